@@ -0,0 +1,312 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* parallel_algorithms: parallel_for, parallel_reduce, and parallel_transform
+ *                      on a thread_pool.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STORM_PARALLEL_ALGORITHMS_H
+#define STORM_PARALLEL_ALGORITHMS_H 1
+
+#include <utility>
+#include <functional>
+#include <iterator>
+#include <concepts>
+#include <exception>
+#include <optional>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstddef>
+
+#include "cache_line.hpp"
+
+namespace storm {
+
+	/* How the range gets split into chunks.
+	 *
+	 * static_chunks: one chunk per participant, all the same size. The
+	 *                fewest atomic operations, but one slow chunk holds up
+	 *                everybody.
+	 * guided       : each chunk is a share of what's left, so they start big
+	 *                and shrink toward the end, where balance matters.
+	 * adaptive     : each participant starts at the grain size and resizes
+	 *                its chunks to take about adaptive_chunk_time each,
+	 *                capped at its share of what's left, so cheap bodies get
+	 *                big chunks and expensive ones small chunks without
+	 *                anybody having to pick a grain size.
+	 */
+	enum class chunking {
+		static_chunks,
+		guided,
+		adaptive,
+	};
+
+	// How long adaptive chunking aims for each chunk to take.
+	inline constexpr std::chrono::microseconds adaptive_chunk_time{50};
+
+	struct parallel_options {
+		chunking mode = chunking::adaptive;
+		// The smallest chunk worth handing out.
+		std::size_t grain = 1;
+	};
+
+	namespace detail {
+		// What the participants in one parallel call share.
+		template<typename Body>
+		struct chunk_state {
+			chunk_state(Body &b, const std::size_t size, const std::size_t parts,
+					const parallel_options o) :
+				body(b), n(size), participants(parts), opts(o), remaining(size) {}
+
+			Body &body;
+			const std::size_t n;
+			const std::size_t participants;
+			const parallel_options opts;
+
+			// The next element nobody's claimed. Can run past n.
+			alignas(cache_line_size) std::atomic<std::size_t> next{0};
+			// Elements that haven't been finished or cancelled.
+			alignas(cache_line_size) std::atomic<std::size_t> remaining;
+			std::atomic<bool> failed{false};
+			std::exception_ptr error;
+		};
+
+		// finish: count count elements as done, and wake the caller if
+		// they were the last.
+		template<typename Body>
+		void finish(chunk_state<Body> &s, const std::size_t count){
+			if(count != 0 && s.remaining.fetch_sub(count, std::memory_order_acq_rel) == count)
+				s.remaining.notify_all();
+		}
+
+		/* participate: claim and run chunks until there aren't any left.
+		 *
+		 * Body only gets touched for chunks that are really there, so a
+		 * participant that starts after everything's done just leaves, even
+		 * if the call it was for has already returned.
+		 */
+		template<typename Body>
+		void participate(chunk_state<Body> &s, const std::size_t id){
+			using clock = std::chrono::steady_clock;
+
+			const std::size_t grain = std::max<std::size_t>(1, s.opts.grain);
+			std::size_t size = s.opts.mode == chunking::static_chunks ?
+				std::max(grain, (s.n + s.participants - 1) / s.participants) : grain;
+
+			while(true){
+				std::size_t begin;
+				if(s.opts.mode == chunking::guided){
+					begin = s.next.load(std::memory_order_relaxed);
+					do{
+						if(begin >= s.n)
+							return;
+						size = std::max(grain, (s.n - begin) / (2 * s.participants));
+					}while(!s.next.compare_exchange_weak(begin, begin + size,
+						std::memory_order_relaxed));
+				}else{
+					begin = s.next.fetch_add(size, std::memory_order_relaxed);
+					if(begin >= s.n)
+						return;
+				}
+				const std::size_t end = std::min(s.n, begin + size);
+
+				const clock::time_point start = s.opts.mode == chunking::adaptive ?
+					clock::now() : clock::time_point();
+				try{
+					s.body(id, begin, end);
+				}catch(...){
+					if(!s.failed.exchange(true, std::memory_order_acq_rel))
+						s.error = std::current_exception();
+					// Cancel everything nobody's claimed yet, and count it
+					// as done along with this chunk.
+					const std::size_t claimed = std::min(s.n,
+						s.next.exchange(s.n, std::memory_order_relaxed));
+					finish(s, end - begin + (s.n - claimed));
+					return;
+				}
+
+				if(s.opts.mode == chunking::adaptive){
+					const clock::duration took = clock::now() - start;
+					const std::size_t share = std::max(grain, (s.n - std::min(s.n, end)) / s.participants);
+					if(took < adaptive_chunk_time / 2)
+						size *= 2;
+					else if(took > adaptive_chunk_time * 2)
+						size /= 2;
+					size = std::clamp(size, grain, share);
+				}
+
+				finish(s, end - begin);
+			}
+		}
+
+		/* run_chunks: run body(id, begin, end) over chunks of [0, n) on pool
+		 *             and the calling thread, and wait for all of them.
+		 *
+		 * Each participant is one task, so there are at most pool.size()
+		 * queue operations however big n is. The caller is a participant
+		 * too, so this finishes even if every worker is busy, including when
+		 * it's called from one of the pool's own tasks.
+		 *
+		 * id is the participant, from 0 to the return value, which is how
+		 * many participants there were.
+		 */
+		template<typename Pool, typename Body>
+		std::size_t run_chunks(Pool &pool, const std::size_t n, const parallel_options opts,
+				Body &&body){
+			if(n == 0)
+				return 0;
+
+			const std::size_t grain = std::max<std::size_t>(1, opts.grain);
+			const std::size_t participants = std::min<std::size_t>(pool.size() + 1,
+				(n + grain - 1) / grain);
+
+			// Shared, since helpers might not start until we've returned.
+			const auto s = std::make_shared<chunk_state<std::remove_reference_t<Body>>>(
+				body, n, participants, opts);
+			// If a post fails, the helpers that did get posted still use
+			// body, so we can't leave before they're done. We can do all the
+			// chunks ourselves, though, so carry on and throw afterward.
+			std::exception_ptr post_error;
+			try{
+				for(std::size_t id = 1; id < participants; id++)
+					pool.post([s, id](){ participate(*s, id); });
+			}catch(...){
+				post_error = std::current_exception();
+			}
+			participate(*s, 0);
+
+			std::size_t left = s->remaining.load(std::memory_order_acquire);
+			while(left != 0){
+				s->remaining.wait(left, std::memory_order_acquire);
+				left = s->remaining.load(std::memory_order_acquire);
+			}
+
+			if(s->failed.load(std::memory_order_acquire))
+				std::rethrow_exception(s->error);
+			if(post_error)
+				std::rethrow_exception(post_error);
+			return participants;
+		}
+
+		// at: the ith element after first, or for an index, the ith index.
+		template<std::integral It>
+		It at(const It first, const std::size_t i){
+			return first + It(i);
+		}
+		template<std::random_access_iterator It>
+		decltype(auto) at(const It first, const std::size_t i){
+			return first[std::iter_difference_t<It>(i)];
+		}
+
+		template<typename It>
+		std::size_t distance(const It first, const It last){
+			return last > first ? std::size_t(last - first) : 0;
+		}
+
+		// A partial result that doesn't share a cache line with its
+		// neighbors.
+		template<typename T>
+		struct alignas(cache_line_size) padded_partial {
+			std::optional<T> value;
+		};
+	}
+
+	// Ranges the parallel algorithms work on: indexes, or random-access
+	// iterators.
+	template<typename It>
+	concept parallel_range = std::integral<It> || std::random_access_iterator<It>;
+
+	/* parallel_for: call f on every index in [first, last), or on every
+	 *               element, for iterators, using pool.
+	 *
+	 * The calls can happen in any order, on any thread, including this one.
+	 * If f throws, chunks that haven't started are skipped, and the first
+	 * exception is rethrown here once the ones that have started are done.
+	 */
+	template<typename Pool, parallel_range It, typename F>
+	void parallel_for(Pool &pool, const It first, const It last, F &&f,
+			const parallel_options opts = {}){
+		detail::run_chunks(pool, detail::distance(first, last), opts,
+			[first, &f](std::size_t, const std::size_t begin, const std::size_t end){
+				for(std::size_t i = begin; i < end; i++)
+					std::invoke(f, detail::at(first, i));
+			});
+	}
+
+	/* parallel_reduce: combine transform(x) for every index or element x in
+	 *                  [first, last) with reduce, starting from init.
+	 *
+	 * Like std::reduce, the order things are combined in isn't specified,
+	 * so reduce has to be associative and commutative.
+	 */
+	template<typename Pool, parallel_range It, typename T, typename Reduce, typename Transform>
+		requires std::invocable<Transform&, decltype(detail::at(std::declval<It>(), 0))>
+	[[nodiscard]] T parallel_reduce(Pool &pool, const It first, const It last, T init,
+			Reduce reduce, Transform transform, const parallel_options opts = {}){
+		// One partial result per participant, so they never share one.
+		std::vector<detail::padded_partial<T>> partials(pool.size() + 1);
+
+		const std::size_t participants = detail::run_chunks(pool, detail::distance(first, last), opts,
+			[first, &reduce, &transform, &partials](const std::size_t id,
+					const std::size_t begin, const std::size_t end){
+				std::optional<T> &partial = partials[id].value;
+				std::size_t i = begin;
+				if(!partial)
+					partial.emplace(std::invoke(transform, detail::at(first, i++)));
+				for(; i < end; i++)
+					*partial = std::invoke(reduce, std::move(*partial),
+						std::invoke(transform, detail::at(first, i)));
+			});
+
+		for(std::size_t id = 0; id < participants; id++)
+			if(partials[id].value)
+				init = std::invoke(reduce, std::move(init), std::move(*partials[id].value));
+		return init;
+	}
+
+	// parallel_reduce: the same, without a transform.
+	template<typename Pool, parallel_range It, typename T, typename Reduce>
+	[[nodiscard]] T parallel_reduce(Pool &pool, const It first, const It last, T init,
+			Reduce reduce, const parallel_options opts = {}){
+		return parallel_reduce(pool, first, last, std::move(init), std::move(reduce),
+			std::identity(), opts);
+	}
+
+	/* parallel_transform: set the ith element after d_first to op(x) for
+	 *                     the ith index or element x in [first, last).
+	 *
+	 * d_first has to be random-access, since the elements get written in
+	 * any order.
+	 */
+	template<typename Pool, parallel_range It, std::random_access_iterator OutIt, typename F>
+	OutIt parallel_transform(Pool &pool, const It first, const It last, const OutIt d_first,
+			F &&op, const parallel_options opts = {}){
+		const std::size_t n = detail::distance(first, last);
+		detail::run_chunks(pool, n, opts,
+			[first, d_first, &op](std::size_t, const std::size_t begin, const std::size_t end){
+				for(std::size_t i = begin; i < end; i++)
+					detail::at(d_first, i) = std::invoke(op, detail::at(first, i));
+			});
+		return d_first + std::iter_difference_t<OutIt>(n);
+	}
+
+}
+
+#endif // STORM_PARALLEL_ALGORITHMS_H
@@ -0,0 +1,446 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* task_future: A lightweight promise and future for pool tasks.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STORM_TASK_FUTURE_H
+#define STORM_TASK_FUTURE_H 1
+
+#include <utility>
+#include <functional>
+#include <future>
+#include <exception>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <cstdint>
+
+#include "unique_function.hpp"
+
+namespace storm {
+
+	/* task_executor: somewhere to run continuations, like a thread_pool.
+	 *
+	 * It's just a pointer and a function to post to it, so futures don't
+	 * have to know what kind of pool they came from. An empty one runs
+	 * continuations right away, on whatever thread finished the task.
+	 */
+	struct task_executor {
+		void *target = nullptr;
+		void (*post)(void *target, unique_function<void()> &&t) = nullptr;
+
+		void operator()(unique_function<void()> &&t) const {
+			if(post != nullptr)
+				post(target, std::move(t));
+			else
+				t();
+		}
+	};
+
+	template<typename T>
+	class task_future;
+	template<typename T>
+	class task_promise;
+
+	namespace detail {
+		// What a task_future<void> holds, since it can't hold a void.
+		struct void_result {};
+
+		/* task_state: what a task_promise and its task_future share.
+		 *
+		 * Everything the two sides need to agree on is in one atomic word,
+		 * so finishing a task is one fetch_or, and it only has to make a
+		 * system call if somebody's actually asleep waiting for it. The
+		 * result lives right here, so the whole thing is one allocation.
+		 */
+		template<typename T>
+		class task_state {
+		public:
+			using value_type = std::conditional_t<std::is_void_v<T>, void_result, T>;
+
+			// Bits in flags.
+			static constexpr std::uint32_t ready = 1;   // value or error is set
+			static constexpr std::uint32_t failed = 2;  // and it's error
+			static constexpr std::uint32_t waiting = 4; // somebody's in wait()
+			static constexpr std::uint32_t chained = 8; // continuation is set
+
+			explicit task_state(const task_executor e) noexcept : executor(e) {}
+
+			~task_state(){
+				const std::uint32_t f = flags.load(std::memory_order_relaxed);
+				if(f & failed)
+					error.~exception_ptr();
+				else if(f & ready)
+					value.~value_type();
+			}
+
+			task_state(const task_state&) = delete;
+			task_state& operator=(const task_state&) = delete;
+
+			template<typename... V>
+			void set_value(V&&... v){
+				::new(static_cast<void*>(std::addressof(value))) value_type(std::forward<V>(v)...);
+				complete(ready);
+			}
+
+			void set_exception(std::exception_ptr e){
+				::new(static_cast<void*>(std::addressof(error))) std::exception_ptr(std::move(e));
+				complete(ready | failed);
+			}
+
+			/* set_from: set the value to what f() returns, or the error to
+			 *           what it throws.
+			 *
+			 * Only f and the value's constructor are inside the try, so
+			 * nothing that goes wrong after the value's in place can set
+			 * the error over it.
+			 */
+			template<typename F>
+			void set_from(F &&f){
+				try{
+					if constexpr(std::is_void_v<T>){
+						std::invoke(std::forward<F>(f));
+						::new(static_cast<void*>(std::addressof(value))) value_type();
+					}else{
+						::new(static_cast<void*>(std::addressof(value)))
+							value_type(std::invoke(std::forward<F>(f)));
+					}
+				}catch(...){
+					set_exception(std::current_exception());
+					return;
+				}
+				complete(ready);
+			}
+
+			// chain: run c on the executor once we're ready, or now if we
+			// already are. If the executor throws, c is dropped, since it
+			// holds a reference to us that would otherwise never go away.
+			void chain(unique_function<void()> &&c){
+				continuation = std::move(c);
+				if(flags.fetch_or(chained, std::memory_order_acq_rel) & ready){
+					try{
+						executor(std::move(continuation));
+					}catch(...){
+						continuation = nullptr;
+						throw;
+					}
+				}
+			}
+
+			[[nodiscard]] bool is_ready() const noexcept {
+				return flags.load(std::memory_order_acquire) & ready;
+			}
+
+			[[nodiscard]] bool has_failed() const noexcept {
+				return flags.load(std::memory_order_acquire) & failed;
+			}
+
+			void wait() noexcept {
+				std::uint32_t f = flags.load(std::memory_order_acquire);
+				if(f & ready)
+					return;
+
+				// Let complete() know it has to wake us.
+				f = flags.fetch_or(waiting, std::memory_order_acq_rel) | waiting;
+				while(!(f & ready)){
+					flags.wait(f, std::memory_order_acquire);
+					f = flags.load(std::memory_order_acquire);
+				}
+			}
+
+			// take: move the result out, or throw the error. We have to be
+			// ready.
+			value_type take(){
+				if(has_failed())
+					std::rethrow_exception(error);
+				return std::move(value);
+			}
+
+			// error_ptr: what the task threw. We have to have failed.
+			[[nodiscard]] std::exception_ptr error_ptr() const noexcept {
+				return error;
+			}
+
+			// The promise and the future each hold a reference.
+			void release() noexcept {
+				if(refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+					delete this;
+			}
+
+			const task_executor executor;
+
+		private:
+			void complete(const std::uint32_t bits) noexcept {
+				const std::uint32_t before = flags.fetch_or(bits, std::memory_order_acq_rel);
+				// The promise still holds its reference, so we can't have
+				// been deleted out from under this, even if a waiter has
+				// already seen ready and left.
+				if(before & waiting)
+					flags.notify_all();
+				if(before & chained){
+					// We're already set, so there's nobody to tell if the
+					// executor can't take the continuation. Dropping it
+					// breaks the promise it holds, so the future then()
+					// returned throws broken_promise instead of waiting
+					// forever.
+					try{
+						executor(std::move(continuation));
+					}catch(...){
+						continuation = nullptr;
+					}
+				}
+			}
+
+			std::atomic<std::uint32_t> flags{0};
+			std::atomic<std::uint32_t> refs{2};
+			union {
+				value_type value;
+				std::exception_ptr error;
+			};
+			unique_function<void()> continuation;
+		};
+
+		// What a continuation taking a T returns.
+		template<typename F, typename T>
+		struct then_result {
+			using type = std::invoke_result_t<F, T>;
+		};
+		template<typename F>
+		struct then_result<F, void> {
+			using type = std::invoke_result_t<F>;
+		};
+	}
+
+	/* task_future: the result of a task, some time in the future.
+	 *
+	 * Like std::future, but a lot cheaper: there's no mutex or condition
+	 * variable, just an atomic word that waiting blocks on with
+	 * std::atomic::wait (a futex, on Linux), and the result is stored right
+	 * in the shared state. Destroying one never blocks, even if the task
+	 * hasn't finished.
+	 *
+	 * then() chains on another task, which runs on the same executor as
+	 * this one once it's done.
+	 */
+	template<typename T>
+	class task_future {
+		static_assert(!std::is_reference_v<T>, "task_future can't hold a reference");
+
+	public:
+		task_future() noexcept = default;
+
+		task_future(task_future &&other) noexcept :
+			state(std::exchange(other.state, nullptr)) {}
+
+		task_future& operator=(task_future &&other) noexcept {
+			if(this != &other){
+				reset();
+				state = std::exchange(other.state, nullptr);
+			}
+			return *this;
+		}
+
+		~task_future(){
+			reset();
+		}
+
+		task_future(const task_future&) = delete;
+		task_future& operator=(const task_future&) = delete;
+
+		// valid: whether we have a result coming, or get() or then() has
+		// already taken it.
+		[[nodiscard]] bool valid() const noexcept {
+			return state != nullptr;
+		}
+
+		// is_ready: whether get() would return right away.
+		[[nodiscard]] bool is_ready() const {
+			return checked().is_ready();
+		}
+
+		void wait() const {
+			checked().wait();
+		}
+
+		/* get: wait for the result, and return it, or throw what the task
+		 *      threw.
+		 *
+		 * Like std::future, this leaves us invalid.
+		 */
+		T get(){
+			checked().wait();
+			// Let go of the state however we leave.
+			const task_future done(std::move(*this));
+			if constexpr(std::is_void_v<T>)
+				done.state->take();
+			else
+				return done.state->take();
+		}
+
+		/* then: run f on our result once it's ready, and get a future for
+		 *       what f returns.
+		 *
+		 * f gets the value (or nothing, for void), and runs on the same
+		 * executor as the task it's chained on. If the task threw, f is
+		 * skipped, and the returned future throws the same thing.
+		 *
+		 * Like get(), this leaves us invalid.
+		 */
+		template<typename F>
+		[[nodiscard]] task_future<typename detail::then_result<std::decay_t<F>, T>::type>
+		then(F &&f){
+			using R = typename detail::then_result<std::decay_t<F>, T>::type;
+
+			detail::task_state<T> &s = checked();
+			task_promise<R> p(s.executor);
+			task_future<R> next = p.get_future();
+			// The continuation lives in our state, and holds our reference
+			// to it until it runs.
+			s.chain([self = std::move(*this), p = std::move(p), f = std::forward<F>(f)]() mutable {
+				if(self.state->has_failed()){
+					p.set_exception(self.state->error_ptr());
+				}else if constexpr(std::is_void_v<T>){
+					p.set_from(std::move(f));
+				}else{
+					p.set_from([&f, &self]() -> R {
+						return std::invoke(std::move(f), self.state->take());
+					});
+				}
+				// Drop our reference here, since the state is what owns us.
+				self.reset();
+			});
+			return next;
+		}
+
+	private:
+		friend class task_promise<T>;
+		template<typename U>
+		friend class task_future;
+
+		explicit task_future(detail::task_state<T> *s) noexcept : state(s) {}
+
+		detail::task_state<T> &checked() const {
+			if(state == nullptr)
+				throw std::future_error(std::future_errc::no_state);
+			return *state;
+		}
+
+		void reset() noexcept {
+			if(state != nullptr)
+				std::exchange(state, nullptr)->release();
+		}
+
+		detail::task_state<T> *state = nullptr;
+	};
+
+	/* task_promise: the other end of a task_future, for whoever runs the
+	 *               task.
+	 *
+	 * A promise that's destroyed without a result sets a
+	 * std::future_error(broken_promise), so nobody waits forever.
+	 */
+	template<typename T>
+	class task_promise {
+		static_assert(!std::is_reference_v<T>, "task_promise can't hold a reference");
+
+	public:
+		/* Constructor.
+		 *
+		 * executor: where continuations chained on our future run. Empty
+		 *           runs them on whatever thread sets our result.
+		 */
+		explicit task_promise(const task_executor executor = {}) :
+			state(new detail::task_state<T>(executor)) {}
+
+		task_promise(task_promise &&other) noexcept :
+			state(std::exchange(other.state, nullptr)),
+			future_taken(other.future_taken) {}
+
+		task_promise& operator=(task_promise &&other) noexcept {
+			if(this != &other){
+				reset();
+				state = std::exchange(other.state, nullptr);
+				future_taken = other.future_taken;
+			}
+			return *this;
+		}
+
+		~task_promise(){
+			reset();
+		}
+
+		task_promise(const task_promise&) = delete;
+		task_promise& operator=(const task_promise&) = delete;
+
+		// get_future: our future. There's only one, so only call this once.
+		[[nodiscard]] task_future<T> get_future(){
+			if(state == nullptr)
+				throw std::future_error(std::future_errc::no_state);
+			if(future_taken)
+				throw std::future_error(std::future_errc::future_already_retrieved);
+			future_taken = true;
+			return task_future<T>(state);
+		}
+
+		template<typename... V>
+		void set_value(V&&... v){
+			finish().set_value(std::forward<V>(v)...);
+			reset();
+		}
+
+		void set_exception(std::exception_ptr e){
+			finish().set_exception(std::move(e));
+			reset();
+		}
+
+		// set_from: set our result to whatever f() returns, or throws.
+		template<typename F>
+		void set_from(F &&f){
+			finish().set_from(std::forward<F>(f));
+			reset();
+		}
+
+	private:
+		// finish: our state, as long as nobody's set it yet.
+		detail::task_state<T> &finish(){
+			if(state == nullptr)
+				throw std::future_error(std::future_errc::promise_already_satisfied);
+			return *state;
+		}
+
+		void reset() noexcept {
+			if(state == nullptr)
+				return;
+			detail::task_state<T> *s = std::exchange(state, nullptr);
+			if(!s->is_ready())
+				s->set_exception(std::make_exception_ptr(
+					std::future_error(std::future_errc::broken_promise)));
+			// If nobody took the future, its reference is ours too.
+			if(!future_taken)
+				s->release();
+			s->release();
+		}
+
+		detail::task_state<T> *state;
+		bool future_taken = false;
+	};
+
+}
+
+#endif // STORM_TASK_FUTURE_H
@@ -0,0 +1,168 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* task_group: Fork-join on a thread_pool, helping while waiting.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STORM_TASK_GROUP_H
+#define STORM_TASK_GROUP_H 1
+
+#include <utility>
+#include <functional>
+#include <exception>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <cstddef>
+
+namespace storm {
+
+	/* task_group: a set of tasks on a pool that you can wait for all of,
+	 *             from anywhere, including one of the pool's own tasks.
+	 *
+	 * Pool: the pool the tasks run on, like a thread_pool. It needs post()
+	 *       and try_run_one().
+	 *
+	 * Waiting on a std::future from a pool task ties up a worker until the
+	 * future is ready, so recursive fork-join runs out of workers and
+	 * deadlocks as soon as it's deeper than the pool is wide. wait() runs
+	 * whatever's in the pool's queue instead, which is usually our own
+	 * tasks, or whatever's holding them up. When the queue's empty, it
+	 * sleeps, but only for a little while at a time, since our tasks can
+	 * post more that it could help with, and nothing tells us when they do.
+	 *
+	 * The flip side is that a waiting thread can pick up any task, so a
+	 * wait() can take as long as some unrelated task does, and the stack
+	 * gets as deep as the waits nest.
+	 */
+	template<typename Pool>
+	class task_group {
+	public:
+		explicit task_group(Pool &p) :
+			pool(p), state(std::make_shared<shared_state>()) {}
+
+		// Waits for anything that's still running, but drops its exception,
+		// so call wait() if you care.
+		~task_group(){
+			help_until_done();
+		}
+
+		// Waiting needs the pool and the state both, so we can't be copied or
+		// moved.
+		task_group(const task_group&) = delete;
+		task_group(task_group&&) = delete;
+		task_group& operator=(const task_group&) = delete;
+		task_group& operator=(task_group&&) = delete;
+
+		/* run: run f() on the pool, as part of this group.
+		 *
+		 * If f throws, wait() throws the first exception any of the
+		 * group's tasks threw.
+		 */
+		template<typename F>
+		void run(F &&f){
+			state->pending.fetch_add(1, std::memory_order_relaxed);
+			try{
+				// The task holds its own reference to the state, so it can
+				// still notify after the waiter has seen it finish and
+				// destroyed us.
+				pool.post([s = state, f = std::forward<F>(f)]() mutable {
+					try{
+						std::invoke(f);
+					}catch(...){
+						if(!s->failed.exchange(true, std::memory_order_acq_rel))
+							s->error = std::current_exception();
+					}
+					s->finish_one();
+				});
+			}catch(...){
+				// It never made it onto the pool, so don't wait for it.
+				state->finish_one();
+				throw;
+			}
+		}
+
+		/* wait: run tasks off the pool's queue until all of ours have
+		 *       finished, then throw what the first one that threw threw,
+		 *       if any did.
+		 *
+		 * The group can be reused after this.
+		 */
+		void wait(){
+			help_until_done();
+			if(state->failed.exchange(false, std::memory_order_acq_rel))
+				std::rethrow_exception(std::exchange(state->error, nullptr));
+		}
+
+	private:
+		// What our tasks share with us.
+		struct shared_state {
+			// Tasks that have been run but haven't finished yet.
+			std::atomic<std::size_t> pending{0};
+			std::atomic<bool> failed{false};
+			std::exception_ptr error;
+			// For the waiter to sleep on between looks at the queue.
+			std::mutex lock;
+			std::condition_variable done;
+
+			// finish_one: count one task as finished, and wake the waiter
+			// if it was the last.
+			void finish_one() noexcept {
+				if(pending.fetch_sub(1, std::memory_order_acq_rel) == 1){
+					// Passing through the lock means a waiter that's seen
+					// pending above 0 is either asleep already, or will see
+					// it at 0 before it goes to sleep.
+					{
+						const std::lock_guard<std::mutex> l(lock);
+					}
+					done.notify_all();
+				}
+			}
+		};
+
+		// How long help_until_done() sleeps with nothing to do before it
+		// looks at the queue again. It starts short, and doubles up to the
+		// longest each time it finds nothing.
+		static constexpr std::chrono::microseconds shortest_nap{10};
+		static constexpr std::chrono::microseconds longest_nap{1000};
+
+		void help_until_done() noexcept {
+			std::chrono::microseconds nap = shortest_nap;
+			while(state->pending.load(std::memory_order_acquire) != 0){
+				if(pool.try_run_one()){
+					nap = shortest_nap;
+					continue;
+				}
+
+				std::unique_lock<std::mutex> l(state->lock);
+				state->done.wait_for(l, nap, [this](){
+					return state->pending.load(std::memory_order_acquire) == 0;
+				});
+				nap = std::min(nap * 2, longest_nap);
+			}
+		}
+
+		Pool &pool;
+		const std::shared_ptr<shared_state> state;
+	};
+
+}
+
+#endif // STORM_TASK_GROUP_H
@@ -0,0 +1,235 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* thread_pool: A pool of worker threads fed by one of the mpmc queues.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STORM_THREAD_POOL_H
+#define STORM_THREAD_POOL_H 1
+
+#include <utility>
+#include <functional>
+#include <thread>
+#include <vector>
+#include <optional>
+#include <atomic>
+#include <type_traits>
+#include <algorithm>
+#include <cstddef>
+
+#include "mpmc_queue.hpp"
+#include "unique_function.hpp"
+#include "task_future.hpp"
+
+namespace storm {
+
+	/* thread_pool: a fixed set of worker threads that run tasks off of a
+	 *              shared queue.
+	 *
+	 * Queue: the queue engine that feeds the workers, like mpmc_queue (the
+	 *        default) or mpmc_semaphore_queue.
+	 *
+	 * There's one queue for all the workers, so tasks start in about the
+	 * order they were submitted, whoever submits them, and an idle worker
+	 * blocks in the queue's pop_wait() like any other consumer.
+	 *
+	 * submit() hands back a task_future for the task's result, or whatever
+	 * it threw, and continuations chained on that with then() run on the
+	 * pool too. post() is for fire-and-forget tasks, which have nowhere to
+	 * put an exception, so one that throws calls std::terminate(), same as a
+	 * std::thread would.
+	 *
+	 * Destroying the pool drains it first, so everything that was submitted,
+	 * including whatever those tasks submit in turn, gets run.
+	 */
+	template<template<typename> typename Queue = mpmc_queue>
+	class thread_pool {
+	public:
+		// What goes in the queue. Most closures fit in its buffer, so posting
+		// one doesn't allocate anything but the queue's own storage.
+		using task = unique_function<void()>;
+
+		/* Constructor.
+		 *
+		 * threads: how many workers to start. 0 means one per hardware
+		 *          thread, or one if we can't tell how many there are.
+		 */
+		explicit thread_pool(unsigned threads = 0){
+			if(threads == 0)
+				threads = std::max(1u, std::thread::hardware_concurrency());
+
+			workers.reserve(threads);
+			for(unsigned i = 0; i < threads; i++)
+				workers.emplace_back([this](){ work(); });
+		}
+
+		~thread_pool(){
+			drain();
+
+			// An empty task tells a worker to stop, and post() never lets
+			// one in otherwise.
+			for(std::size_t i = 0; i < workers.size(); i++)
+				q.push(task());
+			// The workers are jthreads, so they get joined on the way out.
+		}
+
+		// The workers point back at us, so we can't be copied or moved.
+		thread_pool(const thread_pool&) = delete;
+		thread_pool(thread_pool&&) = delete;
+		thread_pool& operator=(const thread_pool&) = delete;
+		thread_pool& operator=(thread_pool&&) = delete;
+
+		/* post: run f() on a worker, and don't wait for it or tell anybody
+		 *       when it's done, except drain().
+		 *
+		 * An empty f, like a default-constructed task, is ignored.
+		 */
+		template<typename F>
+		void post(F &&f){
+			task t(std::forward<F>(f));
+			if(!t)
+				return;
+
+			outstanding.fetch_add(1, std::memory_order_relaxed);
+			try{
+				q.push(std::move(t));
+			}catch(...){
+				// It never went in, so don't leave drain() waiting for it.
+				finished();
+				throw;
+			}
+		}
+
+		/* post_bulk: post every task in [first, last), moving them out of
+		 *            the range.
+		 *
+		 * This is the same as posting them one at a time, except that drain()
+		 * can't see any of them finished until it knows about all of them.
+		 */
+		template<typename InputIt>
+		void post_bulk(InputIt first, InputIt last){
+			// Hold one count for the batch, so outstanding can't hit 0 while
+			// we're still pushing.
+			outstanding.fetch_add(1, std::memory_order_relaxed);
+			try{
+				for(; first != last; ++first)
+					post(std::move(*first));
+			}catch(...){
+				finished();
+				throw;
+			}
+			finished();
+		}
+
+		/* submit: run f(args...) on a worker, and get a future for what it
+		 *         returns or throws.
+		 *
+		 * f and args are decay-copied, like std::thread and std::async do.
+		 */
+		template<typename F, typename... Args>
+		[[nodiscard]] task_future<std::invoke_result_t<std::decay_t<F>, std::decay_t<Args>...>>
+		submit(F &&f, Args&&... args){
+			using R = std::invoke_result_t<std::decay_t<F>, std::decay_t<Args>...>;
+
+			task_promise<R> p(executor());
+			task_future<R> result = p.get_future();
+			post([p = std::move(p), f = std::forward<F>(f), ...args = std::forward<Args>(args)]() mutable {
+				p.set_from([&](){ return std::invoke(std::move(f), std::move(args)...); });
+			});
+			return result;
+		}
+
+		// executor: us, as somewhere for task_futures to run continuations.
+		[[nodiscard]] task_executor executor() noexcept {
+			return task_executor{this, [](void *pool, task &&t){
+				static_cast<thread_pool*>(pool)->post(std::move(t));
+			}};
+		}
+
+		/* drain: wait until every task that's been submitted so far has
+		 *        finished, along with anything they submitted.
+		 *
+		 * If tasks keep submitting more tasks forever, this waits forever.
+		 * Don't call it from one of the pool's own tasks, since then it's
+		 * waiting for itself.
+		 */
+		void drain(){
+			std::size_t left = outstanding.load(std::memory_order_acquire);
+			while(left != 0){
+				outstanding.wait(left, std::memory_order_acquire);
+				left = outstanding.load(std::memory_order_acquire);
+			}
+		}
+
+		/* try_run_one: run a task that's waiting in the queue, right here on
+		 *              this thread, if there is one.
+		 *
+		 * Returns whether it ran anything. This is for threads that are
+		 * waiting on other tasks, like task_group::wait(), so they can help
+		 * instead of sitting on a worker. A posted task that throws calls
+		 * std::terminate(), same as it would on a worker.
+		 */
+		bool try_run_one() noexcept {
+			std::optional<task> t = q.try_pop();
+			if(!t)
+				return false;
+			if(!*t){
+				// That's a worker's stop, so leave it for them.
+				q.push(std::move(*t));
+				return false;
+			}
+
+			(*t)();
+			finished();
+			return true;
+		}
+
+		// size: how many worker threads there are.
+		[[nodiscard]] std::size_t size() const noexcept {
+			return workers.size();
+		}
+
+	private:
+		// finished: count one task as done, and wake drain() if that was the
+		// last one.
+		void finished(){
+			if(outstanding.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				outstanding.notify_all();
+		}
+
+		// work: what each worker does until it gets an empty task.
+		void work(){
+			while(true){
+				task t = q.pop_wait();
+				if(!t)
+					return;
+
+				t();
+				finished();
+			}
+		}
+
+		Queue<task> q;
+		// Tasks that have been posted but haven't finished yet.
+		std::atomic<std::size_t> outstanding{0};
+		// Last, so they're stopped and joined before anything else goes away.
+		std::vector<std::jthread> workers;
+	};
+
+}
+
+#endif // STORM_THREAD_POOL_H
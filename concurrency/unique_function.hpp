@@ -0,0 +1,220 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* unique_function: A move-only std::function with a small buffer.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STORM_UNIQUE_FUNCTION_H
+#define STORM_UNIQUE_FUNCTION_H 1
+
+#include <utility>
+#include <functional>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <cstddef>
+
+#include "cache_line.hpp"
+
+namespace storm {
+
+	namespace detail {
+		template<typename F>
+		struct is_std_function : std::false_type {};
+		template<typename Signature>
+		struct is_std_function<std::function<Signature>> : std::true_type {};
+	}
+
+	/* unique_function: a type-erased callable like std::function, except
+	 *                  that it only has to be movable, and it keeps
+	 *                  callables up to InlineSize bytes inside itself
+	 *                  instead of allocating.
+	 *
+	 * Signature : the call signature, like void() or int(int).
+	 * InlineSize: how many bytes of callable fit without allocating. The
+	 *             default makes the whole thing exactly one cache line.
+	 *
+	 * A callable only goes inline if it fits, isn't over-aligned, and can be
+	 * moved without throwing, since moving a unique_function never throws.
+	 * Anything else goes on the heap, same as std::function would do.
+	 *
+	 * Calling is non-const, so callables with mutable state work, and calling
+	 * an empty one throws std::bad_function_call.
+	 */
+	template<typename Signature, std::size_t InlineSize = cache_line_size - sizeof(void*)>
+	class unique_function;
+
+	template<typename R, typename... Args, std::size_t InlineSize>
+	class unique_function<R(Args...), InlineSize> {
+		// Anything that doesn't fit goes on the heap, and then the buffer
+		// holds a pointer to it.
+		static_assert(InlineSize >= sizeof(void*), "the buffer has to fit at least a pointer");
+
+	public:
+		static constexpr std::size_t inline_size = InlineSize;
+
+		// stores_inline: whether an F would go in the buffer.
+		template<typename F>
+		static constexpr bool stores_inline =
+			sizeof(F) <= InlineSize &&
+			alignof(F) <= alignof(std::max_align_t) &&
+			std::is_nothrow_move_constructible_v<F>;
+
+		unique_function() noexcept = default;
+		unique_function(std::nullptr_t) noexcept {}
+
+		/* Constructor from any callable.
+		 *
+		 * Null function pointers and empty std::functions make an empty
+		 * unique_function, like they would an empty std::function.
+		 */
+		template<typename F, typename D = std::decay_t<F>>
+			requires (!std::is_same_v<D, unique_function> && std::is_invocable_r_v<R, D&, Args...>)
+		unique_function(F &&f){
+			if constexpr(std::is_pointer_v<D> || std::is_member_pointer_v<D> ||
+					detail::is_std_function<D>::value){
+				if(!f)
+					return;
+			}
+
+			if constexpr(stores_inline<D>){
+				::new(static_cast<void*>(storage)) D(std::forward<F>(f));
+			}else{
+				::new(static_cast<void*>(storage)) D*(new D(std::forward<F>(f)));
+			}
+			vtable = &ops_for<D>;
+		}
+
+		unique_function(unique_function &&other) noexcept {
+			take(other);
+		}
+
+		unique_function& operator=(unique_function &&other) noexcept {
+			if(this != &other){
+				reset();
+				take(other);
+			}
+			return *this;
+		}
+
+		unique_function& operator=(std::nullptr_t) noexcept {
+			reset();
+			return *this;
+		}
+
+		~unique_function(){
+			reset();
+		}
+
+		// Only movable, that's the point.
+		unique_function(const unique_function&) = delete;
+		unique_function& operator=(const unique_function&) = delete;
+
+		explicit operator bool() const noexcept {
+			return vtable != nullptr;
+		}
+
+		R operator()(Args... args){
+			if(vtable == nullptr)
+				throw std::bad_function_call();
+			return vtable->invoke(storage, std::forward<Args>(args)...);
+		}
+
+		void swap(unique_function &other) noexcept {
+			unique_function tmp(std::move(other));
+			other = std::move(*this);
+			*this = std::move(tmp);
+		}
+
+	private:
+		// What we know how to do with whatever's in storage.
+		struct operations {
+			R (*invoke)(void *storage, Args&&... args);
+			// Move-construct into dst from src, and destroy src.
+			void (*relocate)(void *dst, void *src) noexcept;
+			void (*destroy)(void *storage) noexcept;
+		};
+
+		// get: the callable in storage, wherever it really lives.
+		template<typename D>
+		static D &get(void *storage) noexcept {
+			if constexpr(stores_inline<D>)
+				return *std::launder(static_cast<D*>(storage));
+			else
+				return **std::launder(static_cast<D**>(storage));
+		}
+
+		template<typename D>
+		static R invoke(void *storage, Args&&... args){
+			if constexpr(std::is_void_v<R>)
+				std::invoke(get<D>(storage), std::forward<Args>(args)...);
+			else
+				return std::invoke(get<D>(storage), std::forward<Args>(args)...);
+		}
+
+		template<typename D>
+		static void relocate(void *dst, void *src) noexcept {
+			if constexpr(stores_inline<D>){
+				D &s = get<D>(src);
+				::new(dst) D(std::move(s));
+				s.~D();
+			}else{
+				// Only the pointer moves.
+				::new(dst) D*(*std::launder(static_cast<D**>(src)));
+			}
+		}
+
+		template<typename D>
+		static void destroy(void *storage) noexcept {
+			if constexpr(stores_inline<D>)
+				get<D>(storage).~D();
+			else
+				delete &get<D>(storage);
+		}
+
+		template<typename D>
+		static constexpr operations ops_for{&invoke<D>, &relocate<D>, &destroy<D>};
+
+		// take: move other's callable into us, leaving it empty. We have to
+		// be empty already.
+		void take(unique_function &other) noexcept {
+			if(other.vtable == nullptr)
+				return;
+			other.vtable->relocate(storage, other.storage);
+			vtable = std::exchange(other.vtable, nullptr);
+		}
+
+		void reset() noexcept {
+			if(vtable != nullptr)
+				std::exchange(vtable, nullptr)->destroy(storage);
+		}
+
+		// The buffer goes first, so it's aligned without any padding in front
+		// of it, and the pointer fills out the rest of the cache line.
+		alignas(std::max_align_t) std::byte storage[InlineSize];
+		const operations *vtable = nullptr;
+	};
+
+	template<typename Signature, std::size_t InlineSize>
+	void swap(unique_function<Signature, InlineSize> &a,
+			unique_function<Signature, InlineSize> &b) noexcept {
+		a.swap(b);
+	}
+
+}
+
+#endif // STORM_UNIQUE_FUNCTION_H
@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* cache_line: The cache line size we pad and align things to.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STORM_CACHE_LINE_H
+#define STORM_CACHE_LINE_H 1
+
+#include <cstddef>
+
+namespace storm {
+
+	/* cache_line_size: how far apart to keep things that different threads
+	 *                  write to, so they don't false-share.
+	 *
+	 * std::hardware_destructive_interference_size would be the obvious
+	 * choice, but GCC warns about using it in headers since its value can
+	 * change with -mtune, which would be an ABI break. 64 is right for
+	 * basically every x86 and most ARM parts we care about, so just use that.
+	 */
+	inline constexpr std::size_t cache_line_size = 64;
+
+}
+
+#endif // STORM_CACHE_LINE_H
@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* latency_histogram: Log-linear histograms for recording latencies.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STORM_LATENCY_HISTOGRAM_H
+#define STORM_LATENCY_HISTOGRAM_H 1
+
+#include <atomic>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+namespace storm {
+
+	namespace detail {
+		/* The bucketing scheme, same idea as HdrHistogram: values below
+		 * 2^histogram_sub_bits each get their own bucket, and every power of
+		 * two above that is split into 2^histogram_sub_bits linear buckets.
+		 * With 5 bits that's about 3% worst-case relative error, over the
+		 * whole range of a std::uint64_t, in 1920 buckets.
+		 */
+		inline constexpr unsigned histogram_sub_bits = 5;
+		inline constexpr std::size_t histogram_sub_count =
+			std::size_t(1) << histogram_sub_bits;
+		inline constexpr std::size_t histogram_buckets =
+			(64 - histogram_sub_bits + 1) * histogram_sub_count;
+
+		// histogram_bucket: which bucket a value goes in.
+		constexpr std::size_t histogram_bucket(std::uint64_t v) noexcept {
+			if(v < histogram_sub_count)
+				return v;
+
+			const unsigned shift = std::bit_width(v) - 1 - histogram_sub_bits;
+			return shift * histogram_sub_count + (v >> shift);
+		}
+
+		// histogram_bucket_high: the biggest value that lands in a bucket.
+		constexpr std::uint64_t histogram_bucket_high(std::size_t i) noexcept {
+			if(i < histogram_sub_count)
+				return i;
+
+			const unsigned shift = i / histogram_sub_count - 1;
+			const std::uint64_t mantissa = i - shift * histogram_sub_count;
+			// For the very top bucket this wraps around to 2^64 - 1, which is
+			// exactly what we want.
+			return ((mantissa + 1) << shift) - 1;
+		}
+	}
+
+	/* log_linear_histogram: a histogram of std::uint64_t values, usually
+	 *                       nanoseconds, with bounded relative error.
+	 *
+	 * This one is plain data and not thread-safe, so give each thread its
+	 * own and merge() them, or use concurrent_log_linear_histogram and take
+	 * a snapshot() of it.
+	 */
+	class log_linear_histogram {
+	public:
+		log_linear_histogram() : counts(detail::histogram_buckets, 0) {}
+
+		// record: add one value.
+		void record(std::uint64_t v) noexcept {
+			counts[detail::histogram_bucket(v)]++;
+			total++;
+			max_seen = std::max(max_seen, v);
+		}
+
+		// merge: add everything from another histogram into this one.
+		void merge(const log_linear_histogram &other) noexcept {
+			for(std::size_t i = 0; i < counts.size(); i++)
+				counts[i] += other.counts[i];
+			total += other.total;
+			max_seen = std::max(max_seen, other.max_seen);
+		}
+
+		// count: how many values were recorded.
+		[[nodiscard]] std::uint64_t count() const noexcept { return total; }
+
+		// max: the biggest value recorded, exactly.
+		[[nodiscard]] std::uint64_t max() const noexcept { return max_seen; }
+
+		/* percentile: the value that p percent of the recorded values are at
+		 *             or below.
+		 *
+		 * p: the percentile, from 0 to 100, so the median is 50 and p99.9 is
+		 *    99.9.
+		 *
+		 * Like HdrHistogram this reports the top of the bucket it lands in,
+		 * so it errs on the high side. Returns 0 if nothing was recorded.
+		 */
+		[[nodiscard]] std::uint64_t percentile(double p) const noexcept {
+			if(total == 0)
+				return 0;
+
+			const double wanted = std::ceil(std::clamp(p, 0.0, 100.0) / 100.0 * double(total));
+			const std::uint64_t target = std::max<std::uint64_t>(1, std::uint64_t(wanted));
+
+			std::uint64_t seen = 0;
+			for(std::size_t i = 0; i < counts.size(); i++){
+				seen += counts[i];
+				if(seen >= target)
+					return std::min(detail::histogram_bucket_high(i), max_seen);
+			}
+
+			return max_seen;
+		}
+
+	private:
+		friend class concurrent_log_linear_histogram;
+
+		std::vector<std::uint64_t> counts;
+		std::uint64_t total = 0;
+		std::uint64_t max_seen = 0;
+	};
+
+	/* concurrent_log_linear_histogram: a lock-free log_linear_histogram that
+	 *                                  any number of threads can record into.
+	 *
+	 * Recording is one relaxed fetch_add on the bucket, plus a CAS on the
+	 * max when a new biggest value shows up, which stops happening pretty
+	 * quickly. Snapshots read each bucket once with no locking, so values
+	 * recorded while one is being taken may or may not show up in it.
+	 */
+	class concurrent_log_linear_histogram {
+	public:
+		concurrent_log_linear_histogram() = default;
+
+		// Atomics aren't copyable or movable, so neither are we.
+		concurrent_log_linear_histogram(const concurrent_log_linear_histogram&) = delete;
+		concurrent_log_linear_histogram(concurrent_log_linear_histogram&&) = delete;
+		concurrent_log_linear_histogram& operator=(const concurrent_log_linear_histogram&) = delete;
+		concurrent_log_linear_histogram& operator=(concurrent_log_linear_histogram&&) = delete;
+
+		// record: add one value.
+		void record(std::uint64_t v) noexcept {
+			counts[detail::histogram_bucket(v)].fetch_add(1, std::memory_order_relaxed);
+
+			std::uint64_t old_max = max_seen.load(std::memory_order_relaxed);
+			while(v > old_max &&
+			      !max_seen.compare_exchange_weak(old_max, v, std::memory_order_relaxed))
+				;
+		}
+
+		// snapshot: copy the counts out into a plain histogram.
+		[[nodiscard]] log_linear_histogram snapshot() const {
+			log_linear_histogram h;
+
+			for(std::size_t i = 0; i < counts.size(); i++){
+				h.counts[i] = counts[i].load(std::memory_order_relaxed);
+				h.total += h.counts[i];
+			}
+			h.max_seen = max_seen.load(std::memory_order_relaxed);
+
+			return h;
+		}
+
+	private:
+		std::array<std::atomic<std::uint64_t>, detail::histogram_buckets> counts{};
+		std::atomic<std::uint64_t> max_seen{0};
+	};
+
+}
+
+#endif // STORM_LATENCY_HISTOGRAM_H
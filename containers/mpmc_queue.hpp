@@ -29,6 +29,8 @@
 #include <optional>
 #include <chrono>
 
+#include "queue_stats.hpp"
+
 namespace storm {
 
 	/* mpmc_queue: a multi-producer multi-consumer queue that blocks consumers
@@ -36,6 +38,8 @@ namespace storm {
 	 *
 	 * T        : the element type, must be movable.
 	 * Container: the underlying container type used in a std::queue
+	 * Stats    : the statistics policy, see queue_stats.hpp. The default,
+	 *            no_queue_stats, keeps none and compiles away entirely.
 	 *
 	 * This is almost the same interface as std::queue, but one thing to note
 	 * is pop() returns by value, so you pop() instead of copying back() then
@@ -52,7 +56,8 @@ namespace storm {
 	 */
 	template<
 		typename T,
-		typename Container = typename std::queue<T>::container_type>
+		typename Container = typename std::queue<T>::container_type,
+		typename Stats = no_queue_stats>
 	class mpmc_queue {
 	public:
 		// Constructor and destructor are default, and not interesting.
@@ -73,8 +78,9 @@ namespace storm {
 		// push: put an element into the queue
 		void push(const T &t){
 			{
-				std::lock_guard<std::shared_mutex> lk(mtx);
+				const auto lk = lock();
 				q.push(t);
+				stats.pushed(q.size());
 				// Release the lock before notifying, since that's more efficient
 				// on most systems.
 			}
@@ -83,8 +89,9 @@ namespace storm {
 		// And the "move into" version of above.
 		void push(T &&t){
 			{
-				std::lock_guard<std::shared_mutex> lk(mtx);
+				const auto lk = lock();
 				q.push(std::move(t));
+				stats.pushed(q.size());
 				// Again, release the lock then notify.
 			}
 			cv.notify_one();
@@ -94,8 +101,9 @@ namespace storm {
 		template<typename... Args>
 		void emplace(Args&&... args){
 			{
-				std::lock_guard<std::shared_mutex> lk(mtx);
+				const auto lk = lock();
 				q.emplace(std::forward<Args>(args)...);
+				stats.pushed(q.size());
 				// Again, release the lock then notify.
 			}
 			cv.notify_one();
@@ -103,25 +111,30 @@ namespace storm {
 
 		// try_pop: try to pop an element if there is one. Does not block.
 		std::optional<T> try_pop(){
-			std::lock_guard<std::shared_mutex> lk(mtx);
+			const auto lk = lock();
 
 			if(q.empty())
 				return std::optional<T>();
 
 			std::optional<T> t(std::move(q.front()));
 			q.pop();
+			stats.popped();
 
 			return t;
 		}
 
 		// pop_wait: wait until there is an element, then pop.
 		T pop_wait(){
-			std::unique_lock<std::shared_mutex> lk(mtx);
+			auto lk = lock();
 
-			cv.wait(lk, [this](){ return !q.empty(); });
+			if(q.empty()){
+				stats.waited();
+				cv.wait(lk, [this](){ return !q.empty(); });
+			}
 
 			T t(std::move(q.front()));
 			q.pop();
+			stats.popped();
 
 			return t;
 		}
@@ -136,13 +149,19 @@ namespace storm {
 		 */
 		template<typename Rep, typename Period>
 		std::optional<T> pop_wait_for(const std::chrono::duration<Rep, Period> &rel_time){
-			std::unique_lock<std::shared_mutex> lk(mtx);
-
-			if(!cv.wait_for(lk, rel_time, [this](){ return !q.empty(); }))
-				return std::optional<T>();
+			auto lk = lock();
+
+			if(q.empty()){
+				stats.waited();
+				if(!cv.wait_for(lk, rel_time, [this](){ return !q.empty(); })){
+					stats.timed_out();
+					return std::optional<T>();
+				}
+			}
 
 			std::optional<T> t(std::move(q.front()));
 			q.pop();
+			stats.popped();
 
 			return t;
 		}
@@ -157,13 +176,19 @@ namespace storm {
 		 */
 		template<typename Clock, typename Duration>
 		std::optional<T> pop_wait_until(const std::chrono::time_point<Clock, Duration> &timeout_time){
-			std::unique_lock<std::shared_mutex> lk(mtx);
-
-			if(!cv.wait_until(lk, timeout_time, [this](){ return !q.empty(); }))
-				return std::optional<T>();
+			auto lk = lock();
+
+			if(q.empty()){
+				stats.waited();
+				if(!cv.wait_until(lk, timeout_time, [this](){ return !q.empty(); })){
+					stats.timed_out();
+					return std::optional<T>();
+				}
+			}
 
 			std::optional<T> t(std::move(q.front()));
 			q.pop();
+			stats.popped();
 
 			return t;
 		}
@@ -188,6 +213,16 @@ namespace storm {
 			return q.size();
 		}
 
+		/* stats_snapshot: return a copy of the statistics counters.
+		 *
+		 * With the default no_queue_stats this is always all zeroes. See
+		 * queue_stats.hpp for which counters are consistent with each other.
+		 */
+		[[nodiscard]] queue_stats_snapshot stats_snapshot() const {
+			std::shared_lock<std::shared_mutex> lk(mtx);
+			return stats.snapshot();
+		}
+
 		/* swap: swap the queues, atomically, while being careful of waiters.
 		 *
 		 * So this is an interesting one, and I'm not sure it'd ever really be
@@ -202,6 +237,9 @@ namespace storm {
 		 * and the locking throws, we std::terminate(). AFAIK that only happens
 		 * in situations that are already UB, or in some versions of Windows
 		 * if it's lazily allocating and fails.
+		 *
+		 * The statistics stay with each queue object rather than following the
+		 * elements, so the high-water marks don't get swapped.
 		 */
 		void swap(mpmc_queue &other) noexcept(noexcept(q.swap(other.q))) {
 			// Grab the lock in an extra scope so we release it before
@@ -229,6 +267,25 @@ namespace storm {
 
 	private:
 
+		/* lock: lock the mutex exclusively, and tell the stats if we had to
+		 *       wait for it.
+		 *
+		 * Counting contention takes a try_lock() first, so only do that if
+		 * we're actually keeping stats.
+		 */
+		std::unique_lock<std::shared_mutex> lock(){
+			if constexpr(Stats::enabled){
+				std::unique_lock<std::shared_mutex> lk(mtx, std::try_to_lock);
+				if(!lk.owns_lock()){
+					lk.lock();
+					stats.lock_contended();
+				}
+				return lk;
+			}else{
+				return std::unique_lock<std::shared_mutex>(mtx);
+			}
+		}
+
 		// The mutex that protects all of this.
 		// It's mutable because we have const member functions.
 		mutable std::shared_mutex mtx;
@@ -238,11 +295,14 @@ namespace storm {
 
 		// The queue we're using to store stuff.
 		std::queue<T, Container> q;
+
+		// The statistics, which take no space if we aren't keeping any.
+		[[no_unique_address]] Stats stats;
 	};
 
 	// swap as an overload of std::swap.
-	template<typename T, typename C>
-	void swap(mpmc_queue<T, C> &lhs, mpmc_queue<T, C> &rhs)
+	template<typename T, typename C, typename S>
+	void swap(mpmc_queue<T, C, S> &lhs, mpmc_queue<T, C, S> &rhs)
 			noexcept(noexcept(lhs.swap(rhs))) {
 		lhs.swap(rhs);
 	}
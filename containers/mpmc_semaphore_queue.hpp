@@ -28,6 +28,9 @@
 #include <semaphore>
 #include <optional>
 #include <chrono>
+#include <limits>
+
+#include "queue_stats.hpp"
 
 namespace storm {
 
@@ -37,6 +40,8 @@ namespace storm {
 	 *
 	 * T        : the element type, must be movable.
 	 * Container: the underlying container type used in a std::queue
+	 * Stats    : the statistics policy, see queue_stats.hpp. The default,
+	 *            no_queue_stats, keeps none and compiles away entirely.
 	 *
 	 * This is almost the same interface as std::queue, but one thing to note
 	 * is pop() returns by value, so you pop() instead of copying back() then
@@ -57,7 +62,8 @@ namespace storm {
 	 */
 	template<
 		typename T,
-		typename Container = typename std::queue<T>::container_type>
+		typename Container = typename std::queue<T>::container_type,
+		typename Stats = no_queue_stats>
 	class mpmc_semaphore_queue {
 	public:
 		// Constructor and destructor are (almost) default, and not
@@ -79,8 +85,9 @@ namespace storm {
 		// push: put an element into the queue
 		void push(const T &t){
 			{
-				std::lock_guard<std::shared_mutex> lk(mtx);
+				const auto lk = lock();
 				q.push(t);
+				stats.pushed(q.size());
 				// Release the lock before notifying, since that's more efficient
 				// on most systems.
 			}
@@ -89,8 +96,9 @@ namespace storm {
 		// And the "move into" version of above.
 		void push(T &&t){
 			{
-				std::lock_guard<std::shared_mutex> lk(mtx);
+				const auto lk = lock();
 				q.push(std::move(t));
+				stats.pushed(q.size());
 				// Again, release the lock then notify.
 			}
 			available.release();
@@ -100,8 +108,9 @@ namespace storm {
 		template<typename... Args>
 		void emplace(Args&&... args){
 			{
-				std::lock_guard<std::shared_mutex> lk(mtx);
+				const auto lk = lock();
 				q.emplace(std::forward<Args>(args)...);
+				stats.pushed(q.size());
 				// Again, release the lock then notify.
 			}
 			available.release();
@@ -110,28 +119,39 @@ namespace storm {
 		// try_pop: try to pop an element if there is one. Does not block.
 		std::optional<T> try_pop(){
 			// Try to grab from the semaphore.
-			if(available.try_acquire())
+			if(!available.try_acquire())
 				return std::optional<T>();
 
 			// We got permission to take one, but we need the lock.
-			std::lock_guard<std::shared_mutex> lk(mtx);
+			const auto lk = lock();
 
 			std::optional<T> t(std::move(q.front()));
 			q.pop();
+			stats.popped();
 
 			return t;
 		}
 
 		// pop_wait: wait until there is an element, then pop.
 		T pop_wait(){
-			// Grab one count from the semaphore.
-			available.acquire();
+			// Grab one count from the semaphore, noting if we had to block.
+			// Only try first if we're counting, so no stats doesn't cost an
+			// extra atomic on every pop.
+			if constexpr(Stats::enabled){
+				if(!available.try_acquire()){
+					stats.waited();
+					available.acquire();
+				}
+			}else{
+				available.acquire();
+			}
 
 			// Now we can take one, but we need the lock.
-			std::lock_guard<std::shared_mutex> lk(mtx);
+			const auto lk = lock();
 
 			T t(std::move(q.front()));
 			q.pop();
+			stats.popped();
 
 			return t;
 		}
@@ -146,15 +166,27 @@ namespace storm {
 		 */
 		template<typename Rep, typename Period>
 		std::optional<T> pop_wait_for(const std::chrono::duration<Rep, Period> &rel_time){
-			// Try to get permission to take an element.
-			if(!available.try_acquire_for(rel_time))
-				return std::optional<T>();
+			// Try to get permission to take an element, the same way as
+			// pop_wait().
+			if constexpr(Stats::enabled){
+				if(!available.try_acquire()){
+					stats.waited();
+					if(!available.try_acquire_for(rel_time)){
+						stats.timed_out();
+						return std::optional<T>();
+					}
+				}
+			}else{
+				if(!available.try_acquire_for(rel_time))
+					return std::optional<T>();
+			}
 
 			// Now we can take one, but we need the lock.
-			std::lock_guard<std::shared_mutex> lk(mtx);
+			const auto lk = lock();
 
 			std::optional<T> t(std::move(q.front()));
 			q.pop();
+			stats.popped();
 
 			return t;
 		}
@@ -169,15 +201,27 @@ namespace storm {
 		 */
 		template<typename Clock, typename Duration>
 		std::optional<T> pop_wait_until(const std::chrono::time_point<Clock, Duration> &timeout_time){
-			// Try to get permission to take an element.
-			if(!available.try_acquire_until(timeout_time))
-				return std::optional<T>();
+			// Try to get permission to take an element, the same way as
+			// pop_wait().
+			if constexpr(Stats::enabled){
+				if(!available.try_acquire()){
+					stats.waited();
+					if(!available.try_acquire_until(timeout_time)){
+						stats.timed_out();
+						return std::optional<T>();
+					}
+				}
+			}else{
+				if(!available.try_acquire_until(timeout_time))
+					return std::optional<T>();
+			}
 
 			// Now we can take one, but we need the lock.
-			std::lock_guard<std::shared_mutex> lk(mtx);
+			const auto lk = lock();
 
 			std::optional<T> t(std::move(q.front()));
 			q.pop();
+			stats.popped();
 
 			return t;
 		}
@@ -202,8 +246,37 @@ namespace storm {
 			return q.size();
 		}
 
+		/* stats_snapshot: return a copy of the statistics counters.
+		 *
+		 * With the default no_queue_stats this is always all zeroes. See
+		 * queue_stats.hpp for which counters are consistent with each other.
+		 */
+		[[nodiscard]] queue_stats_snapshot stats_snapshot() const {
+			std::shared_lock<std::shared_mutex> lk(mtx);
+			return stats.snapshot();
+		}
+
 	private:
 
+		/* lock: lock the mutex exclusively, and tell the stats if we had to
+		 *       wait for it.
+		 *
+		 * Counting contention takes a try_lock() first, so only do that if
+		 * we're actually keeping stats.
+		 */
+		std::unique_lock<std::shared_mutex> lock(){
+			if constexpr(Stats::enabled){
+				std::unique_lock<std::shared_mutex> lk(mtx, std::try_to_lock);
+				if(!lk.owns_lock()){
+					lk.lock();
+					stats.lock_contended();
+				}
+				return lk;
+			}else{
+				return std::unique_lock<std::shared_mutex>(mtx);
+			}
+		}
+
 		// Get the max size we can be.
 		static constexpr typename Container::difference_type max_size =
 			std::numeric_limits<typename Container::difference_type>::max();
@@ -219,6 +292,9 @@ namespace storm {
 
 		// The queue we're using to store stuff.
 		std::queue<T, Container> q;
+
+		// The statistics, which take no space if we aren't keeping any.
+		[[no_unique_address]] Stats stats;
 	};
 
 }
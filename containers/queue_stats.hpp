@@ -0,0 +1,168 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* queue_stats: Statistics policies for the mpmc queues.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STORM_QUEUE_STATS_H
+#define STORM_QUEUE_STATS_H 1
+
+#include <atomic>
+#include <array>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#include "cache_line.hpp"
+
+namespace storm {
+
+	// queue_stats_snapshot: a copy of a queue's counters at some instant.
+	struct queue_stats_snapshot {
+		// How many elements went in.
+		std::uint64_t pushes = 0;
+		// How many elements came out.
+		std::uint64_t pops = 0;
+		// How many pops found the queue empty and had to block.
+		std::uint64_t waits = 0;
+		// How many timed pops gave up.
+		std::uint64_t timeouts = 0;
+		// The most elements that were ever in the queue at once.
+		std::uint64_t high_water_mark = 0;
+		// How many times somebody wanted the lock but someone else had it.
+		std::uint64_t lock_contended = 0;
+	};
+
+	/* no_queue_stats: the default statistics policy, which keeps none.
+	 *
+	 * Every hook is an empty inline function, and the queues hold their
+	 * policy as [[no_unique_address]], so this costs nothing in either time
+	 * or space. The queues also check enabled with if constexpr to skip the
+	 * extra work that measuring lock contention needs.
+	 */
+	struct no_queue_stats {
+		static constexpr bool enabled = false;
+
+		void pushed(std::size_t /* depth */) noexcept {}
+		void popped() noexcept {}
+		void waited() noexcept {}
+		void timed_out() noexcept {}
+		void lock_contended() noexcept {}
+
+		[[nodiscard]] queue_stats_snapshot snapshot() const noexcept {
+			return queue_stats_snapshot();
+		}
+	};
+
+	namespace detail {
+		/* this_thread_stripe: a small number that's stable for the life of the
+		 *                     calling thread.
+		 *
+		 * Threads get handed out numbers round-robin the first time they ask,
+		 * so N threads on a queue with at least N stripes never share one.
+		 */
+		inline std::size_t this_thread_stripe() noexcept {
+			static std::atomic<std::size_t> next_stripe(0);
+			thread_local const std::size_t stripe =
+				next_stripe.fetch_add(1, std::memory_order_relaxed);
+			return stripe;
+		}
+	}
+
+	/* striped_queue_stats: a statistics policy that counts everything in
+	 *                      per-thread stripes.
+	 *
+	 * Stripes: how many sets of counters to keep. Each one gets its own cache
+	 *          line, so threads that land on different stripes never touch
+	 *          each other's counters.
+	 *
+	 * The queues call pushed(), popped(), and lock_contended() with their
+	 * mutex held exclusively, and snapshot() takes it shared, so pushes, pops,
+	 * and the high-water mark in a snapshot always agree with each other. The
+	 * waits and timeouts counters are bumped with relaxed atomics wherever the
+	 * wait happens, which for mpmc_semaphore_queue is outside the lock, so
+	 * those can be off by the handful of waits that are in flight.
+	 */
+	template<std::size_t Stripes = 16>
+	class striped_queue_stats {
+	public:
+		static_assert(Stripes > 0, "need at least one stripe");
+
+		static constexpr bool enabled = true;
+
+		void pushed(std::size_t depth) noexcept {
+			stripe &s = this_stripe();
+			s.pushes.fetch_add(1, std::memory_order_relaxed);
+
+			// Only pushes touch the high-water mark, and they all hold the
+			// queue's lock, so this doesn't need to be a CAS loop.
+			if(depth > s.high_water_mark.load(std::memory_order_relaxed))
+				s.high_water_mark.store(depth, std::memory_order_relaxed);
+		}
+		void popped() noexcept {
+			this_stripe().pops.fetch_add(1, std::memory_order_relaxed);
+		}
+		void waited() noexcept {
+			this_stripe().waits.fetch_add(1, std::memory_order_relaxed);
+		}
+		void timed_out() noexcept {
+			this_stripe().timeouts.fetch_add(1, std::memory_order_relaxed);
+		}
+		void lock_contended() noexcept {
+			this_stripe().lock_contended.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		// snapshot: add up all the stripes.
+		[[nodiscard]] queue_stats_snapshot snapshot() const noexcept {
+			queue_stats_snapshot total;
+
+			for(const stripe &s : stripes){
+				total.pushes += s.pushes.load(std::memory_order_relaxed);
+				total.pops += s.pops.load(std::memory_order_relaxed);
+				total.waits += s.waits.load(std::memory_order_relaxed);
+				total.timeouts += s.timeouts.load(std::memory_order_relaxed);
+				total.lock_contended +=
+					s.lock_contended.load(std::memory_order_relaxed);
+				total.high_water_mark = std::max<std::uint64_t>(
+					total.high_water_mark,
+					s.high_water_mark.load(std::memory_order_relaxed));
+			}
+
+			return total;
+		}
+
+	private:
+		// One thread's worth of counters, on its own cache line.
+		struct alignas(cache_line_size) stripe {
+			std::atomic<std::uint64_t> pushes{0};
+			std::atomic<std::uint64_t> pops{0};
+			std::atomic<std::uint64_t> waits{0};
+			std::atomic<std::uint64_t> timeouts{0};
+			std::atomic<std::uint64_t> high_water_mark{0};
+			std::atomic<std::uint64_t> lock_contended{0};
+		};
+
+		stripe &this_stripe() noexcept {
+			return stripes[detail::this_thread_stripe() % Stripes];
+		}
+
+		std::array<stripe, Stripes> stripes;
+	};
+
+}
+
+#endif // STORM_QUEUE_STATS_H
@@ -0,0 +1,218 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* sojourn_queue: An mpmc queue that measures how long elements sit in it.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STORM_SOJOURN_QUEUE_H
+#define STORM_SOJOURN_QUEUE_H 1
+
+#include <utility>
+#include <optional>
+#include <chrono>
+#include <limits>
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#include "mpmc_queue.hpp"
+#include "queue_stats.hpp"
+#include "cache_line.hpp"
+#include "latency_histogram.hpp"
+
+namespace storm {
+
+	/* sojourn_queue: wraps one of the mpmc queues, timestamps elements as
+	 *                they go in, and records how long they were in the queue
+	 *                into a histogram as they come out.
+	 *
+	 * T    : the element type, must be movable.
+	 * Queue: the underlying queue, e.g. mpmc_queue or mpmc_semaphore_queue.
+	 *
+	 * The interface is the same as the queue it wraps, plus
+	 * sojourn_snapshot() to read the histogram. Elements are stored next to
+	 * their timestamp inside the underlying queue, so T doesn't need to know
+	 * anything about this.
+	 *
+	 * Reading the clock is most of the overhead, so you can ask to only
+	 * sample one push in every sample_period. Each queue counts pushes in
+	 * per-thread stripes, like striped_queue_stats, so pushing threads
+	 * don't fight over the count, and queues don't share one. Unsampled
+	 * elements still carry an (empty) timestamp through the queue, but
+	 * never touch the clock or the histogram.
+	 */
+	template<
+		typename T,
+		template<typename> typename Queue = mpmc_queue>
+	class sojourn_queue {
+	public:
+		using clock = std::chrono::steady_clock;
+
+		/* Constructor.
+		 *
+		 * sample_period: record one in every this many pushes. 1 records
+		 *                everything.
+		 */
+		explicit sojourn_queue(unsigned sample_period = 1) :
+			period(sample_period == 0 ? 1 : sample_period) {}
+		~sojourn_queue() = default;
+
+		// The underlying queue isn't copyable or movable, so neither are we.
+		sojourn_queue(const sojourn_queue&) = delete;
+		sojourn_queue(sojourn_queue&&) = delete;
+		sojourn_queue& operator=(const sojourn_queue&) = delete;
+		sojourn_queue& operator=(sojourn_queue&&) = delete;
+
+		// push: put an element into the queue
+		void push(const T &t){
+			q.emplace(stamp(), t);
+		}
+		// And the "move into" version of above.
+		void push(T &&t){
+			q.emplace(stamp(), std::move(t));
+		}
+
+		// emplace: construct an element in-place in the queue.
+		template<typename... Args>
+		void emplace(Args&&... args){
+			q.emplace(stamp(), std::forward<Args>(args)...);
+		}
+
+		// try_pop: try to pop an element if there is one. Does not block.
+		std::optional<T> try_pop(){
+			return unwrap(q.try_pop());
+		}
+
+		// pop_wait: wait until there is an element, then pop.
+		T pop_wait(){
+			stamped s = q.pop_wait();
+			record(s);
+			return std::move(s.value);
+		}
+
+		/* pop_wait_for: wait for up to the given time for there to be an
+		 *               element, then pop, or fail on timeout.
+		 *
+		 * rel_time: how long to wait for before timing out.
+		 */
+		template<typename Rep, typename Period>
+		std::optional<T> pop_wait_for(const std::chrono::duration<Rep, Period> &rel_time){
+			return unwrap(q.pop_wait_for(rel_time));
+		}
+
+		/* pop_wait_until: wait for up to the given time for there to be an
+		 *                 element, then pop, or fail on timeout.
+		 *
+		 * timeout_time: what time to wait until before timing out.
+		 */
+		template<typename Clock, typename Duration>
+		std::optional<T> pop_wait_until(const std::chrono::time_point<Clock, Duration> &timeout_time){
+			return unwrap(q.pop_wait_until(timeout_time));
+		}
+
+		// empty: same as the underlying queue, and just as racy.
+		[[nodiscard]] bool empty() const {
+			return q.empty();
+		}
+
+		// size: same as the underlying queue, and just as racy.
+		[[nodiscard]] auto size() const {
+			return q.size();
+		}
+
+		/* sojourn_snapshot: get a copy of the time-in-queue histogram, in
+		 *                   nanoseconds.
+		 *
+		 * Use percentile(50), percentile(99), percentile(99.9), and max() on
+		 * it for the usual numbers.
+		 */
+		[[nodiscard]] log_linear_histogram sojourn_snapshot() const {
+			return hist.snapshot();
+		}
+
+		// sample_period: one in how many pushes gets recorded.
+		[[nodiscard]] unsigned sample_period() const noexcept {
+			return period;
+		}
+
+	private:
+		using rep = clock::rep;
+
+		// The timestamp for elements that we aren't sampling.
+		static constexpr rep unsampled = std::numeric_limits<rep>::min();
+
+		// An element, and when it went in.
+		struct stamped {
+			template<typename... Args>
+			explicit stamped(rep when, Args&&... args) :
+				pushed_at(when), value(std::forward<Args>(args)...) {}
+
+			rep pushed_at;
+			T value;
+		};
+
+		// stamp: get the timestamp for the next push from this thread.
+		rep stamp(){
+			if(period != 1){
+				std::atomic<std::uint64_t> &pushes = push_counts[
+					detail::this_thread_stripe() % push_counts.size()].pushes;
+				if(pushes.fetch_add(1, std::memory_order_relaxed) % period != 0)
+					return unsampled;
+			}
+
+			return clock::now().time_since_epoch().count();
+		}
+
+		// record: put an element's time in the queue into the histogram.
+		void record(const stamped &s){
+			if(s.pushed_at == unsampled)
+				return;
+
+			const rep now = clock::now().time_since_epoch().count();
+			const auto waited = std::chrono::duration_cast<std::chrono::nanoseconds>(
+				clock::duration(now - s.pushed_at));
+			hist.record(std::uint64_t(waited.count()));
+		}
+
+		// unwrap: record and unwrap the result of one of the optional pops.
+		std::optional<T> unwrap(std::optional<stamped> &&s){
+			if(!s.has_value())
+				return std::optional<T>();
+
+			record(*s);
+			return std::optional<T>(std::move(s->value));
+		}
+
+		// The sampling period.
+		const unsigned period;
+
+		// Pushes so far, for sampling, striped by pushing thread.
+		struct alignas(cache_line_size) push_count {
+			std::atomic<std::uint64_t> pushes{0};
+		};
+		std::array<push_count, 16> push_counts;
+
+		// The histogram of time in queue, in nanoseconds.
+		concurrent_log_linear_histogram hist;
+
+		// The queue we're wrapping.
+		Queue<stamped> q;
+	};
+
+}
+
+#endif // STORM_SOJOURN_QUEUE_H
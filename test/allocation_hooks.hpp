@@ -0,0 +1,69 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* allocation_hooks: The global operator new and delete, replaced to count
+ *                   allocations for the benchmarks.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef STORM_ALLOCATION_HOOKS_H
+#define STORM_ALLOCATION_HOOKS_H 1
+
+/* These aren't inline, and can't be, since the replacements have to be
+ * ordinary functions. So only include this from one file in each program,
+ * the one with main() in it.
+ *
+ * Every allocation goes through count_allocation() and count_free(), for
+ * results like allocs_per_item. The array versions all come through these.
+ */
+
+#include <new>
+#include <cstddef>
+#include <cstdlib>
+
+#include "memory_counters.hpp"
+
+void *operator new(const std::size_t size){
+	storm::test::count_allocation(size);
+	if(void *p = std::malloc(size == 0 ? 1 : size))
+		return p;
+	throw std::bad_alloc();
+}
+void *operator new(const std::size_t size, const std::align_val_t align){
+	storm::test::count_allocation(size);
+	// aligned_alloc wants a multiple of the alignment.
+	const std::size_t a = std::size_t(align);
+	if(void *p = std::aligned_alloc(a, (size + a - 1) / a * a + (size == 0 ? a : 0)))
+		return p;
+	throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept {
+	if(p != nullptr)
+		storm::test::count_free();
+	std::free(p);
+}
+void operator delete(void *p, std::align_val_t) noexcept {
+	if(p != nullptr)
+		storm::test::count_free();
+	std::free(p);
+}
+void operator delete(void *p, std::size_t) noexcept {
+	::operator delete(p);
+}
+void operator delete(void *p, std::size_t, const std::align_val_t align) noexcept {
+	::operator delete(p, align);
+}
+
+#endif /* STORM_ALLOCATION_HOOKS_H */
@@ -0,0 +1,147 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* bench_noise: Noisy neighbors for the benchmarks to run next to.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef STORM_BENCH_NOISE_H
+#define STORM_BENCH_NOISE_H 1
+
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <optional>
+#include <string_view>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "mpmc_test_helpers.hpp"
+#include "cpu_topology.hpp"
+#include "cache_line.hpp"
+
+namespace storm {
+	namespace test {
+
+/* What kind of neighbor to run next to the test.
+ *
+ * none  : nobody, for comparison.
+ * cpu   : threads that do nothing but arithmetic, so the workers have to
+ *         share their CPUs and get preempted, lock holders included.
+ * memory: threads that walk big buffers a cache line at a time, to eat up
+ *         memory bandwidth and evict everybody's caches.
+ */
+enum class noise_kind {
+	none,
+	cpu,
+	memory,
+};
+
+inline const char *noise_kind_name(const noise_kind k){
+	switch(k){
+	case noise_kind::none: return "none";
+	case noise_kind::cpu: return "cpu";
+	case noise_kind::memory: return "memory";
+	}
+	return "?";
+}
+
+inline std::optional<noise_kind> parse_noise_kind(std::string_view name){
+	for(const noise_kind k : {noise_kind::none, noise_kind::cpu, noise_kind::memory})
+		if(name == noise_kind_name(k))
+			return k;
+	return std::nullopt;
+}
+
+// How big each memory hog's buffer is. Bigger than most L2s, and a few of
+// them together are bigger than most LLCs.
+inline constexpr std::size_t memory_hog_bytes = 16 << 20;
+
+// How long to give the neighbors to get going before the test starts.
+inline constexpr std::chrono::milliseconds noise_ramp_time(10);
+
+/* noisy_neighbors: run some hog threads for as long as this is around.
+ *
+ * kind   : what the hogs do.
+ * threads: how many of them.
+ * cpus   : CPUs to pin them to, round-robin, or empty to leave them be.
+ */
+class noisy_neighbors {
+public:
+	noisy_neighbors(const noise_kind kind, const int threads,
+			const std::vector<int> &cpus = std::vector<int>()){
+		if(kind == noise_kind::none)
+			return;
+
+		for(int i = 0; i < threads; i++){
+			const int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+			hogs.emplace_back([this, kind, cpu](){
+				if(cpu >= 0)
+					pin_this_thread(cpu);
+				if(kind == noise_kind::cpu)
+					cpu_hog();
+				else
+					memory_hog();
+			});
+		}
+		std::this_thread::sleep_for(noise_ramp_time);
+	}
+
+	~noisy_neighbors(){
+		stop.store(true, std::memory_order_relaxed);
+	}
+
+	noisy_neighbors(const noisy_neighbors&) = delete;
+	noisy_neighbors(noisy_neighbors&&) = delete;
+	noisy_neighbors& operator=(const noisy_neighbors&) = delete;
+	noisy_neighbors& operator=(noisy_neighbors&&) = delete;
+
+private:
+	void cpu_hog(){
+		std::uint64_t x = 1;
+		while(!stop.load(std::memory_order_relaxed)){
+			// An LCG, so it can't be optimized away or vectorized.
+			for(int i = 0; i < 4096; i++)
+				x = x * 6364136223846793005u + 1442695040888963407u;
+			consume_value_reg(x);
+		}
+	}
+
+	void memory_hog(){
+		static constexpr std::size_t stride = cache_line_size / sizeof(std::uint64_t);
+		// Check for stop every so often, not just once a pass.
+		static constexpr std::size_t chunk = (1 << 20) / sizeof(std::uint64_t);
+
+		std::vector<std::uint64_t> buffer(memory_hog_bytes / sizeof(std::uint64_t));
+		while(true){
+			for(std::size_t start = 0; start < buffer.size(); start += chunk){
+				if(stop.load(std::memory_order_relaxed))
+					return;
+				for(std::size_t i = start; i < start + chunk && i < buffer.size(); i += stride)
+					buffer[i]++;
+				barrier();
+			}
+		}
+	}
+
+	std::atomic<bool> stop{false};
+	// Last, so they're joined before stop goes away.
+	std::vector<std::jthread> hogs;
+};
+
+	}
+}
+#endif /* STORM_BENCH_NOISE_H */
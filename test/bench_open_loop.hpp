@@ -0,0 +1,160 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* bench_open_loop: Open-loop, scheduled-arrival producers for the benchmarks.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef STORM_BENCH_OPEN_LOOP_H
+#define STORM_BENCH_OPEN_LOOP_H 1
+
+#include <thread>
+#include <chrono>
+#include <random>
+#include <optional>
+#include <string_view>
+
+#include "mpmc_test_helpers.hpp"
+
+namespace storm {
+	namespace test {
+
+/* How the producers space out their pushes.
+ *
+ * constant: exactly evenly.
+ * poisson : exponentially distributed gaps, like independent clients.
+ * bursty  : bursts of burst_length items at burst_speedup times the rate,
+ *           then quiet long enough that the average rate comes out the same.
+ */
+enum class arrival_pattern {
+	constant,
+	poisson,
+	bursty,
+};
+
+inline constexpr int burst_length = 100;
+inline constexpr int burst_speedup = 10;
+
+inline const char *arrival_pattern_name(const arrival_pattern p){
+	switch(p){
+	case arrival_pattern::constant: return "constant";
+	case arrival_pattern::poisson: return "poisson";
+	case arrival_pattern::bursty: return "bursty";
+	}
+	return "?";
+}
+
+inline std::optional<arrival_pattern> parse_arrival_pattern(std::string_view name){
+	for(const arrival_pattern p : {arrival_pattern::constant, arrival_pattern::poisson, arrival_pattern::bursty})
+		if(name == arrival_pattern_name(p))
+			return p;
+	return std::nullopt;
+}
+
+/* arrival_schedule: when each push is supposed to happen, as an offset
+ *                   from the start of the test.
+ *
+ * Everything is computed from the start time rather than from when the
+ * last push actually happened, so falling behind doesn't push the rest of
+ * the schedule back.
+ */
+template<arrival_pattern Pattern>
+class arrival_schedule {
+public:
+	using duration = std::chrono::steady_clock::duration;
+
+	// mean_gap: the average time between pushes.
+	explicit arrival_schedule(const duration mean_gap) :
+		gap(mean_gap),
+		rng(std::random_device()()),
+		exponential(1.0) {}
+
+	// next: the offset for the next push.
+	duration next(){
+		const duration when = offset;
+
+		if constexpr(Pattern == arrival_pattern::constant){
+			offset = gap * ++count;
+		}else if constexpr(Pattern == arrival_pattern::poisson){
+			offset += std::chrono::duration_cast<duration>(
+				std::chrono::duration<double, duration::period>(
+					exponential(rng) * double(gap.count())));
+		}else{
+			// Inside a burst everything's close together, and the last one
+			// in a burst waits out the rest of the burst's time.
+			++count;
+			if(count % burst_length != 0)
+				offset += gap / burst_speedup;
+			else
+				offset = gap * count;
+		}
+
+		return when;
+	}
+
+private:
+	const duration gap;
+	duration offset{0};
+	long long count = 0;
+	std::mt19937_64 rng;
+	std::exponential_distribution<double> exponential;
+};
+
+/* pace_until: wait until a deadline, as precisely as we can.
+ *
+ * Sleeping is only good to within tens of microseconds, so sleep until a
+ * little before, then spin the rest of the way.
+ */
+inline void pace_until(const std::chrono::steady_clock::time_point deadline){
+	using clock = std::chrono::steady_clock;
+	static constexpr auto spin_window = std::chrono::microseconds(100);
+
+	if(deadline - clock::now() > spin_window)
+		std::this_thread::sleep_until(deadline - spin_window);
+	while(clock::now() < deadline)
+		cpu_relax();
+}
+
+/* open_loop_producer: push n items on a schedule, no matter how the queue
+ *                     is doing.
+ *
+ * params.delay is the average gap between this producer's pushes. Items are
+ * stamped with when they were _supposed_ to be sent, not when they
+ * actually were, so if we fall behind, the consumers' latencies include it.
+ * That's the fix for coordinated omission: a stalled system can't hide its
+ * stalls by also stalling the load generator.
+ */
+template<typename Queue, typename T, arrival_pattern Pattern>
+static void open_loop_producer(
+		const producer_parameters<Queue, T> params){
+	arrival_schedule<Pattern> schedule(params.delay);
+
+	params.common.setup_done->arrive_and_wait();
+	params.common.start->arrive_and_wait();
+
+	const auto begin = std::chrono::steady_clock::now();
+	for(int i = 0; i < params.common.num_items; i++){
+		const auto intended = begin + schedule.next();
+		pace_until(intended);
+		params.common.q->push(stamp_item(params.default_value, intended));
+		note_progress(*params.common.metrics);
+	}
+
+	params.common.stop->arrive_and_wait();
+}
+
+	}
+}
+#endif /* STORM_BENCH_OPEN_LOOP_H */
@@ -0,0 +1,116 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* bench_ops: Uncontended, single-thread costs of each queue operation.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef STORM_BENCH_OPS_H
+#define STORM_BENCH_OPS_H 1
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#include "mpmc_test_helpers.hpp"
+#include "cycle_clock.hpp"
+
+namespace storm {
+	namespace test {
+
+// What one operation cost, in ticks with the clock's overhead taken off.
+struct op_cost {
+	const char *op;
+	int samples;
+	std::uint64_t min;
+	std::uint64_t p50;
+	std::uint64_t p90;
+	std::uint64_t p99;
+};
+
+namespace detail {
+	/* time_op: time op() samples times, with before() run untimed ahead of
+	 *          each one and after() untimed after.
+	 *
+	 * Every sample is timed on its own, so the percentiles are real
+	 * per-call costs, not averages over a batch.
+	 */
+	template<typename Before, typename Op, typename After>
+	op_cost time_op(const char *name, const int samples, const tick_calibration &cal,
+			Before &&before, Op &&op, After &&after){
+		std::vector<std::uint64_t> ticks;
+		ticks.reserve(samples);
+
+		for(int i = 0; i < samples; i++){
+			before();
+			const std::uint64_t t0 = ticks_start();
+			op();
+			const std::uint64_t t1 = ticks_stop();
+			after();
+
+			const std::uint64_t t = t1 - t0;
+			ticks.push_back(t > cal.overhead ? t - cal.overhead : 0);
+		}
+
+		std::sort(ticks.begin(), ticks.end());
+		const auto at = [&ticks](const double p){
+			return ticks[std::min(ticks.size() - 1, std::size_t(p / 100 * double(ticks.size())))];
+		};
+		return op_cost{name, samples, ticks.front(), at(50), at(90), at(99)};
+	}
+}
+
+/* queue_op_costs: time each of a queue's operations with nobody else
+ *                 around, so they never contend or wait.
+ *
+ * The queue is kept almost empty, like at a typical call site: each push
+ * is undone by a pop after it, and each pop is set up by a push before it,
+ * neither of them timed. size() and empty() are timed with one item in.
+ */
+template<typename Queue, typename T>
+static std::vector<op_cost> queue_op_costs(const int samples, const tick_calibration &cal){
+	Queue q;
+	const T value{};
+	const auto nothing = [](){};
+	const auto push_one = [&q, &value](){ q.push(value); };
+	const auto pop_one = [&q](){
+		[[maybe_unused]] const auto t = q.try_pop();
+		consume_value_reg(t.has_value());
+	};
+
+	std::vector<op_cost> costs;
+	costs.push_back(detail::time_op("push", samples, cal,
+		nothing, push_one, pop_one));
+	costs.push_back(detail::time_op("emplace", samples, cal,
+		nothing, [&q](){ q.emplace(); }, pop_one));
+	costs.push_back(detail::time_op("try_pop_empty", samples, cal,
+		nothing, pop_one, nothing));
+	costs.push_back(detail::time_op("try_pop", samples, cal,
+		push_one, pop_one, nothing));
+
+	push_one();
+	costs.push_back(detail::time_op("size", samples, cal,
+		nothing, [&q](){ consume_value_reg(q.size()); }, nothing));
+	costs.push_back(detail::time_op("empty", samples, cal,
+		nothing, [&q](){ consume_value_reg(q.empty()); }, nothing));
+	pop_one();
+
+	return costs;
+}
+
+	}
+}
+#endif /* STORM_BENCH_OPS_H */
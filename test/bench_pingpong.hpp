@@ -0,0 +1,136 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* bench_pingpong: Round-trip latency benchmark for the mpmc queues.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef STORM_BENCH_PINGPONG_H
+#define STORM_BENCH_PINGPONG_H 1
+
+#include <thread>
+#include <latch>
+#include <vector>
+#include <optional>
+#include <chrono>
+#include <cstdint>
+
+#include "mpmc_test_helpers.hpp"
+#include "latency_histogram.hpp"
+#include "cpu_topology.hpp"
+#include "worker_team.hpp"
+
+namespace storm {
+	namespace test {
+
+// What came out of a ping-pong run.
+struct pingpong_result {
+	std::chrono::steady_clock::duration wall_time;
+	// Round-trip times in nanoseconds, from all the pingers.
+	log_linear_histogram rtt;
+	// Where the threads were pinned, pingers first, or empty.
+	std::vector<int> cpus;
+};
+
+/* ping_pong: bounce tokens back and forth through a pair of queues, and
+ *            measure the round trips.
+ *
+ * Each pinger pushes a token with the time in it onto the ping queue, then
+ * waits for a token to come back on the pong queue, and records how long
+ * that took. Each responder pops from ping and pushes the same token onto
+ * pong. So there are as many tokens in flight as there are pingers, and
+ * every round trip pays for two wakeups, which is what a request/response
+ * over these queues feels like.
+ *
+ * pingers, responders: how many threads on each side.
+ * round_trips        : the total number of round trips, split between them.
+ * mode, timeout      : how everybody pops, see pop_with().
+ */
+template<typename Queue>
+static pingpong_result ping_pong(
+		const int pingers, const int responders, const int round_trips,
+		const pop_mode mode, const std::chrono::nanoseconds timeout,
+		const harness_options &options = harness_options()){
+	using clock = std::chrono::steady_clock;
+
+	Queue ping;
+	Queue pong;
+
+	std::vector<int> cpus;
+	if(options.where.strategy != placement_strategy::none){
+		cpus = options.topology ?
+			assign_cpus(options.where, *options.topology, pingers, responders) :
+			assign_cpus(options.where, read_topology(), pingers, responders);
+	}
+
+	// Same idea as test_with_concurrency: +1 for us, so we can time it.
+	std::latch setup(pingers + responders + 1);
+	std::latch start(pingers + responders + 1);
+	std::latch stop(pingers + responders + 1);
+
+	std::vector<worker_metrics> metrics(pingers);
+
+	// Split the round trips up, with the remainder going to the last ones.
+	const auto share = [round_trips](const int i, const int n){
+		return round_trips / n + (i == n - 1 ? round_trips % n : 0);
+	};
+
+	// Workers 0 to pingers-1 are the pingers, and the rest respond.
+	const auto worker = [&](const int w){
+		if(!cpus.empty())
+			pin_this_thread(cpus[std::size_t(w)]);
+		setup.arrive_and_wait();
+		start.arrive_and_wait();
+
+		if(w < pingers){
+			const int n = share(w, pingers);
+			for(int r = 0; r < n; r++){
+				ping.push(clock::now());
+				const clock::time_point sent = pop_with(pong, mode, timeout);
+				metrics[std::size_t(w)].latency.record(std::uint64_t(
+					std::chrono::duration_cast<std::chrono::nanoseconds>(
+						clock::now() - sent).count()));
+			}
+		}else{
+			const int n = share(w - pingers, responders);
+			for(int r = 0; r < n; r++)
+				pong.push(pop_with(ping, mode, timeout));
+		}
+
+		stop.arrive_and_wait();
+	};
+
+	// If we weren't given a team, this one's just for us.
+	std::optional<worker_team> own_team;
+	worker_team &team = options.team ? *options.team : own_team.emplace();
+	team.dispatch(pingers + responders, worker);
+
+	setup.arrive_and_wait();
+	const auto wall_start = clock::now();
+	start.arrive_and_wait();
+	stop.arrive_and_wait();
+	const auto wall_stop = clock::now();
+	team.wait();
+
+	pingpong_result result{wall_stop - wall_start, log_linear_histogram(), std::move(cpus)};
+	for(const worker_metrics &m : metrics)
+		result.rtt.merge(m.latency);
+
+	return result;
+}
+
+	}
+}
+#endif /* STORM_BENCH_PINGPONG_H */
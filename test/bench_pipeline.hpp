@@ -0,0 +1,200 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* bench_pipeline: Multi-stage pipeline benchmark for the mpmc queues.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef STORM_BENCH_PIPELINE_H
+#define STORM_BENCH_PIPELINE_H 1
+
+#include <thread>
+#include <latch>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <optional>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "mpmc_test_helpers.hpp"
+#include "latency_histogram.hpp"
+#include "cpu_topology.hpp"
+#include "busy_work.hpp"
+#include "worker_team.hpp"
+
+namespace storm {
+	namespace test {
+
+// How often the depth sampler looks at the queues.
+inline constexpr std::chrono::milliseconds pipeline_sample_period(1);
+
+// The queue depths at one point in a pipeline run.
+struct depth_sample {
+	// Since the start of the run.
+	std::chrono::steady_clock::duration when;
+	// One for each stage's input queue.
+	std::vector<std::size_t> depths;
+};
+
+// What came out of a pipeline run.
+struct pipeline_result {
+	// From the start until the last item came out the end.
+	std::chrono::steady_clock::duration wall_time;
+	// From each item going in the front to coming out the end, in
+	// nanoseconds.
+	log_linear_histogram latency;
+	// The depth of each stage's queue, sampled every
+	// pipeline_sample_period.
+	std::vector<depth_sample> depths;
+	// Where everybody was pinned, the source first, then the stages in
+	// order, or empty.
+	std::vector<int> cpus;
+};
+
+/* pipeline: push items through stages of workers connected by queues, and
+ *           time them end to end.
+ *
+ * A source pushes items, stamped with when they went in, onto the first
+ * stage's queue as fast as it can. Each stage's workers pop from their
+ * queue, do work_time of busy work, and push onto the next stage's queue,
+ * except for the last stage, which records the latency. Every push can wake
+ * a waiter on the next queue, so this is where wakeups cascade.
+ *
+ * To shut down, the source pushes one stop token per worker after its
+ * items. When the last worker in a stage gets one, it knows everybody in
+ * that stage is done, so it passes the tokens on to the next stage, and
+ * they can't get ahead of any items.
+ *
+ * While that's going, we sample all the queue depths.
+ *
+ * stages, workers: how many stages, and workers in each.
+ * items          : how many items the source pushes.
+ * work_time      : busy work per item, per stage.
+ */
+template<typename Queue>
+static pipeline_result pipeline(
+		const int stages, const int workers, const int items,
+		const std::chrono::nanoseconds work_time,
+		const harness_options &options = harness_options()){
+	using clock = std::chrono::steady_clock;
+
+	// A time that's never a real stamp, to tell the workers to stop.
+	static constexpr clock::time_point stop_token = clock::time_point::min();
+
+	// The queues aren't movable, so they can't go right in a vector.
+	std::vector<std::unique_ptr<Queue>> queues;
+	for(int i = 0; i < stages; i++)
+		queues.push_back(std::make_unique<Queue>());
+
+	std::vector<int> cpus;
+	if(options.where.strategy != placement_strategy::none){
+		cpus = options.topology ?
+			assign_cpus(options.where, *options.topology, 1, stages * workers) :
+			assign_cpus(options.where, read_topology(), 1, stages * workers);
+	}
+
+	const busy_work &work = calibrated_busy_work();
+
+	// Same as test_with_concurrency: +1 for us.
+	const int threads = 1 + stages * workers;
+	std::latch setup(threads + 1);
+	std::latch start(threads + 1);
+
+	// How many workers in each stage are still going.
+	std::vector<std::atomic<int>> running(stages);
+	for(std::atomic<int> &r : running)
+		r.store(workers, std::memory_order_relaxed);
+	// When the last item came out the end.
+	clock::time_point finished;
+
+	std::vector<worker_metrics> metrics(workers);
+
+	const auto source = [&](){
+		for(int i = 0; i < items; i++)
+			queues[0]->push(clock::now());
+		for(int i = 0; i < workers; i++)
+			queues[0]->push(stop_token);
+	};
+	const auto stage_worker = [&](const int s, const int w){
+		const bool last = s == stages - 1;
+		while(true){
+			const clock::time_point sent = queues[std::size_t(s)]->pop_wait();
+			if(sent == stop_token)
+				break;
+
+			work(work_time);
+			if(last)
+				metrics[std::size_t(w)].latency.record(std::uint64_t(
+					std::chrono::duration_cast<std::chrono::nanoseconds>(
+						clock::now() - sent).count()));
+			else
+				queues[std::size_t(s) + 1]->push(sent);
+		}
+
+		if(running[std::size_t(s)].fetch_sub(1, std::memory_order_acq_rel) != 1)
+			return;
+		if(last){
+			finished = clock::now();
+			return;
+		}
+		for(int i = 0; i < workers; i++)
+			queues[std::size_t(s) + 1]->push(stop_token);
+	};
+	// Worker 0 is the source, and the rest are the stages in order.
+	const auto worker = [&](const int t){
+		if(!cpus.empty())
+			pin_this_thread(cpus[std::size_t(t)]);
+		setup.arrive_and_wait();
+		start.arrive_and_wait();
+
+		if(t == 0)
+			source();
+		else
+			stage_worker((t - 1) / workers, (t - 1) % workers);
+	};
+
+	// If we weren't given a team, this one's just for us.
+	std::optional<worker_team> own_team;
+	worker_team &team = options.team ? *options.team : own_team.emplace();
+	team.dispatch(threads, worker);
+
+	setup.arrive_and_wait();
+	const auto wall_start = clock::now();
+	start.arrive_and_wait();
+
+	// Sample until the last stage is all done.
+	std::vector<depth_sample> depths;
+	while(running.back().load(std::memory_order_acquire) != 0){
+		depth_sample d{clock::now() - wall_start, {}};
+		for(const std::unique_ptr<Queue> &q : queues)
+			d.depths.push_back(q->size());
+		depths.push_back(std::move(d));
+		std::this_thread::sleep_for(pipeline_sample_period);
+	}
+	team.wait();
+
+	pipeline_result result{finished - wall_start, log_linear_histogram(),
+		std::move(depths), std::move(cpus)};
+	for(const worker_metrics &m : metrics)
+		result.latency.merge(m.latency);
+
+	return result;
+}
+
+	}
+}
+#endif /* STORM_BENCH_PIPELINE_H */
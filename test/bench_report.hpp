@@ -0,0 +1,307 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* bench_report: Result records and table/JSON/CSV output for the benchmarks.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef STORM_BENCH_REPORT_H
+#define STORM_BENCH_REPORT_H 1
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <variant>
+#include <optional>
+#include <ostream>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <limits>
+#include <charconv>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include "latency_histogram.hpp"
+
+namespace storm {
+	namespace test {
+
+// One named value in a result. Strings are for labels like the engine name,
+// numbers are for everything we measured or counted.
+struct bench_field {
+	std::string name;
+	std::variant<std::string, double> value;
+};
+
+// One row of results: the labels saying what was run, then the measurements.
+// The fields stay in the order they were added, and that's the order they
+// get printed in.
+struct bench_record {
+	std::vector<bench_field> fields;
+
+	bench_record &label(std::string name, std::string value){
+		fields.push_back(bench_field{std::move(name), std::move(value)});
+		return *this;
+	}
+	bench_record &metric(std::string name, double value){
+		fields.push_back(bench_field{std::move(name), value});
+		return *this;
+	}
+
+	// find: get a field's value by name, if it's there.
+	[[nodiscard]] const std::variant<std::string, double> *find(std::string_view name) const {
+		for(const bench_field &f : fields)
+			if(f.name == name)
+				return &f.value;
+		return nullptr;
+	}
+};
+
+// How to print the results.
+enum class output_format {
+	table,
+	json,
+	csv,
+};
+
+// parse_output_format: turn a name from the command line into a format.
+inline std::optional<output_format> parse_output_format(std::string_view name){
+	if(name == "table")
+		return output_format::table;
+	if(name == "json")
+		return output_format::json;
+	if(name == "csv")
+		return output_format::csv;
+	return std::nullopt;
+}
+
+// format_number: print a number without any exponent for integers, and
+// with enough digits to round-trip otherwise. NaN means "not measured",
+// which comes out empty.
+inline std::string format_number(double d){
+	if(std::isnan(d))
+		return std::string();
+
+	std::ostringstream ss;
+	if(d == std::trunc(d) && std::abs(d) < 1e15)
+		ss << std::int64_t(d);
+	else
+		ss << std::setprecision(6) << std::fixed << d;
+	return ss.str();
+}
+
+// format_field: print a field's value as plain text.
+inline std::string format_field(const std::variant<std::string, double> &v){
+	if(const std::string *s = std::get_if<std::string>(&v))
+		return *s;
+	return format_number(std::get<double>(v));
+}
+
+// json_escape: quote a string for JSON.
+inline std::string json_escape(std::string_view s){
+	std::ostringstream out;
+	out << '"';
+	for(const char c : s){
+		switch(c){
+		case '"': out << "\\\""; break;
+		case '\\': out << "\\\\"; break;
+		case '\n': out << "\\n"; break;
+		case '\t': out << "\\t"; break;
+		default:
+			if(static_cast<unsigned char>(c) < 0x20)
+				out << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+				    << int(c) << std::dec << std::setfill(' ');
+			else
+				out << c;
+		}
+	}
+	out << '"';
+	return out.str();
+}
+
+// csv_escape: quote a string for CSV, but only if it needs it.
+inline std::string csv_escape(std::string_view s){
+	if(s.find_first_of(",\"\n") == std::string_view::npos)
+		return std::string(s);
+
+	std::string out = "\"";
+	for(const char c : s){
+		if(c == '"')
+			out += '"';
+		out += c;
+	}
+	out += '"';
+	return out;
+}
+
+// write_json: print the records as a JSON array of objects.
+inline void write_json(std::ostream &out, const std::vector<bench_record> &records){
+	out << "[\n";
+	for(std::size_t r = 0; r < records.size(); r++){
+		out << "  {";
+		const auto &fields = records[r].fields;
+		for(std::size_t i = 0; i < fields.size(); i++){
+			out << (i == 0 ? "" : ", ") << json_escape(fields[i].name) << ": ";
+			if(const std::string *s = std::get_if<std::string>(&fields[i].value)){
+				out << json_escape(*s);
+			}else{
+				const std::string n = format_number(std::get<double>(fields[i].value));
+				out << (n.empty() ? "null" : n);
+			}
+		}
+		out << (r + 1 == records.size() ? "}\n" : "},\n");
+	}
+	out << "]\n";
+}
+
+// all_columns: every field name in the records, in the order first seen.
+inline std::vector<std::string> all_columns(const std::vector<bench_record> &records){
+	std::vector<std::string> columns;
+	for(const bench_record &r : records)
+		for(const bench_field &f : r.fields)
+			if(std::find(columns.begin(), columns.end(), f.name) == columns.end())
+				columns.push_back(f.name);
+	return columns;
+}
+
+// write_csv: print the records as CSV. Different scenarios record different
+// fields, so the columns are all of them, and rows leave out what they
+// don't have.
+inline void write_csv(std::ostream &out, const std::vector<bench_record> &records){
+	const std::vector<std::string> columns = all_columns(records);
+
+	for(std::size_t i = 0; i < columns.size(); i++)
+		out << (i == 0 ? "" : ",") << csv_escape(columns[i]);
+	out << '\n';
+
+	for(const bench_record &r : records){
+		for(std::size_t i = 0; i < columns.size(); i++){
+			out << (i == 0 ? "" : ",");
+			if(const auto *v = r.find(columns[i]))
+				out << csv_escape(format_field(*v));
+		}
+		out << '\n';
+	}
+}
+
+// write_table: print the records as a human-readable table, with a new
+// header every time the set of fields changes.
+inline void write_table(std::ostream &out, const std::vector<bench_record> &records){
+	using std::setw;
+	using std::right;
+
+	std::size_t start = 0;
+	while(start < records.size()){
+		// Find the run of records that have the same fields as this one.
+		std::size_t end = start + 1;
+		const auto same_fields = [](const bench_record &a, const bench_record &b){
+			return std::equal(a.fields.begin(), a.fields.end(),
+				b.fields.begin(), b.fields.end(),
+				[](const bench_field &x, const bench_field &y){ return x.name == y.name; });
+		};
+		while(end < records.size() && same_fields(records[start], records[end]))
+			end++;
+
+		// Size the columns to fit.
+		const auto &names = records[start].fields;
+		std::vector<std::size_t> widths(names.size());
+		for(std::size_t i = 0; i < names.size(); i++){
+			widths[i] = names[i].name.size();
+			for(std::size_t r = start; r < end; r++)
+				widths[i] = std::max(widths[i], format_field(records[r].fields[i].value).size());
+		}
+
+		for(std::size_t i = 0; i < names.size(); i++)
+			out << (i == 0 ? "" : " ") << right << setw(int(widths[i])) << names[i].name;
+		out << '\n';
+		for(std::size_t r = start; r < end; r++){
+			for(std::size_t i = 0; i < names.size(); i++)
+				out << (i == 0 ? "" : " ") << right << setw(int(widths[i]))
+				    << format_field(records[r].fields[i].value);
+			out << '\n';
+		}
+		out << '\n';
+
+		start = end;
+	}
+}
+
+// write_records: print the records in whichever format was asked for.
+inline void write_records(std::ostream &out, const output_format format,
+		const std::vector<bench_record> &records){
+	switch(format){
+	case output_format::table:
+		write_table(out, records);
+		break;
+	case output_format::json:
+		write_json(out, records);
+		break;
+	case output_format::csv:
+		write_csv(out, records);
+		break;
+	}
+}
+
+// add_latency_metrics: add the usual percentiles from a histogram, or
+// blanks if it's empty.
+inline void add_latency_metrics(bench_record &r, const std::string &prefix,
+		const log_linear_histogram &lat){
+	const double none = std::numeric_limits<double>::quiet_NaN();
+	const bool have = lat.count() != 0;
+	r.metric(prefix + "p50_ns", have ? double(lat.percentile(50)) : none)
+	 .metric(prefix + "p90_ns", have ? double(lat.percentile(90)) : none)
+	 .metric(prefix + "p99_ns", have ? double(lat.percentile(99)) : none)
+	 .metric(prefix + "p99.9_ns", have ? double(lat.percentile(99.9)) : none)
+	 .metric(prefix + "max_ns", have ? double(lat.max()) : none);
+}
+
+// parse_int: parse a whole string as a non-negative int, or fail. For the
+// benchmarks' command line options.
+template<typename Int>
+std::optional<Int> parse_int(std::string_view s){
+	Int i{};
+	const auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), i);
+	if(ec != std::errc() || end != s.data() + s.size() || i < 0)
+		return std::nullopt;
+	return i;
+}
+
+// split_list: split a comma-separated list.
+inline std::vector<std::string> split_list(std::string_view s){
+	std::vector<std::string> out;
+	while(true){
+		const auto comma = s.find(',');
+		out.emplace_back(s.substr(0, comma));
+		if(comma == std::string_view::npos)
+			return out;
+		s.remove_prefix(comma + 1);
+	}
+}
+
+// warmed_up: for the rep loops, which count up from -warmup. Says so and
+// returns true if this rep was a warmup, so its results get thrown away.
+inline bool warmed_up(const int rep){
+	if(rep >= 0)
+		return false;
+	std::cerr << "warmup\n";
+	return true;
+}
+
+	}
+}
+#endif /* STORM_BENCH_REPORT_H */
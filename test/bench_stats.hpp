@@ -0,0 +1,370 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* bench_stats: Summaries over repetitions, and comparisons against a saved
+ *              baseline, for the benchmarks.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef STORM_BENCH_STATS_H
+#define STORM_BENCH_STATS_H 1
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <iomanip>
+#include <limits>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <cstddef>
+
+#include "bench_report.hpp"
+
+namespace storm {
+	namespace test {
+
+/* t_critical_95: the two-sided 95% critical value of Student's t.
+ *
+ * Fractional degrees of freedom (from Welch) round down, and anything
+ * between the rows of the table uses the row below, which only ever makes
+ * the intervals a bit wider than they need to be.
+ */
+inline double t_critical_95(const double df){
+	static constexpr double small[] = {
+		12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+		2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+		2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+	};
+
+	if(!(df >= 1))
+		return std::numeric_limits<double>::infinity();
+	if(df < 31)
+		return small[std::size_t(df) - 1];
+	if(df < 40)
+		return small[29];
+	if(df < 60)
+		return 2.021;
+	if(df < 120)
+		return 2.000;
+	if(df < 1000)
+		return 1.980;
+	return 1.960;
+}
+
+// What a set of repetitions of one measurement looks like. With only one
+// sample, stddev and ci95 are NaN.
+struct sample_summary {
+	std::size_t n = 0;
+	double mean = 0;
+	double median = 0;
+	double min = 0;
+	double max = 0;
+	double stddev = 0;
+	// Half the width of the 95% confidence interval for the mean.
+	double ci95 = 0;
+};
+
+// summarize: summarize some samples. NaNs, which mean "not measured", are
+// left out.
+inline sample_summary summarize(std::vector<double> samples){
+	const double none = std::numeric_limits<double>::quiet_NaN();
+
+	std::erase_if(samples, [](const double d){ return std::isnan(d); });
+	std::sort(samples.begin(), samples.end());
+
+	sample_summary s;
+	s.n = samples.size();
+	if(s.n == 0)
+		return sample_summary{0, none, none, none, none, none, none};
+
+	s.mean = std::accumulate(samples.begin(), samples.end(), 0.0) / double(s.n);
+	s.median = s.n % 2 ? samples[s.n / 2] : (samples[s.n / 2 - 1] + samples[s.n / 2]) / 2;
+	s.min = samples.front();
+	s.max = samples.back();
+
+	if(s.n < 2){
+		s.stddev = none;
+		s.ci95 = none;
+		return s;
+	}
+
+	double squares = 0;
+	for(const double d : samples)
+		squares += (d - s.mean) * (d - s.mean);
+	s.stddev = std::sqrt(squares / double(s.n - 1));
+	s.ci95 = t_critical_95(double(s.n - 1)) * s.stddev / std::sqrt(double(s.n));
+	return s;
+}
+
+/* Which way is better for a metric.
+ *
+ * Throughputs (anything "_per_s") are better higher, and times and
+ * per-item costs ("_ns", "_per_item") are better lower. The p99.9 and max
+ * latencies are left out: they're a handful of samples each, and they jump
+ * around too much between runs to say anything about a regression. So is
+ * each worker's longest starvation ("_starved_ns"), which is a max too.
+ */
+enum class metric_direction {
+	none,
+	higher_is_better,
+	lower_is_better,
+};
+
+inline metric_direction direction_of(std::string_view metric){
+	if(metric.ends_with("max_ns") || metric.ends_with("p99.9_ns") ||
+			metric.ends_with("_starved_ns"))
+		return metric_direction::none;
+	if(metric.ends_with("_per_s"))
+		return metric_direction::higher_is_better;
+	if(metric.ends_with("_ns") || metric.ends_with("_per_item"))
+		return metric_direction::lower_is_better;
+	return metric_direction::none;
+}
+
+// One measurement of one configuration, over all its repetitions.
+struct summary_entry {
+	// Every field that says what was run, like "scenario=normal engine=...".
+	std::string key;
+	// The fields that make up the key, for printing.
+	std::vector<bench_field> config;
+	std::string metric;
+	sample_summary stats;
+};
+
+/* summarize_records: group the records by configuration and summarize
+ * each measurement.
+ *
+ * A record's configuration is all of its labels, plus the metrics that
+ * come before its "rep", which is how every scenario lays them out. The
+ * numeric metrics after "rep" are the measurements.
+ */
+inline std::vector<summary_entry> summarize_records(const std::vector<bench_record> &records){
+	struct group {
+		std::string key;
+		std::vector<bench_field> config;
+		std::vector<std::string> metrics;
+		std::vector<std::vector<double>> samples;
+	};
+	std::vector<group> groups;
+
+	for(const bench_record &r : records){
+		std::string key;
+		std::vector<bench_field> config;
+		std::vector<const bench_field*> measured;
+		bool past_rep = false;
+		for(const bench_field &f : r.fields){
+			if(f.name == "rep"){
+				past_rep = true;
+			}else if(past_rep && std::holds_alternative<double>(f.value)){
+				measured.push_back(&f);
+			}else{
+				key += (key.empty() ? "" : " ") + f.name + "=" + format_field(f.value);
+				config.push_back(f);
+			}
+		}
+
+		auto g = std::find_if(groups.begin(), groups.end(),
+			[&key](const group &o){ return o.key == key; });
+		if(g == groups.end()){
+			groups.push_back(group{key, std::move(config), {}, {}});
+			g = groups.end() - 1;
+		}
+
+		for(const bench_field *f : measured){
+			auto m = std::find(g->metrics.begin(), g->metrics.end(), f->name);
+			if(m == g->metrics.end()){
+				g->metrics.push_back(f->name);
+				g->samples.emplace_back();
+				m = g->metrics.end() - 1;
+			}
+			g->samples[m - g->metrics.begin()].push_back(std::get<double>(f->value));
+		}
+	}
+
+	std::vector<summary_entry> out;
+	for(const group &g : groups){
+		for(std::size_t i = 0; i < g.metrics.size(); i++){
+			const sample_summary s = summarize(g.samples[i]);
+			if(s.n != 0)
+				out.push_back(summary_entry{g.key, g.config, g.metrics[i], s});
+		}
+	}
+	return out;
+}
+
+// summary_records: the summaries as records, one per configuration and
+// measurement, for write_records().
+inline std::vector<bench_record> summary_records(const std::vector<summary_entry> &entries){
+	std::vector<bench_record> out;
+	for(const summary_entry &e : entries){
+		bench_record r;
+		r.fields = e.config;
+		r.label("metric", e.metric)
+		 .metric("n", double(e.stats.n))
+		 .metric("median", e.stats.median)
+		 .metric("min", e.stats.min)
+		 .metric("max", e.stats.max)
+		 .metric("mean", e.stats.mean)
+		 .metric("stddev", e.stats.stddev)
+		 .metric("ci95_low", e.stats.mean - e.stats.ci95)
+		 .metric("ci95_high", e.stats.mean + e.stats.ci95);
+		out.push_back(std::move(r));
+	}
+	return out;
+}
+
+/* The baseline file.
+ *
+ * A header line, then one line per configuration and measurement, with
+ * tab-separated key, metric, n, mean, stddev, and median. That's all a
+ * Welch's t-test needs, and it's easy to diff by eye. None of the fields
+ * ever have tabs or newlines in them.
+ */
+inline constexpr std::string_view baseline_header = "# mpmc_bench baseline v1";
+
+inline void write_baseline(std::ostream &out, const std::vector<summary_entry> &entries){
+	out << baseline_header << '\n' << std::setprecision(17);
+	for(const summary_entry &e : entries)
+		out << e.key << '\t' << e.metric << '\t' << e.stats.n << '\t'
+		    << e.stats.mean << '\t' << e.stats.stddev << '\t' << e.stats.median << '\n';
+}
+
+// read_baseline: read what write_baseline() wrote, or nothing if it isn't
+// a baseline file.
+inline std::optional<std::vector<summary_entry>> read_baseline(std::istream &in){
+	std::string line;
+	if(!std::getline(in, line) || line != baseline_header)
+		return std::nullopt;
+
+	std::vector<summary_entry> out;
+	while(std::getline(in, line)){
+		if(line.empty())
+			continue;
+
+		std::vector<std::string> cols;
+		std::string_view rest(line);
+		while(true){
+			const auto tab = rest.find('\t');
+			cols.emplace_back(rest.substr(0, tab));
+			if(tab == std::string_view::npos)
+				break;
+			rest.remove_prefix(tab + 1);
+		}
+		if(cols.size() != 6)
+			return std::nullopt;
+
+		// stod doesn't do "nan", so go through a stream.
+		const auto number = [](const std::string &s){
+			if(s == "nan" || s == "-nan")
+				return std::numeric_limits<double>::quiet_NaN();
+			std::istringstream ss(s);
+			double d;
+			return (ss >> d) ? d : std::numeric_limits<double>::quiet_NaN();
+		};
+
+		summary_entry e;
+		e.key = cols[0];
+		e.metric = cols[1];
+		e.stats.n = std::size_t(number(cols[2]));
+		e.stats.mean = number(cols[3]);
+		e.stats.stddev = number(cols[4]);
+		e.stats.median = number(cols[5]);
+		out.push_back(std::move(e));
+	}
+	return out;
+}
+
+// How one measurement compares to the baseline.
+struct comparison {
+	const summary_entry *current;
+	const summary_entry *baseline;
+	// (current - baseline) / baseline, on the means.
+	double change;
+	// Welch's t and its degrees of freedom.
+	double t;
+	double df;
+	// Whether the difference is significant at 95%, and bigger than the
+	// threshold, and which way it went.
+	bool regression;
+	bool improvement;
+};
+
+/* compare_to_baseline: Welch's t-test on every measurement that has a
+ *                      direction and is in both.
+ *
+ * Something only counts as a regression or improvement if the test says
+ * it's significant _and_ the means moved by more than threshold (a
+ * fraction, like 0.05), so that a tiny but consistent change doesn't
+ * fail the build. Anything with fewer than two samples on either side
+ * can't be tested, and is never flagged.
+ */
+inline std::vector<comparison> compare_to_baseline(
+		const std::vector<summary_entry> &current,
+		const std::vector<summary_entry> &baseline,
+		const double threshold){
+	std::vector<comparison> out;
+
+	for(const summary_entry &c : current){
+		const metric_direction dir = direction_of(c.metric);
+		if(dir == metric_direction::none)
+			continue;
+
+		const auto b = std::find_if(baseline.begin(), baseline.end(),
+			[&c](const summary_entry &o){ return o.key == c.key && o.metric == c.metric; });
+		if(b == baseline.end())
+			continue;
+
+		comparison cmp{&c, &*b, (c.stats.mean - b->stats.mean) / b->stats.mean,
+			std::numeric_limits<double>::quiet_NaN(),
+			std::numeric_limits<double>::quiet_NaN(), false, false};
+
+		if(c.stats.n >= 2 && b->stats.n >= 2){
+			const double vc = c.stats.stddev * c.stats.stddev / double(c.stats.n);
+			const double vb = b->stats.stddev * b->stats.stddev / double(b->stats.n);
+			const double diff = c.stats.mean - b->stats.mean;
+
+			bool significant;
+			if(vc + vb == 0){
+				// No noise at all, so any difference is real.
+				significant = diff != 0;
+				cmp.df = double(c.stats.n + b->stats.n - 2);
+			}else{
+				cmp.t = diff / std::sqrt(vc + vb);
+				cmp.df = (vc + vb) * (vc + vb) /
+					(vc * vc / double(c.stats.n - 1) + vb * vb / double(b->stats.n - 1));
+				significant = std::abs(cmp.t) > t_critical_95(cmp.df);
+			}
+
+			const bool worse = dir == metric_direction::higher_is_better ? diff < 0 : diff > 0;
+			if(significant && std::abs(cmp.change) > threshold){
+				cmp.regression = worse;
+				cmp.improvement = !worse;
+			}
+		}
+
+		out.push_back(cmp);
+	}
+
+	return out;
+}
+
+	}
+}
+#endif /* STORM_BENCH_STATS_H */
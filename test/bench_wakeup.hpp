@@ -0,0 +1,143 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* bench_wakeup: Idle wakeup latency and idle CPU benchmark for the mpmc
+ *               queues.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef STORM_BENCH_WAKEUP_H
+#define STORM_BENCH_WAKEUP_H 1
+
+#include <thread>
+#include <latch>
+#include <vector>
+#include <optional>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+
+#include "mpmc_test_helpers.hpp"
+#include "latency_histogram.hpp"
+#include "cpu_topology.hpp"
+#include "worker_team.hpp"
+
+namespace storm {
+	namespace test {
+
+// How long the consumers get to settle into waiting, and then how long we
+// watch them sit there, before the first push.
+inline constexpr std::chrono::milliseconds wakeup_settle_time(20);
+inline constexpr std::chrono::milliseconds wakeup_idle_window(200);
+
+// What came out of a wakeup run.
+struct wakeup_result {
+	// From each push into the empty queue to a consumer coming back with
+	// it, in nanoseconds.
+	log_linear_histogram wake;
+	// CPU time the idle consumers used while there was nothing to pop, as a
+	// fraction of one CPU per consumer.
+	double idle_cpu;
+	// Where the consumers were pinned, or empty.
+	std::vector<int> cpus;
+};
+
+/* wakeup: measure how quickly idle consumers notice a push, and what they
+ *         cost while they're idle.
+ *
+ * The consumers start popping from an empty queue. First we just watch the
+ * process's CPU time for wakeup_idle_window, which is what they burn doing
+ * nothing. Then we push one item at a time, gap apart, each stamped right
+ * before it goes in, so every push lands on an empty queue with consumers
+ * that have had time to go back to sleep. The consumer that gets it records
+ * how long that took.
+ *
+ * consumers    : how many consumers are waiting.
+ * wakeups      : how many pushes to time.
+ * gap          : the time between pushes.
+ * mode, timeout: how the consumers pop, see pop_with().
+ */
+template<typename Queue>
+static wakeup_result wakeup(
+		const int consumers, const int wakeups,
+		const std::chrono::steady_clock::duration gap,
+		const pop_mode mode, const std::chrono::nanoseconds timeout,
+		const harness_options &options = harness_options()){
+	using clock = std::chrono::steady_clock;
+
+	// A time that's never a real stamp, to tell the consumers to stop.
+	static constexpr clock::time_point stop_token = clock::time_point::min();
+
+	Queue q;
+
+	std::vector<int> cpus;
+	if(options.where.strategy != placement_strategy::none){
+		cpus = options.topology ?
+			assign_cpus(options.where, *options.topology, 0, consumers) :
+			assign_cpus(options.where, read_topology(), 0, consumers);
+	}
+
+	std::latch setup(consumers + 1);
+	std::vector<worker_metrics> metrics(consumers);
+
+	const auto consumer = [&](const int i){
+		if(!cpus.empty())
+			pin_this_thread(cpus[std::size_t(i)]);
+		setup.arrive_and_wait();
+
+		while(true){
+			const clock::time_point sent = pop_with(q, mode, timeout);
+			if(sent == stop_token)
+				break;
+			metrics[std::size_t(i)].latency.record(std::uint64_t(
+				std::chrono::duration_cast<std::chrono::nanoseconds>(
+					clock::now() - sent).count()));
+		}
+	};
+
+	// If we weren't given a team, this one's just for us.
+	std::optional<worker_team> own_team;
+	worker_team &team = options.team ? *options.team : own_team.emplace();
+	team.dispatch(consumers, consumer);
+
+	setup.arrive_and_wait();
+
+	// We're asleep for all of this, so the CPU time is all theirs.
+	std::this_thread::sleep_for(wakeup_settle_time);
+	const std::clock_t idle_start = std::clock();
+	std::this_thread::sleep_for(wakeup_idle_window);
+	const std::clock_t idle_stop = std::clock();
+
+	for(int i = 0; i < wakeups; i++){
+		std::this_thread::sleep_for(gap);
+		q.push(clock::now());
+	}
+	for(int i = 0; i < consumers; i++)
+		q.push(stop_token);
+	team.wait();
+
+	const double idle_seconds = double(idle_stop - idle_start) / CLOCKS_PER_SEC;
+	wakeup_result result{log_linear_histogram(),
+		idle_seconds / std::chrono::duration<double>(wakeup_idle_window).count() / consumers,
+		std::move(cpus)};
+	for(const worker_metrics &m : metrics)
+		result.wake.merge(m.latency);
+
+	return result;
+}
+
+	}
+}
+#endif /* STORM_BENCH_WAKEUP_H */
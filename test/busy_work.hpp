@@ -0,0 +1,96 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* busy_work: Calibrated busy-work for simulating what a worker does with
+ *            an item.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef STORM_BUSY_WORK_H
+#define STORM_BUSY_WORK_H 1
+
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+
+#include "mpmc_test_helpers.hpp"
+
+namespace storm {
+	namespace test {
+
+// spin_iterations: burn n iterations of a loop that can't be optimized away
+// or sped up by running more of it in parallel.
+inline void spin_iterations(const std::uint64_t n){
+	std::uint64_t x = n;
+	for(std::uint64_t i = 0; i < n; i++)
+		x = x * 6364136223846793005u + 1442695040888963407u;
+	consume_value_reg(x);
+}
+
+/* busy_work: spin for a given amount of CPU time without asking the clock.
+ *
+ * Reading the clock in a loop would make the work mostly clock reads, and
+ * a thread that gets preempted would come back to find its time already
+ * up. Instead we count loop iterations, and calibrate how many there are in
+ * a nanosecond once up front. Keep in mind that means frequency scaling
+ * changes how long the work really takes.
+ */
+class busy_work {
+public:
+	// Calibrates, which takes a few milliseconds.
+	busy_work() :
+		iterations_per_ns(calibrate()) {}
+
+	// Work for about this long.
+	void operator()(const std::chrono::nanoseconds time) const {
+		if(time.count() > 0)
+			spin_iterations(std::uint64_t(double(time.count()) * iterations_per_ns));
+	}
+
+	[[nodiscard]] double rate() const {
+		return iterations_per_ns;
+	}
+
+private:
+	// calibrate: time a few rounds of a million iterations, and keep the
+	// fastest, since the slow ones got interrupted.
+	static double calibrate(){
+		using clock = std::chrono::steady_clock;
+		static constexpr std::uint64_t iterations = 1'000'000;
+
+		std::chrono::nanoseconds best = std::chrono::nanoseconds::max();
+		for(int round = 0; round < 5; round++){
+			const auto start = clock::now();
+			spin_iterations(iterations);
+			best = std::min(best, std::chrono::duration_cast<std::chrono::nanoseconds>(
+				clock::now() - start));
+		}
+
+		return double(iterations) / double(std::max<std::int64_t>(1, best.count()));
+	}
+
+	double iterations_per_ns;
+};
+
+// calibrated_busy_work: one busy_work for everybody, calibrated the first
+// time anybody asks, so that each test doesn't pay for calibrating again.
+inline const busy_work &calibrated_busy_work(){
+	static const busy_work work;
+	return work;
+}
+
+	}
+}
+#endif /* STORM_BUSY_WORK_H */
@@ -0,0 +1,257 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* cpu_topology: CPU topology and thread pinning for the benchmarks.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef STORM_CPU_TOPOLOGY_H
+#define STORM_CPU_TOPOLOGY_H 1
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <optional>
+#include <fstream>
+#include <algorithm>
+#include <set>
+#include <tuple>
+#include <charconv>
+
+#include <pthread.h>
+#include <sched.h>
+
+namespace storm {
+	namespace test {
+
+// Where one logical CPU sits.
+struct cpu_info {
+	int cpu;
+	int core;
+	int package;
+};
+
+// read_topology: get the CPUs we're allowed to run on, and where they are.
+// If sysfs doesn't tell us, each CPU is assumed to be its own core on
+// package 0.
+inline std::vector<cpu_info> read_topology(){
+	std::vector<cpu_info> cpus;
+
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return cpus;
+
+	const auto read_int = [](const std::string &path, const int fallback){
+		std::ifstream f(path);
+		int i;
+		return (f >> i) ? i : fallback;
+	};
+
+	for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+		if(!CPU_ISSET(cpu, &allowed))
+			continue;
+
+		const std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+		cpus.push_back(cpu_info{
+			cpu,
+			read_int(dir + "core_id", cpu),
+			read_int(dir + "physical_package_id", 0),
+		});
+	}
+
+	return cpus;
+}
+
+// describe_topology: a short summary, like "2s32c64t" for two sockets with
+// 32 cores and 64 threads between them.
+inline std::string describe_topology(const std::vector<cpu_info> &topo){
+	std::set<int> packages;
+	std::set<std::pair<int, int>> cores;
+	for(const cpu_info &c : topo){
+		packages.insert(c.package);
+		cores.insert({c.package, c.core});
+	}
+
+	return std::to_string(packages.size()) + "s" + std::to_string(cores.size())
+		+ "c" + std::to_string(topo.size()) + "t";
+}
+
+/* How to place workers on CPUs.
+ *
+ * none   : don't pin anything, let the scheduler decide.
+ * compact: fill up each core's SMT siblings, then the next core, then the
+ *          next package. Producers go first, then consumers.
+ * scatter: spread out over packages first, then cores, and only double up
+ *          on SMT siblings once every core has a worker.
+ * smt    : like compact, but pairs each producer with a consumer on SMT
+ *          siblings of the same core, so they share an L1.
+ * list   : pin to an explicit list of CPUs, in order, producers first.
+ *
+ * In every case, if there are more workers than CPUs, it wraps around.
+ */
+enum class placement_strategy {
+	none,
+	compact,
+	scatter,
+	smt,
+	list,
+};
+
+struct placement {
+	placement_strategy strategy = placement_strategy::none;
+	// The CPUs for placement_strategy::list.
+	std::vector<int> cpus;
+};
+
+// parse_placement: parse "none", "compact", "scatter", "smt", or a list of
+// CPUs like "cpus:0,2,4".
+inline std::optional<placement> parse_placement(std::string_view s){
+	if(s == "none")
+		return placement{placement_strategy::none, {}};
+	if(s == "compact")
+		return placement{placement_strategy::compact, {}};
+	if(s == "scatter")
+		return placement{placement_strategy::scatter, {}};
+	if(s == "smt")
+		return placement{placement_strategy::smt, {}};
+
+	static constexpr std::string_view prefix = "cpus:";
+	if(!s.starts_with(prefix))
+		return std::nullopt;
+	s.remove_prefix(prefix.size());
+
+	placement p{placement_strategy::list, {}};
+	while(!s.empty()){
+		int cpu;
+		const auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), cpu);
+		if(ec != std::errc() || cpu < 0)
+			return std::nullopt;
+		p.cpus.push_back(cpu);
+		s.remove_prefix(end - s.data());
+		if(!s.empty()){
+			if(s.front() != ',')
+				return std::nullopt;
+			s.remove_prefix(1);
+		}
+	}
+	if(p.cpus.empty())
+		return std::nullopt;
+
+	return p;
+}
+
+// placement_name: the strategy's name, for the results.
+inline std::string placement_name(const placement &p){
+	switch(p.strategy){
+	case placement_strategy::none: return "none";
+	case placement_strategy::compact: return "compact";
+	case placement_strategy::scatter: return "scatter";
+	case placement_strategy::smt: return "smt";
+	case placement_strategy::list: break;
+	}
+
+	std::string s = "cpus:";
+	for(std::size_t i = 0; i < p.cpus.size(); i++)
+		s += (i == 0 ? "" : ",") + std::to_string(p.cpus[i]);
+	return s;
+}
+
+/* assign_cpus: pick a CPU for each worker.
+ *
+ * Workers are numbered with the producers first, then the consumers. The
+ * result has a CPU for each one, or is empty if we aren't pinning.
+ */
+inline std::vector<int> assign_cpus(const placement &p,
+		const std::vector<cpu_info> &topo,
+		const int producers, const int consumers){
+	const int workers = producers + consumers;
+	std::vector<int> out;
+
+	if(p.strategy == placement_strategy::none || topo.empty())
+		return out;
+
+	if(p.strategy == placement_strategy::list){
+		for(int i = 0; i < workers; i++)
+			out.push_back(p.cpus[i % p.cpus.size()]);
+		return out;
+	}
+
+	// Number each CPU by which SMT thread of its core it is, and each core
+	// by where it is in its package, so we can sort on those.
+	struct ranked {
+		cpu_info info;
+		int thread_rank;
+		int core_rank;
+	};
+	std::vector<ranked> cpus;
+	for(const cpu_info &c : topo){
+		int thread_rank = 0;
+		std::set<int> cores_before;
+		for(const cpu_info &o : topo){
+			if(o.package != c.package)
+				continue;
+			if(o.core == c.core && o.cpu < c.cpu)
+				thread_rank++;
+			if(o.core < c.core)
+				cores_before.insert(o.core);
+		}
+		cpus.push_back(ranked{c, thread_rank, int(cores_before.size())});
+	}
+
+	const auto compact_order = [](const ranked &a, const ranked &b){
+		return std::tie(a.info.package, a.core_rank, a.thread_rank) <
+		       std::tie(b.info.package, b.core_rank, b.thread_rank);
+	};
+	const auto scatter_order = [](const ranked &a, const ranked &b){
+		return std::tie(a.thread_rank, a.core_rank, a.info.package) <
+		       std::tie(b.thread_rank, b.core_rank, b.info.package);
+	};
+	if(p.strategy == placement_strategy::scatter)
+		std::sort(cpus.begin(), cpus.end(), scatter_order);
+	else
+		std::sort(cpus.begin(), cpus.end(), compact_order);
+
+	if(p.strategy != placement_strategy::smt){
+		for(int i = 0; i < workers; i++)
+			out.push_back(cpus[i % cpus.size()].info.cpu);
+		return out;
+	}
+
+	// For smt, walk the compact order handing out CPUs to producer 0,
+	// consumer 0, producer 1, consumer 1, and so on, then whoever's left.
+	out.resize(workers);
+	std::size_t next = 0;
+	for(int i = 0; i < std::max(producers, consumers); i++){
+		if(i < producers)
+			out[i] = cpus[next++ % cpus.size()].info.cpu;
+		if(i < consumers)
+			out[producers + i] = cpus[next++ % cpus.size()].info.cpu;
+	}
+	return out;
+}
+
+// pin_this_thread: pin the calling thread to one CPU. Returns false if the
+// kernel said no.
+inline bool pin_this_thread(const int cpu){
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+	}
+}
+#endif /* STORM_CPU_TOPOLOGY_H */
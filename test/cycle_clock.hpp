@@ -0,0 +1,120 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* cycle_clock: A cycle-accurate timer for microbenchmarks.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef STORM_CYCLE_CLOCK_H
+#define STORM_CYCLE_CLOCK_H 1
+
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <limits>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace storm {
+	namespace test {
+
+/* Reading the clock.
+ *
+ * On x86 these read the TSC, fenced so that nothing we're timing can be
+ * reordered out from between them: lfence before rdtsc waits for
+ * everything before to finish, lfence after keeps everything after from
+ * starting early, and rdtscp at the end waits for the timed code itself.
+ * Any CPU from the last decade or so has an invariant TSC, which ticks at
+ * a constant rate no matter the frequency or sleep state.
+ *
+ * Everywhere else, these fall back to steady_clock in nanoseconds, which is
+ * a lot coarser and costs more to read, but the overhead calibration still
+ * takes out most of that.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+inline constexpr const char *cycle_clock_name = "tsc";
+
+inline std::uint64_t ticks_start(){
+	_mm_lfence();
+	const std::uint64_t t = __rdtsc();
+	_mm_lfence();
+	return t;
+}
+
+inline std::uint64_t ticks_stop(){
+	unsigned int aux;
+	const std::uint64_t t = __rdtscp(&aux);
+	_mm_lfence();
+	return t;
+}
+#else
+inline constexpr const char *cycle_clock_name = "steady_clock";
+
+inline std::uint64_t ticks_start(){
+	return std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+inline std::uint64_t ticks_stop(){
+	return ticks_start();
+}
+#endif
+
+// How to turn ticks into something useful.
+struct tick_calibration {
+	// How long a tick is.
+	double ns_per_tick;
+	// What a ticks_start() and ticks_stop() with nothing between them read,
+	// at the least, which is what to take off of every measurement.
+	std::uint64_t overhead;
+};
+
+/* calibrate_ticks: work out how long a tick is, and what reading the clock
+ *                  costs.
+ *
+ * The tick length comes from comparing against steady_clock over a
+ * stretch of sleeping. The overhead is the smallest of a lot of empty
+ * measurements, since anything more than that was an interrupt or some
+ * other noise.
+ */
+inline tick_calibration calibrate_ticks(){
+	using clock = std::chrono::steady_clock;
+	static constexpr auto stretch = std::chrono::milliseconds(50);
+	static constexpr int overhead_samples = 100'000;
+
+	const auto wall_start = clock::now();
+	const std::uint64_t ticks_begin = ticks_start();
+	std::this_thread::sleep_for(stretch);
+	const std::uint64_t ticks_end = ticks_stop();
+	const auto wall_stop = clock::now();
+
+	std::uint64_t overhead = std::numeric_limits<std::uint64_t>::max();
+	for(int i = 0; i < overhead_samples; i++){
+		const std::uint64_t t0 = ticks_start();
+		const std::uint64_t t1 = ticks_stop();
+		overhead = std::min(overhead, t1 - t0);
+	}
+
+	const double ns = double(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		wall_stop - wall_start).count());
+	return tick_calibration{ns / double(ticks_end - ticks_begin), overhead};
+}
+
+	}
+}
+#endif /* STORM_CYCLE_CLOCK_H */
@@ -0,0 +1,135 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* fairness_metrics: How evenly workers got their turns, over time.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef STORM_FAIRNESS_METRICS_H
+#define STORM_FAIRNESS_METRICS_H 1
+
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+namespace storm {
+	namespace test {
+
+// How far every worker had gotten at one point in a test.
+struct progress_sample {
+	std::chrono::steady_clock::time_point when;
+	// How many items were in the queue.
+	std::size_t queue_size;
+	// How many items each worker had pushed or popped.
+	std::vector<std::int64_t> done;
+};
+
+/* jain_index: Jain's fairness index of some shares, (sum x)^2 / (n sum x^2).
+ *
+ * It's 1 when everybody got the same, and 1/n when one got everything. NaN
+ * if nobody got anything, since then there's nothing to be fair about.
+ */
+inline double jain_index(const std::vector<double> &x){
+	double sum = 0;
+	double squares = 0;
+	for(const double v : x){
+		sum += v;
+		squares += v * v;
+	}
+	if(x.empty() || squares == 0)
+		return std::numeric_limits<double>::quiet_NaN();
+	return sum * sum / (double(x.size()) * squares);
+}
+
+// How fair one side of a test was to its workers.
+struct fairness_summary {
+	// Jain's index of how many items each worker got through in each
+	// sampling window, averaged over the windows where every one of them
+	// still had items to go. NaN if there weren't any.
+	double jain = std::numeric_limits<double>::quiet_NaN();
+	// For each worker, the longest it went without getting an item through
+	// while it still had some to go.
+	std::vector<std::chrono::nanoseconds> starvation;
+
+	[[nodiscard]] std::chrono::nanoseconds longest_starvation() const {
+		return starvation.empty() ? std::chrono::nanoseconds(0) :
+			*std::max_element(starvation.begin(), starvation.end());
+	}
+};
+
+/* summarize_fairness: work out how fair things were to some of the workers
+ *                     in a series of samples.
+ *
+ * first, quotas: which workers, starting at done[first], and how many items
+ *                each one had to get through.
+ * needs_items  : whether these workers can only make progress when there's
+ *                something in the queue, like consumers. If so, a window
+ *                only counts toward starvation if the queue had items at
+ *                both ends of it, so waiting on an empty queue isn't
+ *                starving.
+ *
+ * The samples are only so far apart, so starvation is only as precise as
+ * that, and anything shorter than one window doesn't show up at all.
+ */
+inline fairness_summary summarize_fairness(const std::vector<progress_sample> &samples,
+		const std::size_t first, const std::vector<std::int64_t> &quotas,
+		const bool needs_items){
+	fairness_summary result;
+	result.starvation.assign(quotas.size(), std::chrono::nanoseconds(0));
+	std::vector<std::chrono::nanoseconds> current(quotas.size());
+
+	double jain_total = 0;
+	int jain_windows = 0;
+	std::vector<double> shares(quotas.size());
+	for(std::size_t k = 1; k < samples.size(); k++){
+		const progress_sample &a = samples[k - 1];
+		const progress_sample &b = samples[k];
+		const auto window = std::chrono::duration_cast<std::chrono::nanoseconds>(b.when - a.when);
+		const bool had_items = !needs_items || (a.queue_size > 0 && b.queue_size > 0);
+
+		bool everyone_busy = true;
+		for(std::size_t i = 0; i < quotas.size(); i++){
+			const std::int64_t before = a.done[first + i];
+			const std::int64_t after = b.done[first + i];
+			everyone_busy = everyone_busy && before < quotas[i];
+			shares[i] = double(after - before);
+
+			if(after == before && before < quotas[i] && had_items){
+				current[i] += window;
+				result.starvation[i] = std::max(result.starvation[i], current[i]);
+			}else{
+				current[i] = std::chrono::nanoseconds(0);
+			}
+		}
+
+		const double j = jain_index(shares);
+		if(everyone_busy && !std::isnan(j)){
+			jain_total += j;
+			jain_windows++;
+		}
+	}
+
+	if(jain_windows > 0)
+		result.jain = jain_total / jain_windows;
+	return result;
+}
+
+	}
+}
+#endif /* STORM_FAIRNESS_METRICS_H */
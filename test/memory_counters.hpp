@@ -0,0 +1,127 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* memory_counters: Allocation counts and resident memory for the
+ *                  benchmarks.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef STORM_MEMORY_COUNTERS_H
+#define STORM_MEMORY_COUNTERS_H 1
+
+#include <array>
+#include <atomic>
+#include <optional>
+#include <limits>
+#include <fstream>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+#include "cache_line.hpp"
+#include "queue_stats.hpp"
+
+namespace storm {
+	namespace test {
+
+// How much has been allocated and freed.
+struct allocation_totals {
+	std::uint64_t allocations;
+	std::uint64_t frees;
+	std::uint64_t bytes;
+};
+
+inline allocation_totals operator-(const allocation_totals &a, const allocation_totals &b){
+	return allocation_totals{a.allocations - b.allocations, a.frees - b.frees, a.bytes - b.bytes};
+}
+
+namespace detail {
+	// Striped the same way as striped_queue_stats, so counting doesn't turn
+	// every allocation into a fight over one cache line.
+	struct alignas(cache_line_size) allocation_stripe {
+		std::atomic<std::uint64_t> allocations{0};
+		std::atomic<std::uint64_t> frees{0};
+		std::atomic<std::uint64_t> bytes{0};
+	};
+	inline std::array<allocation_stripe, 16> allocation_stripes;
+}
+
+/* count_allocation, count_free: for a replacement operator new and delete
+ * to call.
+ *
+ * This only counts. A program that wants the numbers has to replace the
+ * global operator new and delete, by including allocation_hooks.hpp from
+ * exactly one of its files. Without that, the counts just stay at zero.
+ */
+inline void count_allocation(const std::size_t bytes) noexcept {
+	detail::allocation_stripe &s = detail::allocation_stripes[
+		storm::detail::this_thread_stripe() % detail::allocation_stripes.size()];
+	s.allocations.fetch_add(1, std::memory_order_relaxed);
+	s.bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+inline void count_free() noexcept {
+	detail::allocation_stripes[
+		storm::detail::this_thread_stripe() % detail::allocation_stripes.size()
+	].frees.fetch_add(1, std::memory_order_relaxed);
+}
+
+// allocations_so_far: the totals over every thread, since the start.
+inline allocation_totals allocations_so_far() noexcept {
+	allocation_totals t{0, 0, 0};
+	for(const detail::allocation_stripe &s : detail::allocation_stripes){
+		t.allocations += s.allocations.load(std::memory_order_relaxed);
+		t.frees += s.frees.load(std::memory_order_relaxed);
+		t.bytes += s.bytes.load(std::memory_order_relaxed);
+	}
+	return t;
+}
+
+// The process's resident memory, in KiB, from /proc/self/status. Either
+// can be missing if we aren't on Linux.
+struct memory_usage {
+	std::optional<std::int64_t> rss_kib;
+	std::optional<std::int64_t> peak_rss_kib;
+};
+
+inline memory_usage read_memory_usage(){
+	memory_usage m;
+
+	std::ifstream status("/proc/self/status");
+	std::string key;
+	while(status >> key){
+		std::int64_t kib;
+		if(key == "VmRSS:" && status >> kib)
+			m.rss_kib = kib;
+		else if(key == "VmHWM:" && status >> kib)
+			m.peak_rss_kib = kib;
+		status.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+	}
+
+	return m;
+}
+
+// reset_peak_rss: start the peak resident memory over from what's resident
+// now, so it covers just what comes next. Returns false if the kernel
+// doesn't let us, in which case the peak is since the process started.
+inline bool reset_peak_rss(){
+	std::ofstream clear_refs("/proc/self/clear_refs");
+	clear_refs << "5" << std::flush;
+	return bool(clear_refs);
+}
+
+	}
+}
+#endif /* STORM_MEMORY_COUNTERS_H */
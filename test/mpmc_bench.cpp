@@ -18,26 +18,51 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 #include <iostream>
-#include <iomanip>
+#include <fstream>
 #include <thread>
 #include <future>
 #include <latch>
 #include <vector>
 #include <array>
 #include <chrono>
-#include <map>
-#include <compare>
+#include <string>
+#include <string_view>
+#include <optional>
 #include <functional>
+#include <type_traits>
+#include <charconv>
+#include <iomanip>
+#include <limits>
+
+#include <new>
 
 #include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <cmath>
+#include <algorithm>
 
 #include "mpmc_queue.hpp"
 #include "mpmc_semaphore_queue.hpp"
 #include "mpmc_test_helpers.hpp"
+#include "bench_report.hpp"
+#include "cpu_topology.hpp"
+#include "bench_pingpong.hpp"
+#include "bench_open_loop.hpp"
+#include "bench_wakeup.hpp"
+#include "bench_noise.hpp"
+#include "bench_ops.hpp"
+#include "bench_pipeline.hpp"
+#include "service_time.hpp"
+#include "bench_stats.hpp"
+#include "memory_counters.hpp"
+#include "allocation_hooks.hpp"
 using namespace storm;
 using namespace storm::test;
 
 using std::cout;
+using std::cerr;
 
 // How many producers and consumers are in a test.
 struct test_size {
@@ -45,103 +70,1497 @@ struct test_size {
 	int consumers;
 };
 
-// and we want these to be orderable like tuples.
-constexpr std::strong_ordering operator<=>(
-		const test_size &lhs,
-		const test_size &rhs){
-	return std::make_tuple(lhs.producers, lhs.consumers) <=>
-	       std::make_tuple(rhs.producers, rhs.consumers);
+// A scenario, and what it runs if you don't override anything.
+struct scenario_preset {
+	std::string_view name;
+	std::vector<test_size> sizes;
+	int items;
+	std::chrono::microseconds delay;
+	// Whether to use the stub workers instead of a real queue.
+	bool stub;
+};
+
+static const std::vector<scenario_preset> &scenario_presets(){
+	using std::chrono::microseconds;
+	using std::chrono::milliseconds;
+
+	static const std::vector<scenario_preset> presets{
+		{"normal", {{1, 1}, {1, 2}, {2, 1}, {2, 2}}, 1'000'000, microseconds(0), false},
+		{"slow", {{10, 1}, {50, 1}, {100, 1}, {100, 2}}, 10'000, milliseconds(10), false},
+		{"stub", {{1, 1}, {1, 2}, {2, 1}, {2, 2}}, 1'000'000, microseconds(0), true},
+	};
+	return presets;
+}
+
+static const scenario_preset *find_preset(std::string_view name){
+	for(const scenario_preset &p : scenario_presets())
+		if(p.name == name)
+			return &p;
+	return nullptr;
+}
+
+// The scenarios that aren't test_with_concurrency, and have their own
+// runners in benchmark().
+static constexpr std::array<std::string_view, 10> custom_scenarios{
+	"pingpong",
+	"openloop",
+	"scaling",
+	"consumers",
+	"wakeup",
+	"noise",
+	"ops",
+	"pipeline",
+	"fairness",
+	"service",
+};
+
+static bool is_scenario(std::string_view name){
+	return find_preset(name) != nullptr ||
+		std::find(custom_scenarios.begin(), custom_scenarios.end(), name) != custom_scenarios.end();
 }
 
-using test_results_map = std::map<test_size, concurrency_test_time>;
+// Everything you can pick from the command line.
+struct bench_options {
+	// Which queues to run: "mpmc", "semaphore", or "all".
+	std::string engine = "all";
+	// Which scenarios to run, by name.
+	std::vector<std::string> scenarios{"normal", "slow", "stub"};
+	// Overrides for what the presets would run.
+	std::optional<int> producers;
+	std::optional<int> consumers;
+	std::optional<int> items;
+	std::optional<std::chrono::microseconds> delay;
+	// The payloads to run, see with_payload(), and their sizes in bytes.
+	std::vector<std::string> payloads{"float"};
+	std::vector<std::size_t> payload_sizes{64};
+	// How many times to run each test, after running it warmup times and
+	// throwing those away.
+	int reps = 1;
+	int warmup = 1;
+	// Where to put the workers.
+	placement where;
+	// How consumers pop, for the scenarios that care, and the timeouts for
+	// the timed modes: one short enough to expire often, and one long enough
+	// that it mostly doesn't.
+	std::vector<pop_mode> pop_modes{pop_mode::wait, pop_mode::spin, pop_mode::backoff,
+		pop_mode::wait_for, pop_mode::wait_until};
+	std::vector<std::chrono::microseconds> timeouts{
+		std::chrono::microseconds(50), std::chrono::microseconds(5000)};
+	// The arrival patterns and offered loads, in items per second, for the
+	// open-loop scenario.
+	std::vector<arrival_pattern> arrivals{arrival_pattern::constant};
+	std::vector<std::int64_t> rates{10'000, 30'000, 100'000, 300'000, 1'000'000};
+	// The most producers or consumers for the scaling scenario, or 0 for
+	// twice std::thread::hardware_concurrency().
+	int scaling_max = 0;
+	// The neighbors for the noise scenario, and how many threads of them,
+	// or 0 for one per hardware thread.
+	std::vector<noise_kind> noises{noise_kind::cpu, noise_kind::memory};
+	int noise_threads = 0;
+	// The pipeline scenario's stages, how long each one works on an item,
+	// and where to write its queue depths over time, if anywhere.
+	int stages = 4;
+	std::chrono::nanoseconds work_time{1000};
+	std::string depth_trace;
+	// How often the fairness scenario samples every worker's progress.
+	std::chrono::microseconds sample_period{1000};
+	// The service scenario's service time distributions, their mean, and
+	// the utilizations to run them at, in percent.
+	std::vector<service_distribution> services{service_distribution::fixed,
+		service_distribution::exponential, service_distribution::bimodal};
+	std::chrono::nanoseconds service_time{10'000};
+	std::vector<int> utilizations{50, 80, 90, 95};
+	// How and where to write the results. An empty output means stdout.
+	output_format format = output_format::table;
+	std::string output;
+	// Whether to print a summary over the reps instead of every rep.
+	bool summary = false;
+	// Where to save the summary as a baseline, and a baseline to compare
+	// against, flagging regressions bigger than threshold_pct percent.
+	std::string save_baseline;
+	std::string baseline;
+	int threshold_pct = 5;
+};
+
+static void print_usage(const char *argv0){
+	cerr << "usage: " << argv0 << " [options]\n"
+	     << "  --engine=mpmc|semaphore|all   which queues to run (all)\n"
+	     << "  --scenario=NAME[,NAME...]     normal, slow, stub (default), and\n"
+	     << "                                pingpong (round trips through two\n"
+	     << "                                queues; producers ping, consumers\n"
+	     << "                                respond, items is round trips),\n"
+	     << "                                openloop (scheduled arrivals at each\n"
+	     << "                                of --rates, latency from the intended\n"
+	     << "                                send time; items defaults to 1s worth),\n"
+	     << "                                scaling (every producer x consumer count\n"
+	     << "                                in powers of two up to --scaling-max),\n"
+	     << "                                consumers (each --pop-mode and timeout,\n"
+	     << "                                saturated and with a 100us producer\n"
+	     << "                                delay unless --delay-us is given),\n"
+	     << "                                wakeup (idle CPU, then latency from a\n"
+	     << "                                push into an empty queue to an idle\n"
+	     << "                                consumer getting it, for each\n"
+	     << "                                --pop-mode; items is pushes and\n"
+	     << "                                --delay-us the gap between them),\n"
+	     << "                                noise (normal workers, quiet and then\n"
+	     << "                                next to each kind of --noise),\n"
+	     << "                                ops (what each call costs on one\n"
+	     << "                                thread, in TSC ticks; items is samples),\n"
+	     << "                                pipeline (--stages of --consumers workers\n"
+	     << "                                each, chained by queues, doing --work-ns\n"
+	     << "                                of work per item per stage),\n"
+	     << "                                fairness (Jain's index and the longest\n"
+	     << "                                starvation for each side, each\n"
+	     << "                                --pop-mode, sampled every --sample-us),\n"
+	     << "                                service (Poisson arrivals to consumers\n"
+	     << "                                that each spend --service-ns per item,\n"
+	     << "                                at each --utilization)\n"
+	     << "  --producers=N                 override the preset producer counts\n"
+	     << "  --consumers=N                 override the preset consumer counts\n"
+	     << "  --items=N                     items per test\n"
+	     << "  --payload=KIND[,KIND...]      float, blob (trivially copyable),\n"
+	     << "                                heap (move-only unique_ptr), string,\n"
+	     << "                                or all (float)\n"
+	     << "  --payload-size=N[,N...]       payload bytes: 16, 64, 256, 1024, 4096,\n"
+	     << "                                or all; strings take any size (64)\n"
+	     << "  --delay-us=N                  producer delay between pushes\n"
+	     << "  --reps=N                      repetitions of each test (1)\n"
+	     << "  --warmup=N                    unrecorded runs before the reps (1)\n"
+	     << "  --pop-mode=MODE[,MODE...]     wait, spin, backoff, wait_for,\n"
+	     << "                                wait_until: how pingpong and consumers\n"
+	     << "                                pop (all)\n"
+	     << "  --timeout-us=N[,N...]         timeouts for the timed pops (50,5000)\n"
+	     << "  --arrival=PATTERN[,...]       constant, poisson, bursty (constant)\n"
+	     << "  --rates=N[,N...]              openloop offered loads in items/s\n"
+	     << "  --scaling-max=N               most workers per side for scaling\n"
+	     << "                                (2 x hardware_concurrency)\n"
+	     << "  --noise=KIND[,KIND...]        cpu, memory: hogs for noise (both)\n"
+	     << "  --noise-threads=N             how many hogs (hardware_concurrency)\n"
+	     << "  --stages=N                    pipeline stages (4)\n"
+	     << "  --work-ns=N                   pipeline work per item per stage (1000)\n"
+	     << "  --depth-trace=FILE            write pipeline queue depths over time\n"
+	     << "                                to FILE as CSV\n"
+	     << "  --sample-us=N                 fairness sampling period (1000)\n"
+	     << "  --service=DIST[,DIST...]      fixed, exponential, bimodal: service\n"
+	     << "                                time distributions (all)\n"
+	     << "  --service-ns=N                mean service time per item (10000)\n"
+	     << "  --utilization=N[,N...]        consumer utilizations to run the\n"
+	     << "                                service scenario at, in percent\n"
+	     << "                                (50,80,90,95)\n"
+	     << "  --placement=STRATEGY          none, compact, scatter, smt, or\n"
+	     << "                                cpus:N,N,... to pin workers (none)\n"
+	     << "  --format=table|json|csv       output format (table)\n"
+	     << "  --output=FILE                 write results to FILE, not stdout\n"
+	     << "  --summary                     print median, min, stddev, and 95% CI\n"
+	     << "                                over the reps instead of every rep\n"
+	     << "  --save-baseline=FILE          save the summary as a baseline\n"
+	     << "  --baseline=FILE               compare against a saved baseline, and\n"
+	     << "                                exit with 3 on any regression\n"
+	     << "  --threshold-pct=N             smallest change that counts as a\n"
+	     << "                                regression, in percent (5)\n";
+}
+
+// parse_pop_mode: turn a name into a pop_mode.
+static std::optional<pop_mode> parse_pop_mode(std::string_view name){
+	for(const pop_mode m : {pop_mode::wait, pop_mode::spin, pop_mode::backoff,
+			pop_mode::wait_for, pop_mode::wait_until})
+		if(name == pop_mode_name(m))
+			return m;
+	return std::nullopt;
+}
+
+// parse_options: fill in bench_options from argv, or complain and return
+// nothing.
+static std::optional<bench_options> parse_options(int argc, char **argv){
+	bench_options opts;
+
+	for(int i = 1; i < argc; i++){
+		const std::string_view arg(argv[i]);
+		const auto eq = arg.find('=');
+		const std::string_view name = arg.substr(0, eq);
+		const std::string_view value = eq == std::string_view::npos ?
+			std::string_view() : arg.substr(eq + 1);
 
-static void print_results(const test_results_map &map){
-	using std::setw;
-	using std::right;
-	// Might as well do it by value, since it's like 16 bytes.
-	// But GCC warns on that, and I don't know an idiom to surpress it.
-	for(const auto & [concurrency, times] : map){
-		cout << right << setw(3) << concurrency.producers << " Producer ";
-		cout << right << setw(2) << concurrency.consumers << " Consumer, ";
-		cout << "wall: " << right << setw(14) << times.wall_time;
-		cout << " cpu: " << right << setw(11) << times.cpu_time << '\n';
+		bool ok = true;
+		if(name == "--help" || name == "-h"){
+			print_usage(argv[0]);
+			return std::nullopt;
+		}else if(name == "--engine"){
+			opts.engine = value;
+			ok = value == "mpmc" || value == "semaphore" || value == "all";
+		}else if(name == "--scenario"){
+			opts.scenarios = split_list(value);
+			for(const std::string &s : opts.scenarios)
+				ok = ok && is_scenario(s);
+		}else if(name == "--producers"){
+			opts.producers = parse_int<int>(value);
+			ok = opts.producers.value_or(0) > 0;
+		}else if(name == "--consumers"){
+			opts.consumers = parse_int<int>(value);
+			ok = opts.consumers.value_or(0) > 0;
+		}else if(name == "--items"){
+			opts.items = parse_int<int>(value);
+			ok = opts.items.value_or(0) > 0;
+		}else if(name == "--payload"){
+			opts.payloads = value == "all" ?
+				std::vector<std::string>{"float", "blob", "heap", "string"} :
+				split_list(value);
+			for(const std::string &kind : opts.payloads)
+				ok = ok && (kind == "float" || kind == "blob" || kind == "heap" || kind == "string");
+		}else if(name == "--payload-size"){
+			opts.payload_sizes.clear();
+			for(const std::string &size : split_list(value == "all" ? "16,64,256,1024,4096" : value)){
+				const auto sz = parse_int<std::size_t>(size);
+				ok = ok && sz.has_value();
+				opts.payload_sizes.push_back(sz.value_or(0));
+			}
+		}else if(name == "--delay-us"){
+			const auto us = parse_int<std::int64_t>(value);
+			ok = us.has_value();
+			opts.delay = std::chrono::microseconds(us.value_or(0));
+		}else if(name == "--reps"){
+			const auto reps = parse_int<int>(value);
+			ok = reps.value_or(0) > 0;
+			opts.reps = reps.value_or(1);
+		}else if(name == "--warmup"){
+			const auto warmup = parse_int<int>(value);
+			ok = warmup.has_value();
+			opts.warmup = warmup.value_or(0);
+		}else if(name == "--pop-mode"){
+			opts.pop_modes.clear();
+			for(const std::string &m : split_list(value)){
+				const auto mode = parse_pop_mode(m);
+				ok = ok && mode.has_value();
+				opts.pop_modes.push_back(mode.value_or(pop_mode::wait));
+			}
+		}else if(name == "--timeout-us"){
+			opts.timeouts.clear();
+			for(const std::string &t : split_list(value)){
+				const auto us = parse_int<std::int64_t>(t);
+				ok = ok && us.value_or(0) > 0;
+				opts.timeouts.push_back(std::chrono::microseconds(us.value_or(1)));
+			}
+		}else if(name == "--arrival"){
+			opts.arrivals.clear();
+			for(const std::string &a : split_list(value)){
+				const auto p = parse_arrival_pattern(a);
+				ok = ok && p.has_value();
+				opts.arrivals.push_back(p.value_or(arrival_pattern::constant));
+			}
+		}else if(name == "--rates"){
+			opts.rates.clear();
+			for(const std::string &r : split_list(value)){
+				const auto rate = parse_int<std::int64_t>(r);
+				ok = ok && rate.value_or(0) > 0;
+				opts.rates.push_back(rate.value_or(1));
+			}
+		}else if(name == "--scaling-max"){
+			const auto n = parse_int<int>(value);
+			ok = n.value_or(0) > 0;
+			opts.scaling_max = n.value_or(0);
+		}else if(name == "--noise"){
+			opts.noises.clear();
+			for(const std::string &n : split_list(value)){
+				const auto kind = parse_noise_kind(n);
+				ok = ok && kind.value_or(noise_kind::none) != noise_kind::none;
+				opts.noises.push_back(kind.value_or(noise_kind::none));
+			}
+		}else if(name == "--noise-threads"){
+			const auto n = parse_int<int>(value);
+			ok = n.value_or(0) > 0;
+			opts.noise_threads = n.value_or(0);
+		}else if(name == "--stages"){
+			const auto n = parse_int<int>(value);
+			ok = n.value_or(0) > 0;
+			opts.stages = n.value_or(1);
+		}else if(name == "--work-ns"){
+			const auto ns = parse_int<std::int64_t>(value);
+			ok = ns.has_value();
+			opts.work_time = std::chrono::nanoseconds(ns.value_or(0));
+		}else if(name == "--depth-trace"){
+			opts.depth_trace = value;
+			ok = !value.empty();
+		}else if(name == "--sample-us"){
+			const auto us = parse_int<std::int64_t>(value);
+			ok = us.value_or(0) > 0;
+			opts.sample_period = std::chrono::microseconds(us.value_or(1));
+		}else if(name == "--service"){
+			opts.services.clear();
+			for(const std::string &d : split_list(value)){
+				const auto dist = parse_service_distribution(d);
+				ok = ok && dist.has_value();
+				opts.services.push_back(dist.value_or(service_distribution::fixed));
+			}
+		}else if(name == "--service-ns"){
+			const auto ns = parse_int<std::int64_t>(value);
+			ok = ns.value_or(0) > 0;
+			opts.service_time = std::chrono::nanoseconds(ns.value_or(1));
+		}else if(name == "--utilization"){
+			opts.utilizations.clear();
+			for(const std::string &u : split_list(value)){
+				const auto pct = parse_int<int>(u);
+				ok = ok && pct.value_or(0) > 0;
+				opts.utilizations.push_back(pct.value_or(1));
+			}
+		}else if(name == "--placement"){
+			const auto p = parse_placement(value);
+			ok = p.has_value();
+			opts.where = p.value_or(placement());
+		}else if(name == "--format"){
+			const auto f = parse_output_format(value);
+			ok = f.has_value();
+			opts.format = f.value_or(output_format::table);
+		}else if(name == "--output"){
+			opts.output = value;
+			ok = !value.empty();
+		}else if(name == "--summary"){
+			opts.summary = true;
+			ok = value.empty();
+		}else if(name == "--save-baseline"){
+			opts.save_baseline = value;
+			ok = !value.empty();
+		}else if(name == "--baseline"){
+			opts.baseline = value;
+			ok = !value.empty();
+		}else if(name == "--threshold-pct"){
+			const auto pct = parse_int<int>(value);
+			ok = pct.has_value();
+			opts.threshold_pct = pct.value_or(0);
+		}else{
+			cerr << "unknown option: " << arg << '\n';
+			print_usage(argv[0]);
+			return std::nullopt;
+		}
+
+		if(!ok){
+			cerr << "bad value for " << name << ": '" << value << "'\n";
+			print_usage(argv[0]);
+			return std::nullopt;
+		}
 	}
+
+	return opts;
+}
+
+// One payload to run: its kind and how many bytes it carries.
+struct payload_choice {
+	std::string kind;
+	std::size_t size;
+};
+
+// payload_choices: every combination of payload kind and size. float only
+// comes in one size.
+static std::vector<payload_choice> payload_choices(const bench_options &opts){
+	std::vector<payload_choice> out;
+	for(const std::string &kind : opts.payloads){
+		if(kind == "float"){
+			out.push_back(payload_choice{kind, sizeof(float)});
+			continue;
+		}
+		for(const std::size_t size : opts.payload_sizes)
+			out.push_back(payload_choice{kind, size});
+	}
+	return out;
+}
+
+// with_sized: call f with the Payload<N> for a size we compiled in.
+template<template<std::size_t> typename Payload, typename F>
+static bool with_sized(const std::size_t size, F &&f){
+	switch(size){
+	case 16: f(std::type_identity<Payload<16>>()); return true;
+	case 64: f(std::type_identity<Payload<64>>()); return true;
+	case 256: f(std::type_identity<Payload<256>>()); return true;
+	case 1024: f(std::type_identity<Payload<1024>>()); return true;
+	case 4096: f(std::type_identity<Payload<4096>>()); return true;
+	default: return false;
+	}
+}
+
+// with_payload: call f with a std::type_identity of the payload type for a
+// choice. Returns false if there's no such payload.
+template<typename F>
+static bool with_payload(const payload_choice &p, F &&f){
+	if(p.kind == "float"){
+		f(std::type_identity<float>());
+		return true;
+	}
+	if(p.kind == "string"){
+		f(std::type_identity<std::string>());
+		return true;
+	}
+	if(p.kind == "heap")
+		return with_sized<heap_handle>(p.size, f);
+	return with_sized<blob>(p.size, f);
+}
+
+// payload_name: a name for the payload type, for the results.
+static std::string payload_name(const payload_choice &p){
+	if(p.kind == "float")
+		return "float";
+	return p.kind + std::to_string(p.size);
+}
+
+// What to run, after the options have been applied to a preset.
+struct scenario_config {
+	std::string name;
+	std::vector<test_size> sizes;
+	int items;
+	std::chrono::microseconds delay;
+	bool stub;
+};
+
+static scenario_config configure(const scenario_preset &p, const bench_options &opts,
+		const payload_choice &payload){
+	// A fast producer can get a long way ahead of the consumers, so unless
+	// you asked for a number of items, keep the worst case for big payloads
+	// down to a few hundred MiB.
+	static constexpr std::size_t max_payload_bytes = 256 << 20;
+	const int default_items = int(std::min<std::size_t>(p.items,
+		std::max<std::size_t>(1000, max_payload_bytes / payload.size)));
+
+	scenario_config c{std::string(p.name), p.sizes, opts.items.value_or(default_items),
+		opts.delay.value_or(p.delay), p.stub};
+
+	// If you only give one of producers and consumers, the other comes from
+	// each of the preset sizes.
+	if(opts.producers || opts.consumers){
+		for(test_size &t : c.sizes){
+			t.producers = opts.producers.value_or(t.producers);
+			t.consumers = opts.consumers.value_or(t.consumers);
+		}
+		// That might have made duplicates.
+		std::vector<test_size> unique;
+		for(const test_size &t : c.sizes){
+			bool seen = false;
+			for(const test_size &u : unique)
+				seen = seen || (u.producers == t.producers && u.consumers == t.consumers);
+			if(!seen)
+				unique.push_back(t);
+		}
+		c.sizes = std::move(unique);
+	}
+
+	return c;
+}
+
+// run_test: run one test, picking the workers the scenario wants.
+template<typename Queue, typename T>
+static concurrency_test_time run_test(const scenario_config &c, const test_size t,
+		const T &value, const harness_options &options){
+	if(c.stub)
+		return test_with_concurrency<Queue, T>(
+			t.producers, t.consumers, value, c.items, c.delay,
+			stub_producer<Queue, T>, stub_consumer<Queue, T>, options);
+	if(c.delay.count() > 0)
+		return test_with_concurrency<Queue, T>(
+			t.producers, t.consumers, value, c.items, c.delay,
+			slow_producer<Queue, T>, normal_consumer<Queue, T>, options);
+	return test_with_concurrency<Queue, T>(
+		t.producers, t.consumers, value, c.items, c.delay,
+		normal_producer<Queue, T>, normal_consumer<Queue, T>, options);
+}
+
+// join_cpus: list the CPUs the workers were pinned to.
+static std::string join_cpus(const std::vector<int> &cpus){
+	if(cpus.empty())
+		return "-";
+
+	std::string s;
+	for(std::size_t i = 0; i < cpus.size(); i++)
+		s += (i == 0 ? "" : " ") + std::to_string(cpus[i]);
+	return s;
+}
+
+// timeouts_for: the timeouts to run a pop_mode with. The untimed modes just
+// get one run, with a timeout of 0.
+static std::vector<std::chrono::microseconds> timeouts_for(const pop_mode mode,
+		const bench_options &opts){
+	if(pop_mode_timed(mode))
+		return opts.timeouts;
+	return {std::chrono::microseconds(0)};
 }
 
+// report_comparisons: print the regressions and improvements against a
+// baseline, and return how many regressions there were.
+static int report_comparisons(const std::vector<comparison> &comparisons){
+	int regressions = 0;
+	int improvements = 0;
+	for(const comparison &c : comparisons){
+		if(!c.regression && !c.improvement)
+			continue;
+		(c.regression ? regressions : improvements)++;
+
+		cerr << (c.regression ? "REGRESSION " : "improvement ") << c.current->key
+		     << ' ' << c.current->metric << ": " << format_number(c.baseline->stats.mean)
+		     << " -> " << format_number(c.current->stats.mean) << " ("
+		     << std::showpos << std::fixed << std::setprecision(1) << c.change * 100
+		     << std::noshowpos << "%, t=" << std::setprecision(2) << c.t
+		     << ", df=" << std::setprecision(1) << c.df << ")\n" << std::defaultfloat;
+	}
+
+	const auto untestable = std::count_if(comparisons.begin(), comparisons.end(),
+		[](const comparison &c){ return c.current->stats.n < 2 || c.baseline->stats.n < 2; });
+	cerr << "Compared " << comparisons.size() << " measurements to the baseline: "
+	     << regressions << " regressions, " << improvements << " improvements";
+	if(untestable > 0)
+		cerr << ", " << untestable << " without enough reps to test";
+	cerr << ".\n";
+
+	return regressions;
+}
+
+// make_record: turn one test's results into a record.
+static bench_record make_record(const std::string &engine,
+		const std::string &payload, const scenario_config &c,
+		const test_size t, const int rep, const harness_options &options,
+		const concurrency_test_time &times){
+	using std::chrono::duration;
+	using std::chrono::nanoseconds;
+
+	bench_record r;
+	r.label("scenario", c.name)
+	 .label("engine", engine)
+	 .label("payload", payload)
+	 .metric("producers", t.producers)
+	 .metric("consumers", t.consumers)
+	 .metric("items", c.items)
+	 .metric("delay_us", double(c.delay.count()))
+	 .metric("rep", rep)
+	 .label("topology", describe_topology(*options.topology))
+	 .label("placement", placement_name(options.where))
+	 .label("cpus", join_cpus(times.cpus));
+
+	const double seconds = duration<double>(times.wall_time).count();
+	r.metric("wall_ns", double(nanoseconds(times.wall_time).count()))
+	 .metric("cpu_ns", double(times.cpu_time) * 1e9 / CLOCKS_PER_SEC)
+	 .metric("items_per_s", std::round(c.items / seconds));
+
+	// The stubs don't have any latency to report.
+	add_latency_metrics(r, "", times.latency);
+	const double none = std::numeric_limits<double>::quiet_NaN();
+
+	// Hardware counters and context switches, per item. The counters come
+	// out empty if perf events aren't allowed here.
+	const auto per_item = [&](const std::optional<std::uint64_t> &v){
+		return v ? double(*v) / c.items : none;
+	};
+	r.metric("cycles_per_item", per_item(times.perf[perf_cycles]))
+	 .metric("instructions_per_item", per_item(times.perf[perf_instructions]))
+	 .metric("cache_misses_per_item", per_item(times.perf[perf_cache_misses]))
+	 .metric("branch_misses_per_item", per_item(times.perf[perf_branch_misses]))
+	 .metric("vol_switches_per_item", double(times.switches.voluntary) / c.items)
+	 .metric("invol_switches_per_item", double(times.switches.involuntary) / c.items);
+
+	// What the queue (and the payloads) cost in memory. The RSS growth is
+	// from the start of the test to its peak, so it's mostly the queue's
+	// backlog. The kernel only updates the peak every so often, so it can
+	// come out a little under where we started.
+	const auto kib = [&](const std::optional<std::int64_t> &v){
+		return v ? double(*v) : none;
+	};
+	r.metric("allocs_per_item", double(times.allocations.allocations) / c.items)
+	 .metric("alloc_bytes_per_item", double(times.allocations.bytes) / c.items)
+	 .metric("peak_rss_kib", kib(times.peak_rss_kib))
+	 .metric("rss_growth_kib", times.peak_rss_kib && times.memory_start.rss_kib ?
+		double(std::max<std::int64_t>(0, *times.peak_rss_kib - *times.memory_start.rss_kib)) : none);
+
+	return r;
+}
+
+// run_pingpong: the round-trip latency scenario, see ping_pong().
 template<template<typename> typename Queue>
-void benchmark(){
-	using std::chrono::milliseconds;
+static void run_pingpong(const std::string &engine, const bench_options &opts,
+		const harness_options &options, std::vector<bench_record> &records){
+	using token = std::chrono::steady_clock::time_point;
+
+	const int pingers = opts.producers.value_or(1);
+	const int responders = opts.consumers.value_or(1);
+	const int round_trips = opts.items.value_or(100'000);
+
+	cerr << "Running pingpong benchmarks.\n";
+	for(const pop_mode mode : opts.pop_modes){
+		for(const std::chrono::microseconds timeout : timeouts_for(mode, opts)){
+			for(int rep = -opts.warmup; rep < opts.reps; rep++){
+				cerr << pingers << "p" << responders << "r " << pop_mode_name(mode) << ": " << std::flush;
+				const pingpong_result result = ping_pong<Queue<token>>(
+					pingers, responders, round_trips, mode, timeout, options);
+				if(warmed_up(rep))
+					continue;
+
+				bench_record r;
+				r.label("scenario", "pingpong")
+				 .label("engine", engine)
+				 .label("pop_mode", pop_mode_name(mode))
+				 .metric("timeout_us", double(timeout.count()))
+				 .metric("pingers", pingers)
+				 .metric("responders", responders)
+				 .metric("round_trips", round_trips)
+				 .metric("rep", rep)
+				 .label("topology", describe_topology(*options.topology))
+				 .label("placement", placement_name(options.where))
+				 .label("cpus", join_cpus(result.cpus))
+				 .metric("wall_ns", double(std::chrono::nanoseconds(result.wall_time).count()))
+				 .metric("round_trips_per_s", std::round(round_trips /
+					std::chrono::duration<double>(result.wall_time).count()));
+				add_latency_metrics(r, "rtt_", result.rtt);
+				records.push_back(std::move(r));
+
+				cerr << "done\n";
+			}
+		}
+	}
+}
+
+// run_wakeup: the idle wakeup scenario, see wakeup().
+template<template<typename> typename Queue>
+static void run_wakeup(const std::string &engine, const bench_options &opts,
+		const harness_options &options, std::vector<bench_record> &records){
+	using token = std::chrono::steady_clock::time_point;
+
+	const int consumers = opts.consumers.value_or(1);
+	const int wakeups = opts.items.value_or(1000);
+	const std::chrono::microseconds gap = opts.delay.value_or(std::chrono::microseconds(1000));
+
+	cerr << "Running wakeup benchmarks.\n";
+	for(const pop_mode mode : opts.pop_modes){
+		for(const std::chrono::microseconds timeout : timeouts_for(mode, opts)){
+			for(int rep = -opts.warmup; rep < opts.reps; rep++){
+				cerr << consumers << "c " << pop_mode_name(mode) << ": " << std::flush;
+				const wakeup_result result = wakeup<Queue<token>>(
+					consumers, wakeups, gap, mode, timeout, options);
+				if(warmed_up(rep))
+					continue;
+
+				bench_record r;
+				r.label("scenario", "wakeup")
+				 .label("engine", engine)
+				 .label("pop_mode", pop_mode_name(mode))
+				 .metric("timeout_us", double(timeout.count()))
+				 .metric("consumers", consumers)
+				 .metric("wakeups", wakeups)
+				 .metric("gap_us", double(gap.count()))
+				 .metric("rep", rep)
+				 .label("topology", describe_topology(*options.topology))
+				 .label("placement", placement_name(options.where))
+				 .label("cpus", join_cpus(result.cpus))
+				 .metric("idle_cpu_pct", result.idle_cpu * 100);
+				add_latency_metrics(r, "wake_", result.wake);
+				records.push_back(std::move(r));
+
+				cerr << "done\n";
+			}
+		}
+	}
+}
+
+// run_openloop_point: one point on the open-loop curve.
+template<typename Queue, typename T>
+static concurrency_test_time run_openloop_point(const arrival_pattern pattern,
+		const test_size t, const int items, const std::chrono::steady_clock::duration gap,
+		const harness_options &options){
+	const T value{};
+
+	switch(pattern){
+	case arrival_pattern::poisson:
+		return test_with_concurrency<Queue, T>(t.producers, t.consumers, value, items, gap,
+			open_loop_producer<Queue, T, arrival_pattern::poisson>,
+			normal_consumer<Queue, T>, options);
+	case arrival_pattern::bursty:
+		return test_with_concurrency<Queue, T>(t.producers, t.consumers, value, items, gap,
+			open_loop_producer<Queue, T, arrival_pattern::bursty>,
+			normal_consumer<Queue, T>, options);
+	case arrival_pattern::constant:
+		break;
+	}
+	return test_with_concurrency<Queue, T>(t.producers, t.consumers, value, items, gap,
+		open_loop_producer<Queue, T, arrival_pattern::constant>,
+		normal_consumer<Queue, T>, options);
+}
+
+/* run_openloop: the open-loop scenario.
+ *
+ * For each offered load, the producers push on a schedule and we measure
+ * the latency from when each item was supposed to be sent. Put together,
+ * that's a throughput versus tail latency curve, which goes vertical
+ * wherever the queue stops keeping up.
+ */
+template<template<typename> typename Queue>
+static void run_openloop(const std::string &engine, const bench_options &opts,
+		const harness_options &options, std::vector<bench_record> &records){
+	using std::chrono::duration;
+	using std::chrono::steady_clock;
+	using item = stamped_item<float>;
+
+	const test_size t{opts.producers.value_or(1), opts.consumers.value_or(1)};
+
+	cerr << "Running openloop benchmarks.\n";
+	for(const arrival_pattern pattern : opts.arrivals){
+		for(const std::int64_t rate : opts.rates){
+			// Each producer does its share of the rate.
+			const auto gap = std::chrono::duration_cast<steady_clock::duration>(
+				duration<double>(double(t.producers) / double(rate)));
+			const int items = opts.items.value_or(int(std::max<std::int64_t>(1000, rate)));
+
+			for(int rep = -opts.warmup; rep < opts.reps; rep++){
+				cerr << arrival_pattern_name(pattern) << ' ' << rate << "/s: " << std::flush;
+				const concurrency_test_time times = run_openloop_point<Queue<item>, item>(
+					pattern, t, items, gap, options);
+				if(warmed_up(rep))
+					continue;
+
+				bench_record r;
+				r.label("scenario", "openloop")
+				 .label("engine", engine)
+				 .label("arrival", arrival_pattern_name(pattern))
+				 .metric("producers", t.producers)
+				 .metric("consumers", t.consumers)
+				 .metric("offered_per_s", double(rate))
+				 .metric("items", items)
+				 .metric("rep", rep)
+				 .label("topology", describe_topology(*options.topology))
+				 .label("placement", placement_name(options.where))
+				 .label("cpus", join_cpus(times.cpus))
+				 .metric("wall_ns", double(std::chrono::nanoseconds(times.wall_time).count()))
+				 .metric("cpu_ns", double(times.cpu_time) * 1e9 / CLOCKS_PER_SEC)
+				 .metric("items_per_s", std::round(items / duration<double>(times.wall_time).count()));
+				add_latency_metrics(r, "", times.latency);
+				records.push_back(std::move(r));
+
+				cerr << "done\n";
+			}
+		}
+	}
+}
+
+// run_service_point: one utilization level with one service distribution.
+template<typename Queue, typename T>
+static concurrency_test_time run_service_point(const service_distribution dist,
+		const test_size t, const int items, const std::chrono::steady_clock::duration gap,
+		const harness_options &options){
+	const T value{};
+	const auto producer = open_loop_producer<Queue, T, arrival_pattern::poisson>;
+
+	switch(dist){
+	case service_distribution::exponential:
+		return test_with_concurrency<Queue, T>(t.producers, t.consumers, value, items, gap,
+			producer, service_consumer<Queue, T, service_distribution::exponential>, options);
+	case service_distribution::bimodal:
+		return test_with_concurrency<Queue, T>(t.producers, t.consumers, value, items, gap,
+			producer, service_consumer<Queue, T, service_distribution::bimodal>, options);
+	case service_distribution::fixed:
+		break;
+	}
+	return test_with_concurrency<Queue, T>(t.producers, t.consumers, value, items, gap,
+		producer, service_consumer<Queue, T, service_distribution::fixed>, options);
+}
+
+/* run_service: the service time scenario.
+ *
+ * The consumers spend --service-ns on each item on average, and the
+ * producers send Poisson arrivals at whatever rate makes the consumers that
+ * busy, so this is an M/G/c queue with the queue under test in the middle.
+ * Queueing theory says the wait blows up as utilization gets near 100%,
+ * and faster the more the service time varies; what we want to see is how
+ * much worse than that each engine makes it, from its own overhead and from
+ * waking consumers up. The latencies are how long items waited in the
+ * queue, not counting their own service.
+ */
+template<template<typename> typename Queue>
+static void run_service(const std::string &engine, const bench_options &opts,
+		const harness_options &options, std::vector<bench_record> &records){
+	using std::chrono::duration;
+	using std::chrono::steady_clock;
+	using item = stamped_item<float>;
+
+	const test_size t{opts.producers.value_or(1), opts.consumers.value_or(2)};
+	const double service_s = duration<double>(opts.service_time).count();
+
+	harness_options service_options = options;
+	service_options.service_time = opts.service_time;
+	// Calibrate before anything's timed.
+	calibrated_busy_work();
 
-	// Here's where we store our results.
-	test_results_map test_results;
+	cerr << "Running service benchmarks.\n";
+	for(const service_distribution dist : opts.services){
+		for(const int utilization : opts.utilizations){
+			// How fast the consumers could go flat out, and the share of
+			// that we offer, split between the producers.
+			const double rate = utilization / 100.0 * t.consumers / service_s;
+			const auto gap = std::chrono::duration_cast<steady_clock::duration>(
+				duration<double>(t.producers / rate));
+			// Half a second's worth by default.
+			const int items = opts.items.value_or(std::max(1000, int(rate / 2)));
 
-	static constexpr int num_items = 1'000'000;
+			for(int rep = -opts.warmup; rep < opts.reps; rep++){
+				cerr << service_distribution_name(dist) << ' ' << utilization << "%: " << std::flush;
+				const concurrency_test_time times = run_service_point<Queue<item>, item>(
+					dist, t, items, gap, service_options);
+				if(warmed_up(rep))
+					continue;
 
-	static constexpr std::array test_sizes(std::to_array<test_size>({
-		{1, 1},
-		{1, 2},
-		{2, 1},
-		{2, 2},
-	}));
+				const double per_s = items / duration<double>(times.wall_time).count();
 
-	cout << "Running basic normal benchmarks.\n";
-	for(const auto t : test_sizes){
-		cout << t.producers << 'p' << t.consumers << "c: " << std::flush;
-		test_results.insert_or_assign(
-			t,
-			test_with_concurrency<Queue<float>, float>(
-				t.producers, t.consumers, 1.0f, num_items, milliseconds(0),
-				normal_producer<Queue<float>, float>, normal_consumer<Queue<float>, float>));
-		cout << "done\n";
+				bench_record r;
+				r.label("scenario", "service")
+				 .label("engine", engine)
+				 .label("service", service_distribution_name(dist))
+				 .metric("service_ns", double(opts.service_time.count()))
+				 .metric("utilization_pct", utilization)
+				 .metric("producers", t.producers)
+				 .metric("consumers", t.consumers)
+				 .metric("offered_per_s", std::round(rate))
+				 .metric("items", items)
+				 .metric("rep", rep)
+				 .label("topology", describe_topology(*options.topology))
+				 .label("placement", placement_name(options.where))
+				 .label("cpus", join_cpus(times.cpus))
+				 .metric("wall_ns", double(std::chrono::nanoseconds(times.wall_time).count()))
+				 .metric("cpu_ns", double(times.cpu_time) * 1e9 / CLOCKS_PER_SEC)
+				 .metric("items_per_s", std::round(per_s))
+				 .metric("achieved_util_pct", per_s * service_s / t.consumers * 100);
+				add_latency_metrics(r, "wait_", times.latency);
+				records.push_back(std::move(r));
+
+				cerr << "done\n";
+			}
+		}
 	}
+}
+
+/* run_consumers: the consumers scenario.
+ *
+ * Runs mode_consumer with each --pop-mode, and each timeout for the timed
+ * ones, to see what polling and timed waits cost. Each one runs with the
+ * queue saturated, and with the producer pushing every 100us, where the
+ * consumers spend most of their time waiting and short timeouts expire. For
+ * the timed modes, we also report how many pops timed out and how late
+ * they came back.
+ */
+template<template<typename> typename Queue>
+static void run_consumers(const std::string &engine, const bench_options &opts,
+		const harness_options &options, std::vector<bench_record> &records){
+	using std::chrono::duration;
+	using std::chrono::microseconds;
+	using item = stamped_item<float>;
+
+	const test_size t{opts.producers.value_or(1), opts.consumers.value_or(2)};
+	const std::vector<microseconds> delays = opts.delay ?
+		std::vector<microseconds>{*opts.delay} :
+		std::vector<microseconds>{microseconds(0), microseconds(100)};
+	const item value{};
+
+	cerr << "Running consumers benchmarks.\n";
+	for(const microseconds delay : delays){
+		// Sparse traffic takes a lot longer per item.
+		const int items = opts.items.value_or(delay.count() > 0 ? 5'000 : 200'000);
+
+		for(const pop_mode mode : opts.pop_modes){
+			for(const microseconds timeout : timeouts_for(mode, opts)){
+				harness_options mode_options = options;
+				mode_options.mode = mode;
+				mode_options.timeout = timeout;
 
-	print_results(test_results);
+				for(int rep = -opts.warmup; rep < opts.reps; rep++){
+					cerr << t.producers << 'p' << t.consumers << "c " << pop_mode_name(mode)
+					     << ": " << std::flush;
+					const concurrency_test_time times = test_with_concurrency<Queue<item>, item>(
+						t.producers, t.consumers, value, items, delay,
+						delay.count() > 0 ? slow_producer<Queue<item>, item> :
+							normal_producer<Queue<item>, item>,
+						mode_consumer<Queue<item>, item>, mode_options);
+					if(warmed_up(rep))
+						continue;
 
-	test_results_map slow_results;
+					const double cpu_ns = double(times.cpu_time) * 1e9 / CLOCKS_PER_SEC;
 
-	static constexpr int slow_items = 10'000;
-	static constexpr std::array slow_test_sizes(std::to_array<test_size>({
-		{10, 1},
-		{50, 1},
-		{100, 1},
-		{100, 2},
-	}));
+					bench_record r;
+					r.label("scenario", "consumers")
+					 .label("engine", engine)
+					 .label("pop_mode", pop_mode_name(mode))
+					 .metric("timeout_us", double(timeout.count()))
+					 .metric("producers", t.producers)
+					 .metric("consumers", t.consumers)
+					 .metric("delay_us", double(delay.count()))
+					 .metric("items", items)
+					 .metric("rep", rep)
+					 .label("topology", describe_topology(*options.topology))
+					 .label("placement", placement_name(options.where))
+					 .label("cpus", join_cpus(times.cpus))
+					 .metric("wall_ns", double(std::chrono::nanoseconds(times.wall_time).count()))
+					 .metric("items_per_s", std::round(items / duration<double>(times.wall_time).count()))
+					 .metric("cpu_ns_per_item", cpu_ns / items);
+					add_latency_metrics(r, "", times.latency);
+					r.metric("timeouts_per_item", double(times.timeout_overshoot.count()) / items);
+					add_latency_metrics(r, "overshoot_", times.timeout_overshoot);
+					records.push_back(std::move(r));
 
-	cout << "Running slow-producer benchmarks.\n";
-	for(const auto t : slow_test_sizes){
-		cout << t.producers << 'p' << t.consumers << "c: " << std::flush;
-		slow_results.insert_or_assign(
-			t,
-			test_with_concurrency<Queue<float>, float>(
-				t.producers, t.consumers, 1.0f, slow_items, milliseconds(10),
-				slow_producer<Queue<float>, float>, normal_consumer<Queue<float>, float>));
-		cout << "done\n";
+					cerr << "done\n";
+				}
+			}
+		}
 	}
+}
+
+/* run_fairness: the fairness scenario.
+ *
+ * Runs mode_consumer with each --pop-mode, sampling how far every worker
+ * has gotten as it goes. A queue can have great throughput by letting
+ * whoever has the lock (or the cache line) keep it, and leave the other
+ * workers waiting: Jain's index over each sampling window shows how
+ * evenly the items were spread, and the longest starvation shows the
+ * worst any one worker waited while it had work to do, along with each
+ * worker's own longest wait. There have to be at least two workers on a
+ * side for its numbers to mean anything.
+ */
+template<template<typename> typename Queue>
+static void run_fairness(const std::string &engine, const bench_options &opts,
+		const harness_options &options, std::vector<bench_record> &records){
+	using std::chrono::duration;
+	using std::chrono::microseconds;
+	using item = stamped_item<float>;
+
+	const test_size t{opts.producers.value_or(4), opts.consumers.value_or(4)};
+	const int items = opts.items.value_or(1'000'000);
+	const item value{};
+
+	cerr << "Running fairness benchmarks.\n";
+	for(const pop_mode mode : opts.pop_modes){
+		for(const microseconds timeout : timeouts_for(mode, opts)){
+			harness_options mode_options = options;
+			mode_options.mode = mode;
+			mode_options.timeout = timeout;
+			mode_options.sample_period = opts.sample_period;
 
-	print_results(slow_results);
+			for(int rep = -opts.warmup; rep < opts.reps; rep++){
+				cerr << t.producers << 'p' << t.consumers << "c " << pop_mode_name(mode)
+				     << ": " << std::flush;
+				const concurrency_test_time times = test_with_concurrency<Queue<item>, item>(
+					t.producers, t.consumers, value, items, microseconds(0),
+					normal_producer<Queue<item>, item>, mode_consumer<Queue<item>, item>,
+					mode_options);
+				if(warmed_up(rep))
+					continue;
 
-	test_results_map stub_results;
+				bench_record r;
+				r.label("scenario", "fairness")
+				 .label("engine", engine)
+				 .label("pop_mode", pop_mode_name(mode))
+				 .metric("timeout_us", double(timeout.count()))
+				 .metric("producers", t.producers)
+				 .metric("consumers", t.consumers)
+				 .metric("items", items)
+				 .metric("sample_us", double(opts.sample_period.count()))
+				 .metric("rep", rep)
+				 .label("topology", describe_topology(*options.topology))
+				 .label("placement", placement_name(options.where))
+				 .label("cpus", join_cpus(times.cpus))
+				 .metric("wall_ns", double(std::chrono::nanoseconds(times.wall_time).count()))
+				 .metric("items_per_s", std::round(items / duration<double>(times.wall_time).count()))
+				 .metric("samples", double(times.progress.size()))
+				 .metric("producer_jain", times.producer_fairness.jain)
+				 .metric("consumer_jain", times.consumer_fairness.jain)
+				 .metric("producer_starved_max_ns",
+					double(times.producer_fairness.longest_starvation().count()))
+				 .metric("consumer_starved_max_ns",
+					double(times.consumer_fairness.longest_starvation().count()));
+				// And the longest each worker went.
+				for(std::size_t i = 0; i < times.producer_fairness.starvation.size(); i++)
+					r.metric("producer" + std::to_string(i) + "_starved_ns",
+						double(times.producer_fairness.starvation[i].count()));
+				for(std::size_t i = 0; i < times.consumer_fairness.starvation.size(); i++)
+					r.metric("consumer" + std::to_string(i) + "_starved_ns",
+						double(times.consumer_fairness.starvation[i].count()));
+				add_latency_metrics(r, "", times.latency);
+				records.push_back(std::move(r));
 
-	cout << "Now testing with stub producers and consumers.\n";
-	for(const auto t : test_sizes){
-		cout << t.producers << 'p' << t.consumers << "c: " << std::flush;
-		stub_results.insert_or_assign(
-			t,
-			test_with_concurrency<Queue<float>, float>(
-				t.producers, t.consumers, 1.0f, num_items, milliseconds(0),
-				stub_producer<Queue<float>, float>, stub_consumer<Queue<float>, float>));
-		cout << "done\n";
+				cerr << "done\n";
+			}
+		}
 	}
+}
+
+/* run_ops: the uncontended operation scenario, see queue_op_costs().
+ *
+ * This runs on the first worker in the team, so it can be pinned to the
+ * first CPU the placement would give out without pinning us.
+ */
+template<template<typename> typename Queue>
+static void run_ops(const std::string &engine, const bench_options &opts,
+		const harness_options &options, std::vector<bench_record> &records){
+	const int samples = opts.items.value_or(100'000);
+	const std::vector<int> cpus = options.where.strategy == placement_strategy::none ?
+		std::vector<int>() : assign_cpus(options.where, *options.topology, 1, 0);
+
+	cerr << "Running ops benchmarks.\n";
+	for(int rep = -opts.warmup; rep < opts.reps; rep++){
+		cerr << "ops: " << std::flush;
+		tick_calibration cal;
+		std::vector<op_cost> costs;
+		const auto measure = [&](int){
+			if(!cpus.empty())
+				pin_this_thread(cpus.front());
+			cal = calibrate_ticks();
+			costs = queue_op_costs<Queue<float>, float>(samples, cal);
+		};
+		options.team->dispatch(1, measure);
+		options.team->wait();
+		if(warmed_up(rep))
+			continue;
 
-	print_results(stub_results);
+		for(const op_cost &c : costs){
+			bench_record r;
+			r.label("scenario", "ops")
+			 .label("engine", engine)
+			 .label("op", c.op)
+			 .label("clock", cycle_clock_name)
+			 .metric("samples", c.samples)
+			 .metric("rep", rep)
+			 .label("topology", describe_topology(*options.topology))
+			 .label("placement", placement_name(options.where))
+			 .label("cpus", join_cpus(cpus))
+			 .metric("ns_per_tick", cal.ns_per_tick)
+			 .metric("overhead_ticks", double(cal.overhead))
+			 .metric("min_ticks", double(c.min))
+			 .metric("p50_ticks", double(c.p50))
+			 .metric("p99_ticks", double(c.p99))
+			 .metric("min_ns", double(c.min) * cal.ns_per_tick)
+			 .metric("p50_ns", double(c.p50) * cal.ns_per_tick)
+			 .metric("p90_ns", double(c.p90) * cal.ns_per_tick)
+			 .metric("p99_ns", double(c.p99) * cal.ns_per_tick);
+			records.push_back(std::move(r));
+		}
+
+		cerr << "done\n";
+	}
+}
+
+// depth_trace: the --depth-trace file, opened the first time it's asked
+// for so that every engine and rep goes in the same one.
+static std::ostream &depth_trace(const std::string &path){
+	static std::ofstream out(path);
+	return out;
 }
 
-int main(int /* argc */, char ** /* argv */){
-	cout << "Benchmarking mpmc_queue:\n";
-	benchmark<mpmc_queue>();
+/* run_pipeline: the pipeline scenario, see pipeline().
+ *
+ * Besides throughput and end-to-end latency, this reports the mean, p99,
+ * and max depth of each stage's queue, so you can see which stage is the
+ * bottleneck: it's the one with everything piled up in front of it.
+ */
+template<template<typename> typename Queue>
+static void run_pipeline(const std::string &engine, const bench_options &opts,
+		const harness_options &options, std::vector<bench_record> &records){
+	using std::chrono::duration;
+	using token = std::chrono::steady_clock::time_point;
+
+	const int stages = opts.stages;
+	const int workers = opts.consumers.value_or(1);
+	const int items = opts.items.value_or(200'000);
+
+	std::ostream *trace = nullptr;
+	if(!opts.depth_trace.empty()){
+		trace = &depth_trace(opts.depth_trace);
+		if(!*trace)
+			cerr << "couldn't open " << opts.depth_trace << ", not tracing depths\n";
+		else if(trace->tellp() == 0)
+			*trace << "engine,stages,workers,rep,time_us,stage,depth\n";
+	}
+
+	cerr << "Running pipeline benchmarks.\n";
+	for(int rep = -opts.warmup; rep < opts.reps; rep++){
+		cerr << stages << 'x' << workers << ": " << std::flush;
+		const pipeline_result result = pipeline<Queue<token>>(
+			stages, workers, items, opts.work_time, options);
+		if(warmed_up(rep))
+			continue;
+
+		bench_record r;
+		r.label("scenario", "pipeline")
+		 .label("engine", engine)
+		 .metric("stages", stages)
+		 .metric("stage_workers", workers)
+		 .metric("work_ns", double(opts.work_time.count()))
+		 .metric("items", items)
+		 .metric("rep", rep)
+		 .label("topology", describe_topology(*options.topology))
+		 .label("placement", placement_name(options.where))
+		 .label("cpus", join_cpus(result.cpus))
+		 .metric("wall_ns", double(std::chrono::nanoseconds(result.wall_time).count()))
+		 .metric("items_per_s", std::round(items /
+			duration<double>(result.wall_time).count()));
+		add_latency_metrics(r, "e2e_", result.latency);
+
+		for(int s = 0; s < stages; s++){
+			std::vector<std::size_t> depths;
+			for(const depth_sample &d : result.depths)
+				depths.push_back(d.depths[s]);
+			std::sort(depths.begin(), depths.end());
+
+			double mean = 0;
+			for(const std::size_t d : depths)
+				mean += double(d);
+			mean = depths.empty() ? 0 : mean / double(depths.size());
+
+			const std::string prefix = "stage" + std::to_string(s) + "_depth_";
+			r.metric(prefix + "mean", mean)
+			 .metric(prefix + "p99", depths.empty() ? 0.0 :
+				double(depths[std::min(depths.size() - 1, depths.size() * 99 / 100)]))
+			 .metric(prefix + "max", depths.empty() ? 0.0 : double(depths.back()));
+		}
+		records.push_back(std::move(r));
+
+		if(trace && *trace){
+			for(const depth_sample &d : result.depths){
+				const auto us = std::chrono::duration_cast<std::chrono::microseconds>(d.when);
+				for(int s = 0; s < stages; s++)
+					*trace << engine << ',' << stages << ',' << workers << ',' << rep << ','
+					       << us.count() << ',' << s << ',' << d.depths[s] << '\n';
+			}
+			trace->flush();
+		}
+
+		cerr << "done\n";
+	}
+}
+
+/* run_noise: the noisy neighbor scenario.
+ *
+ * Runs the normal workers on their own, then next to each kind of noise,
+ * and reports how much throughput and p99 latency got worse. With one hog
+ * per hardware thread (the default) or more, every worker is fighting for
+ * its CPU, so sooner or later one gets preempted holding the queue's lock
+ * and everybody else piles up behind it. The involuntary switches show how
+ * often that's happening. If the workers are pinned, the hogs get pinned to
+ * the same CPUs.
+ */
+template<template<typename> typename Queue>
+static void run_noise(const std::string &engine, const bench_options &opts,
+		const harness_options &options, std::vector<bench_record> &records){
+	using std::chrono::duration;
+	using item = stamped_item<float>;
+
+	const test_size t{opts.producers.value_or(2), opts.consumers.value_or(2)};
+	const int items = opts.items.value_or(200'000);
+	const int hogs = opts.noise_threads > 0 ?
+		opts.noise_threads : std::max(1, int(std::thread::hardware_concurrency()));
+	const item value{};
+
+	const std::vector<int> hog_cpus = options.where.strategy == placement_strategy::none ?
+		std::vector<int>() :
+		assign_cpus(options.where, *options.topology, t.producers, t.consumers);
+
+	std::vector<noise_kind> kinds{noise_kind::none};
+	kinds.insert(kinds.end(), opts.noises.begin(), opts.noises.end());
+
+	// The quiet throughput and p99, averaged over the reps.
+	double quiet_per_s = 0;
+	double quiet_p99 = 0;
+
+	cerr << "Running noise benchmarks.\n";
+	for(const noise_kind kind : kinds){
+		double total_per_s = 0;
+		double total_p99 = 0;
+		for(int rep = -opts.warmup; rep < opts.reps; rep++){
+			cerr << t.producers << 'p' << t.consumers << "c " << noise_kind_name(kind)
+			     << ": " << std::flush;
+			concurrency_test_time times;
+			{
+				const noisy_neighbors neighbors(kind, hogs, hog_cpus);
+				times = test_with_concurrency<Queue<item>, item>(
+					t.producers, t.consumers, value, items, std::chrono::microseconds(0),
+					normal_producer<Queue<item>, item>, normal_consumer<Queue<item>, item>,
+					options);
+			}
+			if(warmed_up(rep))
+				continue;
+
+			const double per_s = items / duration<double>(times.wall_time).count();
+			const double p99 = double(times.latency.percentile(99));
+			total_per_s += per_s;
+			total_p99 += p99;
+
+			bench_record r;
+			r.label("scenario", "noise")
+			 .label("engine", engine)
+			 .label("noise", noise_kind_name(kind))
+			 .metric("noise_threads", kind == noise_kind::none ? 0 : hogs)
+			 .metric("producers", t.producers)
+			 .metric("consumers", t.consumers)
+			 .metric("items", items)
+			 .metric("rep", rep)
+			 .label("topology", describe_topology(*options.topology))
+			 .label("placement", placement_name(options.where))
+			 .label("cpus", join_cpus(times.cpus))
+			 .metric("wall_ns", double(std::chrono::nanoseconds(times.wall_time).count()))
+			 .metric("items_per_s", std::round(per_s))
+			 .metric("throughput_vs_quiet", quiet_per_s > 0 ? per_s / quiet_per_s : 1.0)
+			 .metric("p99_vs_quiet", quiet_p99 > 0 ? p99 / quiet_p99 : 1.0)
+			 .metric("invol_switches_per_item", double(times.switches.involuntary) / items);
+			add_latency_metrics(r, "", times.latency);
+			records.push_back(std::move(r));
+
+			cerr << "done\n";
+		}
+
+		if(kind == noise_kind::none){
+			quiet_per_s = total_per_s / opts.reps;
+			quiet_p99 = total_p99 / opts.reps;
+			// Now that we know what quiet looks like, fix up its own records.
+			for(int rep = 0; rep < opts.reps; rep++){
+				bench_record &r = records[records.size() - opts.reps + rep];
+				for(bench_field &f : r.fields){
+					// Same guards as above, so an empty quiet run doesn't
+					// put inf or NaN in the output.
+					if(f.name == "throughput_vs_quiet")
+						f.value = quiet_per_s > 0 ?
+							std::get<double>(*r.find("items_per_s")) / quiet_per_s : 1.0;
+					else if(f.name == "p99_vs_quiet")
+						f.value = quiet_p99 > 0 ?
+							std::get<double>(*r.find("p99_ns")) / quiet_p99 : 1.0;
+				}
+			}
+		}
+	}
+}
+
+// scaling_levels: 1, 2, 4, and so on up to max, plus the hardware
+// concurrency itself if that's not a power of two, and max.
+static std::vector<int> scaling_levels(const int max){
+	std::vector<int> levels;
+	for(int n = 1; n < max; n *= 2)
+		levels.push_back(n);
+
+	const int hw = int(std::thread::hardware_concurrency());
+	if(hw > 0 && hw < max && std::find(levels.begin(), levels.end(), hw) == levels.end())
+		levels.push_back(hw);
+	levels.push_back(max);
+
+	std::sort(levels.begin(), levels.end());
+	return levels;
+}
+
+/* run_scaling: the scaling scenario.
+ *
+ * Runs the normal workers over a grid of producer and consumer counts, from
+ * 1p1c up past the number of hardware threads, and reports how throughput
+ * and CPU time per item change relative to 1p1c.
+ */
+template<template<typename> typename Queue>
+static void run_scaling(const std::string &engine, const bench_options &opts,
+		const harness_options &options, std::vector<bench_record> &records){
+	using std::chrono::duration;
+	using item = stamped_item<float>;
+
+	const int hw = std::max(1, int(std::thread::hardware_concurrency()));
+	const std::vector<int> levels = scaling_levels(opts.scaling_max > 0 ? opts.scaling_max : 2 * hw);
+	const int items = opts.items.value_or(1'000'000);
+	const item value{};
+
+	// The 1p1c throughput, averaged over the reps, which is what everything
+	// else gets compared to. 1p1c always runs first.
+	double baseline = 0;
+
+	cerr << "Running scaling benchmarks.\n";
+	for(const int p : levels){
+		for(const int c : levels){
+			double total = 0;
+			for(int rep = -opts.warmup; rep < opts.reps; rep++){
+				cerr << p << 'p' << c << "c: " << std::flush;
+				const concurrency_test_time times = test_with_concurrency<Queue<item>, item>(
+					p, c, value, items, std::chrono::microseconds(0),
+					normal_producer<Queue<item>, item>, normal_consumer<Queue<item>, item>,
+					options);
+				if(warmed_up(rep))
+					continue;
+
+				const double per_s = items / duration<double>(times.wall_time).count();
+				const double cpu_ns = double(times.cpu_time) * 1e9 / CLOCKS_PER_SEC;
+				total += per_s;
+
+				bench_record r;
+				r.label("scenario", "scaling")
+				 .label("engine", engine)
+				 .metric("producers", p)
+				 .metric("consumers", c)
+				 .metric("hw_threads", hw)
+				 .metric("items", items)
+				 .metric("rep", rep)
+				 .label("topology", describe_topology(*options.topology))
+				 .label("placement", placement_name(options.where))
+				 .label("cpus", join_cpus(times.cpus))
+				 .metric("wall_ns", double(std::chrono::nanoseconds(times.wall_time).count()))
+				 .metric("items_per_s", std::round(per_s))
+				 .metric("cpu_ns_per_item", cpu_ns / items)
+				 .metric("scaling_vs_1p1c", baseline > 0 ? per_s / baseline : 1.0);
+				add_latency_metrics(r, "", times.latency);
+				records.push_back(std::move(r));
+
+				cerr << "done\n";
+			}
+
+			if(p == 1 && c == 1){
+				baseline = total / opts.reps;
+				// Now that we know the baseline, fix up the 1p1c records.
+				for(int rep = 0; rep < opts.reps; rep++){
+					bench_record &r = records[records.size() - opts.reps + rep];
+					for(bench_field &f : r.fields)
+						if(f.name == "scaling_vs_1p1c")
+							f.value = std::get<double>(*r.find("items_per_s")) / baseline;
+				}
+			}
+		}
+	}
+}
+
+template<template<typename> typename Queue>
+static void benchmark(const std::string &engine, const bench_options &opts,
+		const harness_options &options, std::vector<bench_record> &records){
+	cerr << "Benchmarking " << engine << ":\n";
+
+	for(const std::string &name : opts.scenarios){
+		if(name == "pingpong"){
+			run_pingpong<Queue>(engine, opts, options, records);
+			continue;
+		}
+		if(name == "openloop"){
+			run_openloop<Queue>(engine, opts, options, records);
+			continue;
+		}
+		if(name == "scaling"){
+			run_scaling<Queue>(engine, opts, options, records);
+			continue;
+		}
+		if(name == "consumers"){
+			run_consumers<Queue>(engine, opts, options, records);
+			continue;
+		}
+		if(name == "wakeup"){
+			run_wakeup<Queue>(engine, opts, options, records);
+			continue;
+		}
+		if(name == "noise"){
+			run_noise<Queue>(engine, opts, options, records);
+			continue;
+		}
+		if(name == "ops"){
+			run_ops<Queue>(engine, opts, options, records);
+			continue;
+		}
+		if(name == "pipeline"){
+			run_pipeline<Queue>(engine, opts, options, records);
+			continue;
+		}
+		if(name == "fairness"){
+			run_fairness<Queue>(engine, opts, options, records);
+			continue;
+		}
+		if(name == "service"){
+			run_service<Queue>(engine, opts, options, records);
+			continue;
+		}
+
+		for(const payload_choice &payload : payload_choices(opts)){
+			const scenario_config c = configure(*find_preset(name), opts, payload);
+
+			cerr << "Running " << c.name << " benchmarks with " << payload_name(payload) << ".\n";
+			with_payload(payload, [&]<typename P>(std::type_identity<P>){
+				// The payload is stamped so that we get latencies.
+				using item = stamped_item<P>;
+				const item value{make_payload<P>(payload.size), {}};
+
+				for(const auto t : c.sizes){
+					for(int rep = -opts.warmup; rep < opts.reps; rep++){
+						cerr << t.producers << 'p' << t.consumers << "c: " << std::flush;
+						const concurrency_test_time times =
+							run_test<Queue<item>, item>(c, t, value, options);
+						if(warmed_up(rep))
+							continue;
+						records.push_back(make_record(engine, payload_name(payload),
+							c, t, rep, options, times));
+						cerr << "done\n";
+					}
+				}
+			});
+		}
+	}
+}
+
+int main(int argc, char **argv){
+	const std::optional<bench_options> opts = parse_options(argc, argv);
+	if(!opts)
+		return 2;
+
+	for(const payload_choice &p : payload_choices(*opts)){
+		if(p.size == 0 || !with_payload(p, [](auto){})){
+			cerr << "unsupported payload size " << p.size << " for " << p.kind << '\n';
+			return 2;
+		}
+	}
+
+	// Open the output first, so we don't find out it's bad after running.
+	std::ofstream file;
+	if(!opts->output.empty()){
+		file.open(opts->output);
+		if(!file){
+			cerr << "can't open " << opts->output << " for writing\n";
+			return 1;
+		}
+	}
+	std::ostream &out = opts->output.empty() ? cout : file;
+
+	std::ofstream baseline_out;
+	if(!opts->save_baseline.empty()){
+		baseline_out.open(opts->save_baseline);
+		if(!baseline_out){
+			cerr << "can't open " << opts->save_baseline << " for writing\n";
+			return 1;
+		}
+	}
+
+	std::optional<std::vector<summary_entry>> baseline;
+	if(!opts->baseline.empty()){
+		std::ifstream in(opts->baseline);
+		baseline = read_baseline(in);
+		if(!baseline){
+			cerr << "can't read a baseline from " << opts->baseline << '\n';
+			return 1;
+		}
+	}
+
+	// Read the topology once, and make sure any CPUs we were given are ones
+	// we can actually run on.
+	const std::vector<cpu_info> topology = read_topology();
+	for(const int cpu : opts->where.cpus){
+		if(std::none_of(topology.begin(), topology.end(),
+				[cpu](const cpu_info &c){ return c.cpu == cpu; })){
+			cerr << "CPU " << cpu << " isn't available to us\n";
+			return 2;
+		}
+	}
+	cerr << "Topology: " << describe_topology(topology) << ", placement: "
+	     << placement_name(opts->where) << '\n';
+
+	// Every scenario and rep runs on the same threads, so there's no thread
+	// startup in between them.
+	worker_team team;
+	const harness_options options{opts->where, &topology, &team};
+
+	std::vector<bench_record> records;
+
+	if(opts->engine == "mpmc" || opts->engine == "all")
+		benchmark<mpmc_queue>("mpmc_queue", *opts, options, records);
+	if(opts->engine == "semaphore" || opts->engine == "all")
+		benchmark<mpmc_semaphore_queue>("mpmc_semaphore_queue", *opts, options, records);
+
+	const std::vector<summary_entry> summaries = summarize_records(records);
+	write_records(out, opts->format, opts->summary ? summary_records(summaries) : records);
+
+	if(baseline_out.is_open())
+		write_baseline(baseline_out, summaries);
 
-	cout << "============================\n";
+	if(baseline && report_comparisons(compare_to_baseline(
+			summaries, *baseline, opts->threshold_pct / 100.0)) > 0)
+		return 3;
 
-	cout << "Benchmarking mpmc_semaphore_queue:\n";
-	benchmark<mpmc_semaphore_queue>();
+	return 0;
 }
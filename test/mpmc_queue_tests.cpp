@@ -22,12 +22,15 @@
 #include <future>
 #include <latch>
 #include <vector>
+#include <deque>
+#include <type_traits>
 
 #include <cstddef>
 #include <cassert>
 
 #include "mpmc_queue.hpp"
 #include "mpmc_semaphore_queue.hpp"
+#include "sojourn_queue.hpp"
 #include "mpmc_test_helpers.hpp"
 using namespace storm;
 using namespace storm::test;
@@ -97,6 +100,86 @@ static void test_push_and_size(){
 	}
 }
 
+template<template<typename, typename, typename> typename Queue>
+static void test_stats(){
+	static_assert(std::is_empty_v<no_queue_stats>,
+		"the default stats policy shouldn't take up any space");
+
+	Queue<int, std::deque<int>, striped_queue_stats<>> q;
+
+	for(int i = 0; i < 10; i++){
+		q.push(i);
+		q.emplace(i);
+	}
+	for(int i = 0; i < 5; i++){
+		[[maybe_unused]] const auto t = q.try_pop();
+	}
+	for(int i = 0; i < 15; i++){
+		[[maybe_unused]] const auto t = q.pop_wait();
+	}
+
+	// Now it's empty, so this has to wait and then time out.
+	[[maybe_unused]] const auto t = q.pop_wait_for(std::chrono::milliseconds(1));
+
+	const queue_stats_snapshot s = q.stats_snapshot();
+	if(s.pushes != 20 || s.pops != 20){
+		cout << "stats push/pop counts wrong! " << s.pushes << " pushes, "
+		     << s.pops << " pops\n";
+	}else if(s.high_water_mark != 20){
+		cout << "stats high-water mark wrong! " << s.high_water_mark << '\n';
+	}else if(s.waits != 1 || s.timeouts != 1){
+		cout << "stats wait counts wrong! " << s.waits << " waits, "
+		     << s.timeouts << " timeouts\n";
+	}else if(s.lock_contended != 0){
+		cout << "stats saw lock contention with only one thread! "
+		     << s.lock_contended << '\n';
+	}else{
+		cout << "queue stats look good\n";
+	}
+}
+
+template<template<typename> typename Queue>
+static void test_sojourn(){
+	using std::chrono::milliseconds;
+
+	// Every element gets timed.
+	sojourn_queue<int, Queue> q;
+	// Only one in ten does.
+	sojourn_queue<int, Queue> sampled(10);
+	// And one in three, from the same thread, which shouldn't throw off
+	// the one in ten.
+	sojourn_queue<int, Queue> thirds(3);
+
+	for(int i = 0; i < 100; i++){
+		q.push(i);
+		sampled.emplace(i);
+		thirds.push(i);
+	}
+
+	std::this_thread::sleep_for(milliseconds(2));
+
+	while(q.try_pop().has_value())
+		;
+	while(sampled.pop_wait_for(milliseconds(0)).has_value())
+		;
+	while(thirds.try_pop().has_value())
+		;
+
+	const log_linear_histogram h = q.sojourn_snapshot();
+	const log_linear_histogram hs = sampled.sojourn_snapshot();
+	const log_linear_histogram ht = thirds.sojourn_snapshot();
+	const auto two_ms = std::uint64_t(std::chrono::nanoseconds(milliseconds(2)).count());
+	if(h.count() != 100 || hs.count() != 10 || ht.count() != 34){
+		cout << "sojourn sample counts wrong! " << h.count() << ", "
+		     << hs.count() << ", and " << ht.count() << '\n';
+	}else if(h.percentile(50) < two_ms || h.max() < h.percentile(99.9)){
+		cout << "sojourn times wrong! p50 " << h.percentile(50) << " max "
+		     << h.max() << '\n';
+	}else{
+		cout << "sojourn times look good\n";
+	}
+}
+
 int main(int /* argc */, char ** /* argv */){
 	using std::chrono::milliseconds;
 
@@ -111,6 +194,16 @@ int main(int /* argc */, char ** /* argv */){
 	cout << "Running push and size tests for the semaphore queue\n";
 	test_push_and_size<mpmc_semaphore_queue>();
 
+	cout << "Running stats tests.\n";
+	test_stats<mpmc_queue>();
+	cout << "And again with the semaphore queue.\n";
+	test_stats<mpmc_semaphore_queue>();
+
+	cout << "Running sojourn time tests.\n";
+	test_sojourn<mpmc_queue>();
+	cout << "And again with the semaphore queue.\n";
+	test_sojourn<mpmc_semaphore_queue>();
+
 	cout << "Running basic single-producer single-consumer tests.\n";
 	test_with_concurrency<mpmc_queue<float>, float>(1, 1, 1.0f, num_items, milliseconds(0), normal_producer<mpmc_queue<float>, float>, normal_consumer<mpmc_queue<float>, float>);
 	cout << "And again with the semaphore queue.\n";
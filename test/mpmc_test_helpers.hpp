@@ -20,33 +20,226 @@
 #ifndef STORM_MPMC_TEST_HELPERS_H
 #define STORM_MPMC_TEST_HELPERS_H 1
 
+#include <iostream>
 #include <memory>
-#include <functional>
+#include <optional>
 #include <thread>
-#include <future>
 #include <latch>
+#include <atomic>
 #include <vector>
+#include <array>
+#include <string>
 #include <chrono>
+#include <type_traits>
+#include <algorithm>
 
 #include <ctime>
+#include <cstddef>
+#include <cstdint>
 
 #include "mpmc_queue.hpp"
+#include "latency_histogram.hpp"
+#include "cache_line.hpp"
+#include "perf_counters.hpp"
+#include "memory_counters.hpp"
+#include "cpu_topology.hpp"
+#include "worker_team.hpp"
+#include "fairness_metrics.hpp"
 
 // Compiler barrier macro to make sure it does the work we ask for.
 // At least for GCC, having no outputs makes it implicitly __volatile__.
 // Also add comments so it's easier to see in e.g. Godbolt.
 #define barrier() do { __asm__("# barrier()":::"memory"); } while(0)
 #define consume_value_reg(x) do { __asm__("# consuming: %0":: "r" (x)); } while(0)
+// And the same for things that don't fit in a register.
+#define consume_value_mem(x) do { __asm__("# consuming: %0":: "m" (x)); } while(0)
 
 namespace storm {
 	namespace test {
 
+// cpu_relax: tell the CPU we're spinning, so it can go easy on the other
+// SMT thread and on the memory system.
+inline void cpu_relax(){
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+// A trivially copyable payload of N bytes, to see what moving bigger items
+// around under the lock costs.
+template<std::size_t N>
+struct blob {
+	std::array<std::byte, N> bytes;
+};
+
+// A move-only payload that owns N bytes on the heap, like a
+// std::unique_ptr to a message. Moving it is cheap, but every item the
+// producers make costs an allocation, and every item consumed a free.
+template<std::size_t N>
+struct heap_handle {
+	std::unique_ptr<blob<N>> ptr;
+};
+
+// make_item: make a new item like the given one for a producer to push.
+// That's just a copy, except for move-only payloads, which get cloned.
+template<typename T>
+static T make_item(const T &t){
+	return t;
+}
+template<std::size_t N>
+static heap_handle<N> make_item(const heap_handle<N> &h){
+	if(!h.ptr)
+		return heap_handle<N>();
+	return heap_handle<N>{std::make_unique<blob<N>>(*h.ptr)};
+}
+
+// make_payload: make the value producers start from. size is how many bytes
+// of payload to carry, for the payloads where that can change at run time.
+template<typename T>
+struct payload_factory {
+	static T make(std::size_t /* size */){
+		return T{};
+	}
+};
+template<std::size_t N>
+struct payload_factory<heap_handle<N>> {
+	static heap_handle<N> make(std::size_t /* size */){
+		return heap_handle<N>{std::make_unique<blob<N>>()};
+	}
+};
+template<>
+struct payload_factory<std::string> {
+	static std::string make(std::size_t size){
+		return std::string(size, 'x');
+	}
+};
+template<typename T>
+static T make_payload(std::size_t size){
+	return payload_factory<T>::make(size);
+}
+
+// An item that carries the time it was pushed, so the consumer can work out
+// the end-to-end latency. Use this as T to get latency percentiles out of
+// test_with_concurrency.
+template<typename T>
+struct stamped_item {
+	T value;
+	std::chrono::steady_clock::time_point sent;
+};
+
+// Copying a stamped_item has to copy the payload the same way.
+template<typename T>
+static stamped_item<T> make_item(const stamped_item<T> &t){
+	return stamped_item<T>{make_item(t.value), t.sent};
+}
+
+// stamp_item: make a new item ready to push. Only stamped_items actually
+// get stamped.
+template<typename T>
+static T stamp_item(const T &t){
+	return make_item(t);
+}
+template<typename T>
+static stamped_item<T> stamp_item(const stamped_item<T> &t){
+	return stamped_item<T>{make_item(t.value), std::chrono::steady_clock::now()};
+}
+// And the same, but for a particular send time instead of now.
+template<typename T>
+static T stamp_item(const T &t, std::chrono::steady_clock::time_point){
+	return make_item(t);
+}
+template<typename T>
+static stamped_item<T> stamp_item(const stamped_item<T> &t,
+		const std::chrono::steady_clock::time_point when){
+	return stamped_item<T>{make_item(t.value), when};
+}
+
+// consume_item: make sure the compiler thinks we used an item.
+template<typename T>
+static void consume_item(const T &t){
+	if constexpr(std::is_scalar_v<T>)
+		consume_value_reg(t);
+	else
+		consume_value_mem(t);
+}
+template<typename T>
+static void consume_item(const stamped_item<T> &t){
+	consume_item(t.value);
+}
+
+// The different ways a consumer can get an item out of a queue.
+enum class pop_mode {
+	// pop_wait()
+	wait,
+	// try_pop() in a loop until it works
+	spin,
+	// try_pop() in a loop, backing off more and more between tries
+	backoff,
+	// pop_wait_for() in a loop until it works
+	wait_for,
+	// pop_wait_until() in a loop until it works
+	wait_until,
+};
+
+// pop_mode_name: the name of a pop_mode, for results.
+inline const char *pop_mode_name(const pop_mode mode){
+	switch(mode){
+	case pop_mode::wait: return "wait";
+	case pop_mode::spin: return "spin";
+	case pop_mode::backoff: return "backoff";
+	case pop_mode::wait_for: return "wait_for";
+	case pop_mode::wait_until: return "wait_until";
+	}
+	return "?";
+}
+
+// pop_mode_timed: whether a pop_mode uses a timeout.
+inline bool pop_mode_timed(const pop_mode mode){
+	return mode == pop_mode::wait_for || mode == pop_mode::wait_until;
+}
+
+// Here's what each worker measures about itself while it runs. Every worker
+// gets its own, so nothing in here needs to be thread-safe, except for
+// progress, but they do need to be on their own cache lines.
+struct alignas(cache_line_size) worker_metrics {
+	// How many items this worker has gotten through so far. Only the worker
+	// writes it, but the harness can sample it while the test runs.
+	std::atomic<std::int64_t> progress{0};
+	// End-to-end latency of each item, in nanoseconds.
+	log_linear_histogram latency;
+	// How late each timed pop that timed out came back, in nanoseconds.
+	log_linear_histogram timeout_overshoot;
+	// Hardware counters for this worker's thread.
+	thread_perf_counters perf;
+};
+
+// record_item: note down whatever we can learn from an item we popped.
+// Again, only stamped_items have anything to record.
+template<typename T>
+static void record_item(worker_metrics &, const T &){
+}
+template<typename T>
+static void record_item(worker_metrics &m, const stamped_item<T> &t){
+	const auto waited = std::chrono::steady_clock::now() - t.sent;
+	m.latency.record(std::uint64_t(
+		std::chrono::duration_cast<std::chrono::nanoseconds>(waited).count()));
+}
+
+// note_progress: count one more item through. There's only one writer, so
+// this doesn't need a locked add, just a store other threads can read.
+inline void note_progress(worker_metrics &m){
+	m.progress.store(m.progress.load(std::memory_order_relaxed) + 1,
+		std::memory_order_relaxed);
+}
+
 // Here's a struct used to encapsulate the common parameters for a test
 // worker.
 template<typename Queue, typename T>
 struct worker_parameters {
-	// The queue under test:
-	std::shared_ptr<Queue> q;
+	// The queue under test, which the harness owns:
+	Queue *q;
 	// How many items this worker should put in or take out:
 	int num_items;
 	// Do setup tasks then arrive at this latch:
@@ -55,6 +248,17 @@ struct worker_parameters {
 	std::latch *start;
 	// _Immediately_ after the work is done, arrive here:
 	std::latch *stop;
+	// This worker's own measurements:
+	worker_metrics *metrics;
+	// Which CPU to pin this worker to, or -1 to leave it to the scheduler:
+	int cpu;
+	// How consumers that care should pop, and the timeout for the timed
+	// modes:
+	pop_mode mode;
+	std::chrono::nanoseconds timeout;
+	// How long consumers that simulate work spend on each item, on
+	// average:
+	std::chrono::nanoseconds service_time;
 };
 
 // Here's a struct that we use to encapsulate a whole bunch of params that
@@ -71,12 +275,80 @@ struct producer_parameters {
 // Typedef for the test functions that are on the producer side.
 template<typename Queue, typename T>
 using producer_test_function =
-	std::function<void(producer_parameters<Queue, T>)>;
+	void (*)(producer_parameters<Queue, T>);
 
 // Typedef for the test functions that are on the consumer side.
 template<typename Queue, typename T>
 using consumer_test_function =
-	std::function<void(worker_parameters<Queue, T>)>;
+	void (*)(worker_parameters<Queue, T>);
+
+// The most cpu_relax()es pop_mode::backoff does between tries, before it
+// gives up and yields instead.
+inline constexpr int max_backoff_spins = 1024;
+
+/* pop_with: pop one item from q, however mode says to, and don't come back
+ *           without one.
+ *
+ * timeout: how long each timed pop waits, for pop_mode::wait_for and
+ *          pop_mode::wait_until.
+ * metrics: if given, every timed pop that times out records how far past
+ *          its deadline it came back.
+ */
+template<typename Queue>
+static auto pop_with(Queue &q, const pop_mode mode,
+		const std::chrono::nanoseconds timeout,
+		worker_metrics *const metrics = nullptr){
+	using clock = std::chrono::steady_clock;
+
+	const auto overshot = [metrics](const clock::time_point deadline){
+		if(metrics == nullptr)
+			return;
+		const auto late = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			clock::now() - deadline).count();
+		metrics->timeout_overshoot.record(std::uint64_t(std::max<std::int64_t>(late, 0)));
+	};
+
+	switch(mode){
+	case pop_mode::spin:
+		while(true){
+			auto t = q.try_pop();
+			if(t.has_value())
+				return std::move(*t);
+		}
+	case pop_mode::backoff:
+		for(int spins = 1; ; ){
+			auto t = q.try_pop();
+			if(t.has_value())
+				return std::move(*t);
+			if(spins <= max_backoff_spins){
+				for(int i = 0; i < spins; i++)
+					cpu_relax();
+				spins *= 2;
+			}else{
+				std::this_thread::yield();
+			}
+		}
+	case pop_mode::wait_for:
+		while(true){
+			const auto deadline = clock::now() + timeout;
+			auto t = q.pop_wait_for(timeout);
+			if(t.has_value())
+				return std::move(*t);
+			overshot(deadline);
+		}
+	case pop_mode::wait_until:
+		while(true){
+			const auto deadline = clock::now() + timeout;
+			auto t = q.pop_wait_until(deadline);
+			if(t.has_value())
+				return std::move(*t);
+			overshot(deadline);
+		}
+	case pop_mode::wait:
+		break;
+	}
+	return q.pop_wait();
+}
 
 // put n items into q
 template<typename Queue, typename T>
@@ -86,7 +358,8 @@ static void normal_producer(
 	params.common.start->arrive_and_wait();
 
 	for(int i = 0; i < params.common.num_items; i++){
-		params.common.q->push(params.default_value);
+		params.common.q->push(stamp_item(params.default_value));
+		note_progress(*params.common.metrics);
 	}
 
 	params.common.stop->arrive_and_wait();
@@ -101,7 +374,27 @@ static void normal_consumer(
 
 	for(int i = 0; i < params.num_items; i++){
 		[[maybe_unused]] const T loc = params.q->pop_wait();
-		consume_value_reg(loc);
+		consume_item(loc);
+		record_item(*params.metrics, loc);
+		note_progress(*params.metrics);
+	}
+
+	params.stop->arrive_and_wait();
+}
+
+// pop n items from q, however params.mode says to
+template<typename Queue, typename T>
+static void mode_consumer(
+		const worker_parameters<Queue, T> params){
+	params.setup_done->arrive_and_wait();
+	params.start->arrive_and_wait();
+
+	for(int i = 0; i < params.num_items; i++){
+		[[maybe_unused]] const T loc =
+			pop_with(*params.q, params.mode, params.timeout, params.metrics);
+		consume_item(loc);
+		record_item(*params.metrics, loc);
+		note_progress(*params.metrics);
 	}
 
 	params.stop->arrive_and_wait();
@@ -115,11 +408,13 @@ static void slow_producer(
 	params.common.start->arrive_and_wait();
 
 	for(int i = 0; i < params.common.num_items - 1; i++){
-		params.common.q->push(params.default_value);
+		params.common.q->push(stamp_item(params.default_value));
+		note_progress(*params.common.metrics);
 		std::this_thread::sleep_for(params.delay);
 	}
 	// Do the last one outside of the loop to avoid the extra sleep.
-	params.common.q->push(params.default_value);
+	params.common.q->push(stamp_item(params.default_value));
+	note_progress(*params.common.metrics);
 
 	params.common.stop->arrive_and_wait();
 }
@@ -136,7 +431,7 @@ static void stub_producer(
 	params.common.start->arrive_and_wait();
 
 	for(int i = 0; i < params.common.num_items; i++){
-		q->push(params.default_value);
+		q->push(stamp_item(params.default_value));
 	}
 
 	barrier();
@@ -145,6 +440,7 @@ static void stub_producer(
 }
 
 // simulate popping n items from q, but do it to a local stub
+// The items were all made during setup, so there's no latency to record.
 template<typename Queue, typename T>
 static void stub_consumer(
 		worker_parameters<Queue, T> params){
@@ -162,29 +458,81 @@ static void stub_consumer(
 
 	for(int i = 0; i < params.num_items; i++){
 		[[maybe_unused]] T loc = std::move(q->front());
-		consume_value_reg(loc);
+		consume_item(loc);
 		q->pop();
 	}
 
 	params.stop->arrive_and_wait();
 }
 
+// Optional knobs for test_with_concurrency, so the common case doesn't need
+// to spell them all out.
+struct harness_options {
+	// Where to put the workers.
+	placement where;
+	// The machine's topology, if you've already read it. Otherwise we read
+	// it every time we need it.
+	const std::vector<cpu_info> *topology = nullptr;
+	// Threads to run the workers on. Otherwise we spawn new ones for every
+	// test.
+	worker_team *team = nullptr;
+	// How the consumers that care should pop, see mode_consumer().
+	pop_mode mode = pop_mode::wait;
+	std::chrono::nanoseconds timeout{0};
+	// How long the consumers that simulate work spend on each item, on
+	// average, see service_consumer().
+	std::chrono::nanoseconds service_time{0};
+	// How often to sample every worker's progress, for the fairness
+	// numbers, or 0 not to. The sampler is one more thread, and its samples
+	// get allocated while the test runs, so leave this off for the
+	// throughput and allocation numbers.
+	std::chrono::nanoseconds sample_period{0};
+};
+
 // How much time was taken by a benchmark.
 struct concurrency_test_time {
 	std::chrono::steady_clock::duration wall_time;
 	std::clock_t cpu_time;
+	// Per-item latency from all the consumers, merged. This is only filled
+	// in if T is a stamped_item.
+	log_linear_histogram latency;
+	// How late the consumers' timed pops came back when they timed out, in
+	// nanoseconds, merged. Its count is how many timed out.
+	log_linear_histogram timeout_overshoot;
+	// Hardware counters, summed over all the workers. Events we weren't
+	// allowed to count are left empty.
+	perf_totals perf;
+	// Context switches for the whole process.
+	context_switches switches;
+	// What got allocated and freed while the test ran, if the program counts
+	// allocations, see count_allocation().
+	allocation_totals allocations;
+	// Resident memory when the test started, and the most it got to. The
+	// peak is empty if we couldn't reset it before the test.
+	memory_usage memory_start;
+	std::optional<std::int64_t> peak_rss_kib;
+	// Which CPU each worker was pinned to, producers first, or empty if we
+	// didn't pin them. A worker the kernel wouldn't pin gets -1.
+	std::vector<int> cpus;
+	// How far each worker had gotten over time, producers first, if we were
+	// asked to sample it, and how fair that was to each side. The first
+	// sample is at the start, and the last at the end.
+	std::vector<progress_sample> progress;
+	fairness_summary producer_fairness;
+	fairness_summary consumer_fairness;
 };
 
 // test with producer(s) and consumer(s) on different threads
 template<typename Queue, typename T>
 static concurrency_test_time test_with_concurrency(
 		const int producers, const int consumers,
-		const T default_value, const int num_items,
+		const T &default_value, const int num_items,
 		const std::chrono::steady_clock::duration prod_delay,
 		const producer_test_function<Queue, T> producer_function,
-		const consumer_test_function<Queue, T> consumer_function){
+		const consumer_test_function<Queue, T> consumer_function,
+		const harness_options &options = harness_options()){
 	// Here's the queue we'll be testing.
-	auto q = std::make_shared<Queue>();
+	const auto q = std::make_unique<Queue>();
 
 	// This is the wall clock start time.
 	std::chrono::time_point<std::chrono::steady_clock> wall_start;
@@ -198,80 +546,155 @@ static concurrency_test_time test_with_concurrency(
 	std::latch start(producers+consumers+1);
 	std::latch stop(producers+consumers+1);
 
-	// Here's where we keep the futures for the producer and consumer tasks.
-	std::vector<std::future<void>> producer_futs;
-	std::vector<std::future<void>> consumer_futs;
+	// Every worker gets its own metrics, which we merge at the end.
+	std::vector<worker_metrics> producer_metrics(producers);
+	std::vector<worker_metrics> consumer_metrics(consumers);
+
+	// Work out where everybody goes, producers first.
+	std::vector<int> cpus;
+	if(options.where.strategy != placement_strategy::none){
+		cpus = options.topology ?
+			assign_cpus(options.where, *options.topology, producers, consumers) :
+			assign_cpus(options.where, read_topology(), producers, consumers);
+	}
+	const auto cpu_for = [&cpus](const int worker){
+		return cpus.empty() ? -1 : cpus[worker];
+	};
+
+	// Everything the team's workers need to find their own parameters.
+	// Workers 0 to producers-1 are the producers, and the rest are the
+	// consumers.
+	struct team_jobs {
+		std::vector<producer_parameters<Queue, T>> producer_params;
+		std::vector<worker_parameters<Queue, T>> consumer_params;
+		producer_test_function<Queue, T> producer_function;
+		consumer_test_function<Queue, T> consumer_function;
+		// Where each worker really got pinned, or -1.
+		std::vector<int> pinned;
+	} jobs{{}, {}, producer_function, consumer_function,
+		std::vector<int>(std::size_t(producers + consumers), -1)};
 
 	// Here's a naive estimate of how many items per worker to run.
 	const int items_per_producer = num_items / producers;
 	const int items_per_consumer = num_items / consumers;
 
-	// And here's where we keep track of the number of items left.
-	int producer_items_left = num_items;
-	int consumer_items_left = num_items;
-
 	// We distribute extra onto the last worker to avoid any questions about
 	// rounding in the division op.
-	for(int i = 0; i < producers-1; i++){
-		producer_futs.push_back(
-			std::async(std::launch::async,
-				producer_function, producer_parameters<Queue, T>{
-					worker_parameters<Queue, T>{
-						q,
-						items_per_producer,
-						&setup,
-						&start,
-						&stop,
-					},
-					default_value,
-					prod_delay,
-				}));
-
-		producer_items_left -= items_per_producer;
-	}
-	for(int i = 0; i < consumers-1; i++){
-		consumer_futs.push_back(
-			std::async(std::launch::async,
-				consumer_function, worker_parameters<Queue, T>{
-					q,
-					items_per_consumer,
-					&setup,
-					&start,
-					&stop,
-				}));
-
-		consumer_items_left -= items_per_consumer;
-	}
-
-	// Now put the remaining work on the last workers.
-	producer_futs.push_back(
-		std::async(std::launch::async,
-			producer_function, producer_parameters<Queue, T>{
-				worker_parameters<Queue, T>{
-					q,
-					producer_items_left,
-					&setup,
-					&start,
-					&stop,
-				},
-				default_value,
-				prod_delay,
-			}));
-	producer_items_left = 0;
-	consumer_futs.push_back(
-		std::async(std::launch::async,
-			consumer_function, worker_parameters<Queue, T>{
-				q,
-				consumer_items_left,
+	jobs.producer_params.reserve(producers);
+	for(int i = 0; i < producers; i++){
+		jobs.producer_params.push_back(producer_parameters<Queue, T>{
+			worker_parameters<Queue, T>{
+				q.get(),
+				i == producers - 1 ?
+					num_items - items_per_producer * (producers - 1) :
+					items_per_producer,
 				&setup,
 				&start,
 				&stop,
-			}));
-	consumer_items_left = 0;
+				&producer_metrics[i],
+				cpu_for(i),
+				options.mode,
+				options.timeout,
+				options.service_time,
+			},
+			make_item(default_value),
+			prod_delay,
+		});
+	}
+	jobs.consumer_params.reserve(consumers);
+	for(int i = 0; i < consumers; i++){
+		jobs.consumer_params.push_back(worker_parameters<Queue, T>{
+			q.get(),
+			i == consumers - 1 ?
+				num_items - items_per_consumer * (consumers - 1) :
+				items_per_consumer,
+			&setup,
+			&start,
+			&stop,
+			&consumer_metrics[i],
+			cpu_for(producers + i),
+			options.mode,
+			options.timeout,
+			options.service_time,
+		});
+	}
+
+	// The fairness summary needs everybody's quota, and the parameters are
+	// gone once they've been moved into the workers.
+	std::vector<std::int64_t> producer_quotas;
+	for(const producer_parameters<Queue, T> &p : jobs.producer_params)
+		producer_quotas.push_back(p.common.num_items);
+	std::vector<std::int64_t> consumer_quotas;
+	for(const worker_parameters<Queue, T> &c : jobs.consumer_params)
+		consumer_quotas.push_back(c.num_items);
+
+	// Every worker pins itself, then opens hardware counters on its own
+	// thread before it does anything else, then we turn them all on and off
+	// together.
+	// The parameters get moved all the way through, since T might be
+	// move-only.
+	const auto run_worker = [](void *context, const int worker){
+		team_jobs &j = *static_cast<team_jobs*>(context);
+		const bool producer = worker < int(j.producer_params.size());
+		worker_parameters<Queue, T> &common = producer ?
+			j.producer_params[worker].common :
+			j.consumer_params[worker - j.producer_params.size()];
+
+		if(common.cpu >= 0 && pin_this_thread(common.cpu))
+			j.pinned[std::size_t(worker)] = common.cpu;
+		common.metrics->perf.open_for_this_thread();
+
+		if(producer)
+			j.producer_function(std::move(j.producer_params[worker]));
+		else
+			j.consumer_function(std::move(j.consumer_params[worker - j.producer_params.size()]));
+	};
+
+	// Snapshot everybody's progress, producers first.
+	const auto sample_progress = [&](const std::chrono::steady_clock::time_point when){
+		progress_sample s{when, q->size(), {}};
+		s.done.reserve(producers + consumers);
+		for(const worker_metrics &m : producer_metrics)
+			s.done.push_back(m.progress.load(std::memory_order_relaxed));
+		for(const worker_metrics &m : consumer_metrics)
+			s.done.push_back(m.progress.load(std::memory_order_relaxed));
+		return s;
+	};
+
+	// The sampler starts before the test does, so it doesn't hold up the
+	// start, and we throw away what it saw before then.
+	std::vector<progress_sample> progress;
+	std::jthread sampler;
+	if(options.sample_period.count() > 0){
+		sampler = std::jthread([&](const std::stop_token stopping){
+			while(!stopping.stop_requested()){
+				progress.push_back(sample_progress(std::chrono::steady_clock::now()));
+				std::this_thread::sleep_for(options.sample_period);
+			}
+		});
+	}
+
+	// If we weren't given a team, this one's just for us.
+	std::optional<worker_team> own_team;
+	worker_team &team = options.team ? *options.team : own_team.emplace();
+	team.dispatch(producers + consumers, run_worker, &jobs);
 
 	// Make sure that everyone is set up and ready to start timing.
 	setup.arrive_and_wait();
 
+	// Turn on the counters. This is a syscall per counter, so do it before
+	// we start the clocks.
+	for(worker_metrics &m : producer_metrics)
+		m.perf.enable();
+	for(worker_metrics &m : consumer_metrics)
+		m.perf.enable();
+	const context_switches switches_start = process_context_switches();
+
+	// Same for the memory numbers, which mean reading and writing files.
+	const bool peak_reset = reset_peak_rss();
+	const memory_usage memory_start = read_memory_usage();
+	const allocation_totals allocations_start = allocations_so_far();
+
 	// Now that everything's set up, start the timers and the test.
 	wall_start = std::chrono::steady_clock::now();
 	cpu_start = std::clock();
@@ -282,12 +705,78 @@ static concurrency_test_time test_with_concurrency(
 	const auto wall_stop = std::chrono::steady_clock::now();
 	auto cpu_stop = std::clock();
 
-	// We could loop over the vectors and wait, but why do that when
-	// the destructors do the job for us?
+	const allocation_totals allocations_stop = allocations_so_far();
+	const context_switches switches_stop = process_context_switches();
+	const memory_usage memory_stop = read_memory_usage();
+	for(worker_metrics &m : producer_metrics)
+		m.perf.disable();
+	for(worker_metrics &m : consumer_metrics)
+		m.perf.disable();
+
+	// Everybody recorded their metrics before arriving at stop, so we can
+	// read them now without waiting for the threads to exit.
+	log_linear_histogram latency;
+	log_linear_histogram timeout_overshoot;
+	for(const worker_metrics &m : consumer_metrics){
+		latency.merge(m.latency);
+		timeout_overshoot.merge(m.timeout_overshoot);
+	}
+
+	perf_totals perf;
+	perf.fill(0);
+	for(const worker_metrics &m : producer_metrics)
+		add_totals(perf, m.perf.read());
+	for(const worker_metrics &m : consumer_metrics)
+		add_totals(perf, m.perf.read());
+
+	// The workers are done with everything on our stack once they've all
+	// come back to the team.
+	team.wait();
+
+	// Only report the placement we really got.
+	if(!cpus.empty() && jobs.pinned != cpus){
+		std::cerr << "warning: couldn't pin "
+		          << std::count(jobs.pinned.begin(), jobs.pinned.end(), -1) << " of "
+		          << cpus.size() << " workers, they're reported as CPU -1\n";
+		cpus = jobs.pinned;
+	}
+
+	fairness_summary producer_fairness;
+	fairness_summary consumer_fairness;
+	if(sampler.joinable()){
+		sampler.request_stop();
+		sampler.join();
+
+		// Nobody had done anything at the start, and everybody was done at
+		// the end.
+		std::erase_if(progress, [&](const progress_sample &s){
+			return s.when <= wall_start || s.when >= wall_stop;
+		});
+		progress.insert(progress.begin(), progress_sample{wall_start, 0,
+			std::vector<std::int64_t>(producers + consumers, 0)});
+		progress.push_back(sample_progress(wall_stop));
+
+		producer_fairness = summarize_fairness(progress, 0, producer_quotas, false);
+		consumer_fairness = summarize_fairness(progress, producers, consumer_quotas, true);
+	}
 
 	return concurrency_test_time{
 		wall_stop - wall_start,
 		cpu_stop - cpu_start,
+		std::move(latency),
+		std::move(timeout_overshoot),
+		perf,
+		context_switches{
+			switches_stop.voluntary - switches_start.voluntary,
+			switches_stop.involuntary - switches_start.involuntary,
+		},
+		allocations_stop - allocations_start,
+		memory_start,
+		peak_reset ? memory_stop.peak_rss_kib : std::nullopt,
+		std::move(cpus),
+		std::move(progress),
+		std::move(producer_fairness),
+		std::move(consumer_fairness),
 	};
 }
 
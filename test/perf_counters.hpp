@@ -0,0 +1,189 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* perf_counters: Hardware performance counters and context switch counts
+ *                for the benchmarks.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef STORM_PERF_COUNTERS_H
+#define STORM_PERF_COUNTERS_H 1
+
+#include <array>
+#include <optional>
+#include <cstddef>
+#include <cstdint>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <sys/resource.h>
+
+namespace storm {
+	namespace test {
+
+// The hardware events we count, in the order they're stored.
+enum perf_event_index : std::size_t {
+	perf_cycles,
+	perf_instructions,
+	perf_cache_misses,
+	perf_branch_misses,
+	perf_event_count,
+};
+
+// Totals for each event. An event is empty if we couldn't count it, which
+// is normal in containers, VMs without a virtual PMU, or with a strict
+// perf_event_paranoid.
+using perf_totals = std::array<std::optional<std::uint64_t>, perf_event_count>;
+
+/* thread_perf_counters: the hardware counters for one thread.
+ *
+ * A worker calls open_for_this_thread() during its setup, and the thread
+ * running the benchmark turns everyone's counters on and off together with
+ * enable() and disable(), so the counts cover just the timed part. The
+ * counts stay readable after the thread exits.
+ */
+class thread_perf_counters {
+public:
+	thread_perf_counters(){
+		fds.fill(-1);
+	}
+	~thread_perf_counters(){
+		close_all();
+	}
+
+	// We own file descriptors, so no copying or moving.
+	thread_perf_counters(const thread_perf_counters&) = delete;
+	thread_perf_counters(thread_perf_counters&&) = delete;
+	thread_perf_counters& operator=(const thread_perf_counters&) = delete;
+	thread_perf_counters& operator=(thread_perf_counters&&) = delete;
+
+	// open_for_this_thread: start watching the calling thread, disabled. Any
+	// event we aren't allowed to count is just left out.
+	void open_for_this_thread(){
+#ifdef __linux__
+		static constexpr std::array<std::uint64_t, perf_event_count> configs{
+			PERF_COUNT_HW_CPU_CYCLES,
+			PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_CACHE_MISSES,
+			PERF_COUNT_HW_BRANCH_MISSES,
+		};
+
+		close_all();
+		for(std::size_t i = 0; i < perf_event_count; i++){
+			perf_event_attr attr{};
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.size = sizeof(attr);
+			attr.config = configs[i];
+			attr.disabled = 1;
+			// Counting the kernel needs more privileges than we usually have,
+			// and it's mostly futex calls that the switch counts cover anyway.
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			// In case the PMU is oversubscribed and has to multiplex.
+			attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+			fds[i] = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+		}
+#endif
+	}
+
+	// enable: reset the counts and start counting.
+	void enable(){
+#ifdef __linux__
+		for(const int fd : fds){
+			if(fd >= 0){
+				ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+				ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+			}
+		}
+#endif
+	}
+
+	// disable: stop counting.
+	void disable(){
+#ifdef __linux__
+		for(const int fd : fds)
+			if(fd >= 0)
+				ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+#endif
+	}
+
+	// read: get the counts, scaled up if the kernel had to multiplex them.
+	[[nodiscard]] perf_totals read() const {
+		perf_totals totals;
+#ifdef __linux__
+		for(std::size_t i = 0; i < perf_event_count; i++){
+			if(fds[i] < 0)
+				continue;
+
+			// value, time enabled, time running
+			std::uint64_t buf[3];
+			if(::read(fds[i], buf, sizeof(buf)) != sizeof(buf))
+				continue;
+
+			if(buf[2] == 0 || buf[2] == buf[1])
+				totals[i] = buf[0];
+			else
+				totals[i] = std::uint64_t(double(buf[0]) * double(buf[1]) / double(buf[2]));
+		}
+#endif
+		return totals;
+	}
+
+private:
+	void close_all(){
+#ifdef __linux__
+		for(int &fd : fds){
+			if(fd >= 0)
+				close(fd);
+			fd = -1;
+		}
+#endif
+	}
+
+	std::array<int, perf_event_count> fds;
+};
+
+// add_totals: add b into a. If either one is missing an event, so does the
+// sum, since a total over only some of the threads would be misleading.
+inline void add_totals(perf_totals &a, const perf_totals &b){
+	for(std::size_t i = 0; i < perf_event_count; i++){
+		if(a[i] && b[i])
+			*a[i] += *b[i];
+		else
+			a[i].reset();
+	}
+}
+
+// Voluntary and involuntary context switches for the whole process.
+struct context_switches {
+	long voluntary;
+	long involuntary;
+};
+
+inline context_switches process_context_switches(){
+	rusage ru{};
+	getrusage(RUSAGE_SELF, &ru);
+	return context_switches{ru.ru_nvcsw, ru.ru_nivcsw};
+}
+
+	}
+}
+#endif /* STORM_PERF_COUNTERS_H */
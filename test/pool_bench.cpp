@@ -0,0 +1,813 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* pool_bench: Benchmarks for the thread_pool.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <iostream>
+#include <fstream>
+#include <thread>
+#include <future>
+#include <vector>
+#include <array>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <optional>
+#include <functional>
+#include <charconv>
+#include <algorithm>
+#include <random>
+#include <iterator>
+#include <new>
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <cmath>
+#include <cstdlib>
+
+#include "mpmc_queue.hpp"
+#include "mpmc_semaphore_queue.hpp"
+#include "latency_histogram.hpp"
+#include "unique_function.hpp"
+#include "task_future.hpp"
+#include "thread_pool.hpp"
+#include "parallel_algorithms.hpp"
+#include "task_group.hpp"
+#include "bench_report.hpp"
+#include "memory_counters.hpp"
+#include "allocation_hooks.hpp"
+using namespace storm;
+using namespace storm::test;
+
+using std::cout;
+using std::cerr;
+
+// The scenarios we know how to run.
+static constexpr std::array<std::string_view, 6> pool_scenarios{
+	"throughput",
+	"latency",
+	"futures",
+	"parallel",
+	"forkjoin",
+	"functions",
+};
+
+// Everything you can pick from the command line.
+struct pool_options {
+	// Which queues to run the pool on: "mpmc", "semaphore", or "all".
+	std::string engine = "all";
+	std::vector<std::string> scenarios{"throughput", "latency", "futures", "parallel", "forkjoin",
+		"functions"};
+	// How many workers in the pool, or 0 for one per hardware thread.
+	std::vector<unsigned> threads{1, 0};
+	// Overrides for how many tasks each test runs.
+	std::optional<int> tasks;
+	// How long to leave the pool idle between tasks for the idle latency.
+	std::chrono::microseconds gap{100};
+	int reps = 1;
+	int warmup = 1;
+	output_format format = output_format::table;
+	std::string output;
+};
+
+static void print_usage(const char *argv0){
+	cerr << "usage: " << argv0 << " [options]\n"
+	     << "  --engine=mpmc|semaphore|all   which queues feed the pool (all)\n"
+	     << "  --scenario=NAME[,NAME...]     throughput (empty tasks per second\n"
+	     << "                                with post, submit, a std::future, and\n"
+	     << "                                post_bulk), latency (submit to start,\n"
+	     << "                                with the pool idle and loaded), futures\n"
+	     << "                                (submit and get one at a time, with\n"
+	     << "                                task_future, std::future, and\n"
+	     << "                                std::async), parallel (parallel_for\n"
+	     << "                                and parallel_reduce with each kind of\n"
+	     << "                                chunking, and a task per element),\n"
+	     << "                                forkjoin (recursive fib and quicksort,\n"
+	     << "                                with task_group and std::async),\n"
+	     << "                                functions\n"
+	     << "                                (std::function against unique_function\n"
+	     << "                                through a queue on one thread, for\n"
+	     << "                                each closure size) (all)\n"
+	     << "  --threads=N[,N...]            pool sizes, 0 is one per hardware\n"
+	     << "                                thread (1,0)\n"
+	     << "  --tasks=N                     tasks per test, or elements for\n"
+	     << "                                parallel and quicksort\n"
+	     << "  --gap-us=N                    idle time between idle latency\n"
+	     << "                                tasks (100)\n"
+	     << "  --reps=N                      repetitions of each test (1)\n"
+	     << "  --warmup=N                    unrecorded runs before the reps (1)\n"
+	     << "  --format=table|json|csv       output format (table)\n"
+	     << "  --output=FILE                 write results to FILE, not stdout\n";
+}
+
+// parse_options: fill in pool_options from argv, or complain and return
+// nothing.
+static std::optional<pool_options> parse_options(int argc, char **argv){
+	pool_options opts;
+
+	for(int i = 1; i < argc; i++){
+		const std::string_view arg(argv[i]);
+		const auto eq = arg.find('=');
+		const std::string_view name = arg.substr(0, eq);
+		const std::string_view value = eq == std::string_view::npos ?
+			std::string_view() : arg.substr(eq + 1);
+
+		bool ok = true;
+		if(name == "--help" || name == "-h"){
+			print_usage(argv[0]);
+			return std::nullopt;
+		}else if(name == "--engine"){
+			opts.engine = value;
+			ok = value == "mpmc" || value == "semaphore" || value == "all";
+		}else if(name == "--scenario"){
+			opts.scenarios = split_list(value);
+			for(const std::string &s : opts.scenarios)
+				ok = ok && std::find(pool_scenarios.begin(), pool_scenarios.end(), s) !=
+					pool_scenarios.end();
+		}else if(name == "--threads"){
+			opts.threads.clear();
+			for(const std::string &t : split_list(value)){
+				const auto n = parse_int<unsigned>(t);
+				ok = ok && n.has_value();
+				opts.threads.push_back(n.value_or(0));
+			}
+		}else if(name == "--tasks"){
+			opts.tasks = parse_int<int>(value);
+			ok = opts.tasks.value_or(0) > 0;
+		}else if(name == "--gap-us"){
+			const auto us = parse_int<std::int64_t>(value);
+			ok = us.has_value();
+			opts.gap = std::chrono::microseconds(us.value_or(0));
+		}else if(name == "--reps"){
+			const auto reps = parse_int<int>(value);
+			ok = reps.value_or(0) > 0;
+			opts.reps = reps.value_or(1);
+		}else if(name == "--warmup"){
+			const auto warmup = parse_int<int>(value);
+			ok = warmup.has_value();
+			opts.warmup = warmup.value_or(0);
+		}else if(name == "--format"){
+			const auto f = parse_output_format(value);
+			ok = f.has_value();
+			opts.format = f.value_or(output_format::table);
+		}else if(name == "--output"){
+			opts.output = value;
+			ok = !value.empty();
+		}else{
+			cerr << "unknown option: " << arg << '\n';
+			print_usage(argv[0]);
+			return std::nullopt;
+		}
+
+		if(!ok){
+			cerr << "bad value for " << name << ": '" << value << "'\n";
+			print_usage(argv[0]);
+			return std::nullopt;
+		}
+	}
+
+	return opts;
+}
+
+// How a test gets its tasks into the pool.
+enum class submit_method {
+	post,
+	submit,
+	// Like submit, but with a std::packaged_task and std::future, for
+	// comparison.
+	std_future,
+	bulk,
+};
+
+inline const char *submit_method_name(const submit_method m){
+	switch(m){
+	case submit_method::post: return "post";
+	case submit_method::submit: return "submit";
+	case submit_method::std_future: return "std_future";
+	case submit_method::bulk: return "post_bulk";
+	}
+	return "?";
+}
+
+// What a throughput test took.
+struct throughput_time {
+	std::chrono::steady_clock::duration wall_time;
+	std::clock_t cpu_time;
+	allocation_totals allocations;
+};
+
+/* empty_tasks: push tasks empty tasks through the pool one way or another,
+ *              and time it until they've all finished.
+ *
+ * The tasks don't do anything, so this is all overhead: making the task,
+ * the queue, waking workers, and for submit, the future's shared state.
+ */
+template<typename Pool>
+static throughput_time empty_tasks(Pool &pool, const submit_method method, const int tasks){
+	// Set these up ahead of time, so the timing is just the pool.
+	std::vector<task_future<void>> futures;
+	std::vector<std::future<void>> std_futures;
+	std::vector<typename Pool::task> batch;
+	if(method == submit_method::submit)
+		futures.reserve(tasks);
+	if(method == submit_method::std_future)
+		std_futures.reserve(tasks);
+	if(method == submit_method::bulk){
+		batch.reserve(tasks);
+		for(int i = 0; i < tasks; i++)
+			batch.emplace_back([](){});
+	}
+
+	const allocation_totals allocations_start = allocations_so_far();
+	const auto wall_start = std::chrono::steady_clock::now();
+	const std::clock_t cpu_start = std::clock();
+
+	switch(method){
+	case submit_method::post:
+		for(int i = 0; i < tasks; i++)
+			pool.post([](){});
+		break;
+	case submit_method::submit:
+		for(int i = 0; i < tasks; i++)
+			futures.push_back(pool.submit([](){}));
+		break;
+	case submit_method::std_future:
+		for(int i = 0; i < tasks; i++){
+			std::packaged_task<void()> p([](){});
+			std_futures.push_back(p.get_future());
+			pool.post(std::move(p));
+		}
+		break;
+	case submit_method::bulk:
+		pool.post_bulk(batch.begin(), batch.end());
+		break;
+	}
+	pool.drain();
+
+	return throughput_time{std::chrono::steady_clock::now() - wall_start,
+		std::clock() - cpu_start, allocations_so_far() - allocations_start};
+}
+
+/* start_latency: time from submitting each task to it starting on a
+ *                worker.
+ *
+ * gap: how long to wait between submissions. With a gap, every task finds
+ *      the workers asleep, so this is mostly how long it takes to wake one.
+ *      Without one, they're all submitted back to back, and the later ones
+ *      wait behind the earlier ones.
+ */
+template<typename Pool>
+static log_linear_histogram start_latency(Pool &pool, const int tasks,
+		const std::chrono::microseconds gap){
+	using clock = std::chrono::steady_clock;
+	concurrent_log_linear_histogram latency;
+
+	for(int i = 0; i < tasks; i++){
+		pool.post([&latency, sent = clock::now()](){
+			latency.record(std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				clock::now() - sent).count()));
+		});
+		if(gap.count() > 0)
+			std::this_thread::sleep_for(gap);
+	}
+	pool.drain();
+
+	return latency.snapshot();
+}
+
+// run_throughput: the throughput scenario, for each way of submitting.
+template<typename Pool>
+static void run_throughput(const std::string &engine, const pool_options &opts,
+		Pool &pool, std::vector<bench_record> &records){
+	using std::chrono::duration;
+
+	const int tasks = opts.tasks.value_or(1'000'000);
+
+	for(const submit_method method : {submit_method::post, submit_method::submit,
+			submit_method::std_future, submit_method::bulk}){
+		for(int rep = -opts.warmup; rep < opts.reps; rep++){
+			cerr << pool.size() << " threads " << submit_method_name(method) << ": " << std::flush;
+			const throughput_time times = empty_tasks(pool, method, tasks);
+			if(warmed_up(rep))
+				continue;
+
+			const double cpu_ns = double(times.cpu_time) * 1e9 / CLOCKS_PER_SEC;
+
+			bench_record r;
+			r.label("scenario", "throughput")
+			 .label("engine", engine)
+			 .label("method", submit_method_name(method))
+			 .metric("threads", double(pool.size()))
+			 .metric("tasks", tasks)
+			 .metric("rep", rep)
+			 .metric("wall_ns", double(std::chrono::nanoseconds(times.wall_time).count()))
+			 .metric("tasks_per_s", std::round(tasks / duration<double>(times.wall_time).count()))
+			 .metric("cpu_ns_per_task", cpu_ns / tasks)
+			 .metric("allocs_per_task", double(times.allocations.allocations) / tasks)
+			 .metric("alloc_bytes_per_task", double(times.allocations.bytes) / tasks);
+			records.push_back(std::move(r));
+
+			cerr << "done\n";
+		}
+	}
+}
+
+// run_latency: the latency scenario, with the pool idle and loaded.
+template<typename Pool>
+static void run_latency(const std::string &engine, const pool_options &opts,
+		Pool &pool, std::vector<bench_record> &records){
+	for(const bool idle : {true, false}){
+		const std::chrono::microseconds gap = idle ? opts.gap : std::chrono::microseconds(0);
+		const int tasks = opts.tasks.value_or(idle ? 10'000 : 1'000'000);
+
+		for(int rep = -opts.warmup; rep < opts.reps; rep++){
+			cerr << pool.size() << " threads " << (idle ? "idle" : "loaded") << ": " << std::flush;
+			const log_linear_histogram latency = start_latency(pool, tasks, gap);
+			if(warmed_up(rep))
+				continue;
+
+			bench_record r;
+			r.label("scenario", "latency")
+			 .label("engine", engine)
+			 .label("load", idle ? "idle" : "loaded")
+			 .metric("threads", double(pool.size()))
+			 .metric("tasks", tasks)
+			 .metric("gap_us", double(gap.count()))
+			 .metric("rep", rep);
+			add_latency_metrics(r, "start_", latency);
+			records.push_back(std::move(r));
+
+			cerr << "done\n";
+		}
+	}
+}
+
+// The kinds of future the futures scenario compares.
+enum class future_kind {
+	task_future,
+	std_future,
+	std_async,
+};
+
+inline const char *future_kind_name(const future_kind k){
+	switch(k){
+	case future_kind::task_future: return "task_future";
+	case future_kind::std_future: return "std_future";
+	case future_kind::std_async: return "std_async";
+	}
+	return "?";
+}
+
+/* round_trips: submit a task and get() its result, tasks times, one at a
+ *              time.
+ *
+ * Unlike the throughput scenario, there's only ever one task in flight,
+ * so every get() really has to wait for a worker, and this is the whole
+ * cost of a future: the shared state, setting it, and waking the waiter.
+ *
+ * std_async doesn't use the pool at all, it's what std::async does on its
+ * own, which is start a thread for every task.
+ */
+template<typename Pool>
+static throughput_time round_trips(Pool &pool, const future_kind kind, const int tasks){
+	int sum = 0;
+
+	const allocation_totals allocations_start = allocations_so_far();
+	const auto wall_start = std::chrono::steady_clock::now();
+	const std::clock_t cpu_start = std::clock();
+
+	for(int i = 0; i < tasks; i++){
+		switch(kind){
+		case future_kind::task_future:
+			sum += pool.submit([i](){ return i; }).get();
+			break;
+		case future_kind::std_future: {
+			std::packaged_task<int()> p([i](){ return i; });
+			std::future<int> f = p.get_future();
+			pool.post(std::move(p));
+			sum += f.get();
+			break;
+		}
+		case future_kind::std_async:
+			sum += std::async(std::launch::async, [i](){ return i; }).get();
+			break;
+		}
+	}
+
+	const throughput_time times{std::chrono::steady_clock::now() - wall_start,
+		std::clock() - cpu_start, allocations_so_far() - allocations_start};
+	// Keep the tasks from being optimized out.
+	if(sum == 1)
+		cerr << ' ';
+	return times;
+}
+
+// run_futures: the futures scenario, for each kind of future.
+template<typename Pool>
+static void run_futures(const std::string &engine, const pool_options &opts,
+		Pool &pool, std::vector<bench_record> &records){
+	for(const future_kind kind : {future_kind::task_future, future_kind::std_future,
+			future_kind::std_async}){
+		// A thread per task is slow enough that it gets fewer.
+		const int tasks = opts.tasks.value_or(kind == future_kind::std_async ? 10'000 : 100'000);
+
+		for(int rep = -opts.warmup; rep < opts.reps; rep++){
+			cerr << pool.size() << " threads " << future_kind_name(kind) << ": " << std::flush;
+			const throughput_time times = round_trips(pool, kind, tasks);
+			if(warmed_up(rep))
+				continue;
+
+			const double wall_ns = double(std::chrono::nanoseconds(times.wall_time).count());
+			const double cpu_ns = double(times.cpu_time) * 1e9 / CLOCKS_PER_SEC;
+
+			bench_record r;
+			r.label("scenario", "futures")
+			 .label("engine", engine)
+			 .label("future", future_kind_name(kind))
+			 .metric("threads", double(pool.size()))
+			 .metric("tasks", tasks)
+			 .metric("rep", rep)
+			 .metric("wall_ns", wall_ns)
+			 .metric("ns_per_task", wall_ns / tasks)
+			 .metric("cpu_ns_per_task", cpu_ns / tasks)
+			 .metric("allocs_per_task", double(times.allocations.allocations) / tasks)
+			 .metric("alloc_bytes_per_task", double(times.allocations.bytes) / tasks);
+			records.push_back(std::move(r));
+
+			cerr << "done\n";
+		}
+	}
+}
+
+inline const char *chunking_name(const chunking c){
+	switch(c){
+	case chunking::static_chunks: return "static";
+	case chunking::guided: return "guided";
+	case chunking::adaptive: return "adaptive";
+	}
+	return "?";
+}
+
+/* parallel_loop: a cheap loop over data, with parallel_for or
+ *                parallel_reduce, or with no mode, a task per element.
+ *
+ * The body is only a few nanoseconds, so this is mostly how much the
+ * splitting costs. A task per element is what you'd get without the
+ * parallel algorithms, and it's all queue operations.
+ */
+template<typename Pool>
+static throughput_time parallel_loop(Pool &pool, const bool reduce,
+		const std::optional<chunking> mode, std::vector<double> &data){
+	const auto body = [&data](const std::size_t i){ data[i] = std::sqrt(data[i]) + 1; };
+	double sum = 0;
+
+	const allocation_totals allocations_start = allocations_so_far();
+	const auto wall_start = std::chrono::steady_clock::now();
+	const std::clock_t cpu_start = std::clock();
+
+	if(!mode){
+		for(std::size_t i = 0; i < data.size(); i++)
+			pool.post([&body, i](){ body(i); });
+		pool.drain();
+	}else if(reduce){
+		sum = parallel_reduce(pool, data.begin(), data.end(), 0.0, std::plus<>(),
+			[](const double x){ return std::sqrt(x); }, parallel_options{*mode, 1});
+	}else{
+		parallel_for(pool, std::size_t(0), data.size(), body, parallel_options{*mode, 1});
+	}
+
+	const throughput_time times{std::chrono::steady_clock::now() - wall_start,
+		std::clock() - cpu_start, allocations_so_far() - allocations_start};
+	// Keep the reduction from being optimized out.
+	if(sum == 1)
+		cerr << ' ';
+	return times;
+}
+
+// run_parallel: the parallel scenario, for each algorithm and chunking.
+template<typename Pool>
+static void run_parallel(const std::string &engine, const pool_options &opts,
+		Pool &pool, std::vector<bench_record> &records){
+	const int elements = opts.tasks.value_or(1'000'000);
+	std::vector<double> data(std::size_t(elements), 2.0);
+
+	for(const bool reduce : {false, true}){
+		for(const std::optional<chunking> mode : {std::optional<chunking>(),
+				std::optional(chunking::static_chunks), std::optional(chunking::guided),
+				std::optional(chunking::adaptive)}){
+			// There's no reduce that's a task per element.
+			if(reduce && !mode)
+				continue;
+			const char *algorithm = reduce ? "parallel_reduce" : "parallel_for";
+			const char *mode_name = mode ? chunking_name(*mode) : "per_task";
+
+			for(int rep = -opts.warmup; rep < opts.reps; rep++){
+				cerr << pool.size() << " threads " << algorithm << ' ' << mode_name << ": "
+				     << std::flush;
+				const throughput_time times = parallel_loop(pool, reduce, mode, data);
+				if(warmed_up(rep))
+					continue;
+
+				const double wall_ns = double(std::chrono::nanoseconds(times.wall_time).count());
+				const double cpu_ns = double(times.cpu_time) * 1e9 / CLOCKS_PER_SEC;
+
+				bench_record r;
+				r.label("scenario", "parallel")
+				 .label("engine", engine)
+				 .label("algorithm", algorithm)
+				 .label("chunking", mode_name)
+				 .metric("threads", double(pool.size()))
+				 .metric("elements", elements)
+				 .metric("rep", rep)
+				 .metric("wall_ns", wall_ns)
+				 .metric("ns_per_element", wall_ns / elements)
+				 .metric("cpu_ns_per_element", cpu_ns / elements)
+				 .metric("allocs_per_element", double(times.allocations.allocations) / elements);
+				records.push_back(std::move(r));
+
+				cerr << "done\n";
+			}
+		}
+	}
+}
+
+// Ways the forkjoin scenario waits for its children.
+enum class join_method {
+	// task_group::wait(), which helps.
+	task_group,
+	// std::async and std::future::get(), which blocks. It starts a thread
+	// for every child, since blocking workers in a fixed pool would
+	// deadlock.
+	std_async,
+};
+
+inline const char *join_method_name(const join_method j){
+	switch(j){
+	case join_method::task_group: return "task_group";
+	case join_method::std_async: return "std_async";
+	}
+	return "?";
+}
+
+// The fib the forkjoin scenario finds, and below where it stops forking.
+inline constexpr int forkjoin_fib_n = 30;
+inline constexpr int forkjoin_fib_cutoff = 16;
+// Below how many elements quicksort just calls std::sort.
+inline constexpr std::ptrdiff_t forkjoin_sort_cutoff = 4096;
+
+static std::int64_t serial_fib(const int n){
+	return n < 2 ? n : serial_fib(n - 1) + serial_fib(n - 2);
+}
+
+// fork_join: run a and b in parallel, one way or the other.
+template<typename Pool, typename A, typename B>
+static void fork_join(Pool &pool, const join_method join, A &&a, B &&b){
+	if(join == join_method::task_group){
+		task_group g(pool);
+		g.run(std::forward<A>(a));
+		b();
+		g.wait();
+	}else{
+		std::future<void> f = std::async(std::launch::async, std::forward<A>(a));
+		b();
+		f.get();
+	}
+}
+
+template<typename Pool>
+static std::int64_t parallel_fib(Pool &pool, const join_method join, const int n){
+	if(n < forkjoin_fib_cutoff)
+		return serial_fib(n);
+
+	std::int64_t a = 0, b = 0;
+	fork_join(pool, join,
+		[&pool, &a, join, n](){ a = parallel_fib(pool, join, n - 1); },
+		[&pool, &b, join, n](){ b = parallel_fib(pool, join, n - 2); });
+	return a + b;
+}
+
+template<typename Pool, typename It>
+static void parallel_quicksort(Pool &pool, const join_method join, const It first, const It last){
+	if(last - first < forkjoin_sort_cutoff){
+		std::sort(first, last);
+		return;
+	}
+
+	// Middle of three for the pivot, then a three-way partition, so runs
+	// of equal elements don't recurse.
+	auto pivot = *std::next(first, (last - first) / 2);
+	pivot = std::max(std::min(*first, pivot), std::min(std::max(*first, pivot), *std::prev(last)));
+	const It lt = std::partition(first, last, [pivot](const auto &x){ return x < pivot; });
+	const It gt = std::partition(lt, last, [pivot](const auto &x){ return !(pivot < x); });
+
+	fork_join(pool, join,
+		[&pool, join, first, lt](){ parallel_quicksort(pool, join, first, lt); },
+		[&pool, join, gt, last](){ parallel_quicksort(pool, join, gt, last); });
+}
+
+// run_forkjoin: the forkjoin scenario, for fib and quicksort both ways.
+template<typename Pool>
+static void run_forkjoin(const std::string &engine, const pool_options &opts,
+		Pool &pool, std::vector<bench_record> &records){
+	const int elements = opts.tasks.value_or(1'000'000);
+	std::vector<std::uint32_t> unsorted(std::size_t(elements), 0);
+	std::mt19937 rng(12345);
+	for(std::uint32_t &x : unsorted)
+		x = std::uint32_t(rng());
+
+	for(const bool sort : {false, true}){
+		for(const join_method join : {join_method::task_group, join_method::std_async}){
+			const char *problem = sort ? "quicksort" : "fib";
+
+			for(int rep = -opts.warmup; rep < opts.reps; rep++){
+				cerr << pool.size() << " threads " << problem << ' ' << join_method_name(join)
+				     << ": " << std::flush;
+
+				std::vector<std::uint32_t> data = unsorted;
+				bool right = true;
+				const auto wall_start = std::chrono::steady_clock::now();
+				const std::clock_t cpu_start = std::clock();
+				if(sort)
+					parallel_quicksort(pool, join, data.begin(), data.end());
+				else
+					right = parallel_fib(pool, join, forkjoin_fib_n) == 832040;
+				const auto wall_time = std::chrono::steady_clock::now() - wall_start;
+				const std::clock_t cpu_time = std::clock() - cpu_start;
+				right = right && std::is_sorted(data.begin(), data.end()) == sort;
+
+				if(!right)
+					cerr << "wrong answer! ";
+				if(warmed_up(rep))
+					continue;
+
+				bench_record r;
+				r.label("scenario", "forkjoin")
+				 .label("engine", engine)
+				 .label("problem", problem)
+				 .label("join", join_method_name(join))
+				 .metric("threads", double(pool.size()))
+				 .metric("size", sort ? elements : forkjoin_fib_n)
+				 .metric("rep", rep)
+				 .metric("wall_ns", double(std::chrono::nanoseconds(wall_time).count()))
+				 .metric("cpu_ns", double(cpu_time) * 1e9 / CLOCKS_PER_SEC);
+				records.push_back(std::move(r));
+
+				cerr << "done\n";
+			}
+		}
+	}
+}
+
+/* function_round_trips: make tasks closures of Bytes bytes as a Function,
+ *                        push each one through a queue, and call it, all on
+ *                        one thread.
+ *
+ * That's what every task in a pool goes through, minus the other threads,
+ * so the difference between Functions is down to how they store the
+ * closure.
+ */
+template<typename Function, std::size_t Bytes>
+static throughput_time function_round_trips(const int tasks){
+	mpmc_queue<Function> q;
+	std::array<unsigned char, Bytes> payload{};
+	unsigned sum = 0;
+
+	const allocation_totals allocations_start = allocations_so_far();
+	const auto wall_start = std::chrono::steady_clock::now();
+	const std::clock_t cpu_start = std::clock();
+
+	for(int i = 0; i < tasks; i++){
+		payload[0] = static_cast<unsigned char>(i);
+		q.push(Function([payload, &sum](){ sum += payload[0]; }));
+		q.pop_wait()();
+	}
+
+	const throughput_time times{std::chrono::steady_clock::now() - wall_start,
+		std::clock() - cpu_start, allocations_so_far() - allocations_start};
+	// Keep the calls from being optimized out.
+	if(sum == 1)
+		cerr << ' ';
+	return times;
+}
+
+/* run_functions: the functions scenario.
+ *
+ * Closures up to 48 bytes (plus the reference they all capture) fit in
+ * unique_function's buffer, and only the smallest fit in std::function's,
+ * so this shows where each one starts allocating and what that costs.
+ */
+template<typename Function, std::size_t... Sizes>
+static void run_functions(const char *name, const pool_options &opts,
+		std::index_sequence<Sizes...>, std::vector<bench_record> &records){
+	using std::chrono::duration;
+
+	const int tasks = opts.tasks.value_or(1'000'000);
+
+	const auto one = [&]<std::size_t Bytes>(std::integral_constant<std::size_t, Bytes>){
+		for(int rep = -opts.warmup; rep < opts.reps; rep++){
+			cerr << name << ' ' << Bytes << " bytes: " << std::flush;
+			const throughput_time times = function_round_trips<Function, Bytes>(tasks);
+			if(warmed_up(rep))
+				continue;
+
+			bench_record r;
+			r.label("scenario", "functions")
+			 .label("function", name)
+			 .metric("closure_bytes", double(Bytes + sizeof(void*)))
+			 .metric("tasks", tasks)
+			 .metric("rep", rep)
+			 .metric("wall_ns", double(std::chrono::nanoseconds(times.wall_time).count()))
+			 .metric("ns_per_task", double(std::chrono::nanoseconds(times.wall_time).count()) / tasks)
+			 .metric("allocs_per_task", double(times.allocations.allocations) / tasks)
+			 .metric("alloc_bytes_per_task", double(times.allocations.bytes) / tasks);
+			records.push_back(std::move(r));
+
+			cerr << "done\n";
+		}
+	};
+	(one(std::integral_constant<std::size_t, Sizes>()), ...);
+}
+
+template<template<typename> typename Queue>
+static void benchmark(const std::string &engine, const pool_options &opts,
+		std::vector<bench_record> &records){
+	cerr << "Benchmarking a thread_pool on " << engine << ":\n";
+
+	for(const unsigned threads : opts.threads){
+		thread_pool<Queue> pool(threads);
+
+		for(const std::string &name : opts.scenarios){
+			if(name == "throughput")
+				run_throughput(engine, opts, pool, records);
+			else if(name == "latency")
+				run_latency(engine, opts, pool, records);
+			else if(name == "futures")
+				run_futures(engine, opts, pool, records);
+			else if(name == "parallel")
+				run_parallel(engine, opts, pool, records);
+			else if(name == "forkjoin")
+				run_forkjoin(engine, opts, pool, records);
+		}
+	}
+}
+
+int main(int argc, char **argv){
+	std::optional<pool_options> opts = parse_options(argc, argv);
+	if(!opts)
+		return 2;
+
+	// 0 and the hardware concurrency are the same pool, so don't run it
+	// twice.
+	const unsigned hw = std::max(1u, std::thread::hardware_concurrency());
+	for(unsigned &t : opts->threads)
+		t = t == 0 ? hw : t;
+	std::sort(opts->threads.begin(), opts->threads.end());
+	opts->threads.erase(std::unique(opts->threads.begin(), opts->threads.end()),
+		opts->threads.end());
+
+	// Open the output first, so we don't find out it's bad after running.
+	std::ofstream file;
+	if(!opts->output.empty()){
+		file.open(opts->output);
+		if(!file){
+			cerr << "can't open " << opts->output << " for writing\n";
+			return 1;
+		}
+	}
+	std::ostream &out = opts->output.empty() ? cout : file;
+
+	std::vector<bench_record> records;
+
+	if(opts->engine == "mpmc" || opts->engine == "all")
+		benchmark<mpmc_queue>("mpmc_queue", *opts, records);
+	if(opts->engine == "semaphore" || opts->engine == "all")
+		benchmark<mpmc_semaphore_queue>("mpmc_semaphore_queue", *opts, records);
+
+	// This one doesn't use a pool, so it only runs once.
+	if(std::find(opts->scenarios.begin(), opts->scenarios.end(), "functions") !=
+			opts->scenarios.end()){
+		cerr << "Benchmarking task types:\n";
+		using closure_sizes = std::index_sequence<8, 24, 48, 56, 120>;
+		run_functions<std::function<void()>>("std::function", *opts, closure_sizes(), records);
+		run_functions<unique_function<void()>>("unique_function", *opts, closure_sizes(), records);
+	}
+
+	write_records(out, opts->format, records);
+
+	return 0;
+}
@@ -0,0 +1,133 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* service_time: Consumers that spend time on each item, like real ones.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef STORM_SERVICE_TIME_H
+#define STORM_SERVICE_TIME_H 1
+
+#include <chrono>
+#include <random>
+#include <optional>
+#include <string_view>
+#include <cmath>
+
+#include "mpmc_test_helpers.hpp"
+#include "busy_work.hpp"
+
+namespace storm {
+	namespace test {
+
+/* How long consumers spend on each item.
+ *
+ * fixed      : exactly the mean, every time.
+ * exponential: exponentially distributed, like an M/M/c queue's servers.
+ * bimodal    : mostly quick, but bimodal_slow_fraction of the items take
+ *              bimodal_slow_ratio times as long, like cache misses or the
+ *              odd request that has to go to disk.
+ *
+ * They all come out to the same mean, so they have the same utilization
+ * at the same arrival rate, and any difference is down to the variance.
+ */
+enum class service_distribution {
+	fixed,
+	exponential,
+	bimodal,
+};
+
+inline constexpr double bimodal_slow_fraction = 0.1;
+inline constexpr double bimodal_slow_ratio = 10;
+
+inline const char *service_distribution_name(const service_distribution d){
+	switch(d){
+	case service_distribution::fixed: return "fixed";
+	case service_distribution::exponential: return "exponential";
+	case service_distribution::bimodal: return "bimodal";
+	}
+	return "?";
+}
+
+inline std::optional<service_distribution> parse_service_distribution(std::string_view name){
+	for(const service_distribution d : {service_distribution::fixed,
+			service_distribution::exponential, service_distribution::bimodal})
+		if(name == service_distribution_name(d))
+			return d;
+	return std::nullopt;
+}
+
+// service_times: how long to spend on each item, drawn from a distribution.
+template<service_distribution Distribution>
+class service_times {
+public:
+	explicit service_times(const std::chrono::nanoseconds mean_time) :
+		mean(double(mean_time.count())),
+		rng(std::random_device()()),
+		exponential(1.0),
+		slow(bimodal_slow_fraction) {}
+
+	// next: how long to spend on the next item.
+	std::chrono::nanoseconds next(){
+		if constexpr(Distribution == service_distribution::fixed){
+			return std::chrono::nanoseconds(std::llround(mean));
+		}else if constexpr(Distribution == service_distribution::exponential){
+			return std::chrono::nanoseconds(std::llround(exponential(rng) * mean));
+		}else{
+			// Scale the quick ones down so the slow ones don't raise the
+			// mean.
+			const double quick = mean /
+				(1 - bimodal_slow_fraction + bimodal_slow_fraction * bimodal_slow_ratio);
+			return std::chrono::nanoseconds(std::llround(
+				slow(rng) ? quick * bimodal_slow_ratio : quick));
+		}
+	}
+
+private:
+	const double mean;
+	std::mt19937_64 rng;
+	std::exponential_distribution<double> exponential;
+	std::bernoulli_distribution slow;
+};
+
+/* service_consumer: pop n items from q using pop_wait, and spend
+ *                   params.service_time on each one, on average.
+ *
+ * The latency is recorded as soon as an item comes out, so it's how long
+ * the item waited in the queue, not counting its own service.
+ */
+template<typename Queue, typename T, service_distribution Distribution>
+static void service_consumer(
+		const worker_parameters<Queue, T> params){
+	const busy_work &work = calibrated_busy_work();
+	service_times<Distribution> times(params.service_time);
+
+	params.setup_done->arrive_and_wait();
+	params.start->arrive_and_wait();
+
+	for(int i = 0; i < params.num_items; i++){
+		[[maybe_unused]] const T loc = params.q->pop_wait();
+		record_item(*params.metrics, loc);
+		work(times.next());
+		consume_item(loc);
+		note_progress(*params.metrics);
+	}
+
+	params.stop->arrive_and_wait();
+}
+
+	}
+}
+#endif /* STORM_SERVICE_TIME_H */
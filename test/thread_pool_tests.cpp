@@ -0,0 +1,612 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* thread_pool_tests: Tests for the thread_pool.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <iostream>
+#include <future>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <memory>
+#include <stdexcept>
+#include <functional>
+#include <array>
+#include <numeric>
+#include <cstdint>
+#include <latch>
+#include <thread>
+#include <chrono>
+#include <new>
+
+#include "mpmc_queue.hpp"
+#include "mpmc_semaphore_queue.hpp"
+#include "unique_function.hpp"
+#include "task_future.hpp"
+#include "thread_pool.hpp"
+#include "parallel_algorithms.hpp"
+#include "task_group.hpp"
+using namespace storm;
+
+using std::cout;
+
+// Counts how many of it are alive, so we can tell unique_function
+// destroyed everything exactly once.
+struct alive_counter {
+	static inline int alive = 0;
+
+	alive_counter(){ alive++; }
+	alive_counter(const alive_counter&){ alive++; }
+	alive_counter(alive_counter&&) noexcept { alive++; }
+	~alive_counter(){ alive--; }
+};
+
+static void test_unique_function(){
+	using fn = unique_function<int()>;
+	static_assert(sizeof(fn) == cache_line_size, "unique_function should be one cache line");
+
+	const auto small = [p = std::make_unique<int>(1), c = alive_counter()](){ return *p; };
+	const auto big = [a = std::array<int, 64>{2}, c = alive_counter()](){ return a[0]; };
+	static_assert(fn::stores_inline<std::decay_t<decltype(small)>>,
+		"a unique_ptr capture should fit inline");
+	static_assert(!fn::stores_inline<std::decay_t<decltype(big)>>,
+		"a 256 byte capture shouldn't fit inline");
+
+	int result = 0;
+	{
+		fn a([p = std::make_unique<int>(1), c = alive_counter()](){ return *p; });
+		fn b([a = std::array<int, 64>{2}, c = alive_counter()](){ return a[0]; });
+		// Move them around a bit, including swapping inline with heap.
+		fn c(std::move(a));
+		swap(b, c);
+		a = std::move(b);
+		result = a() * 10 + c();
+	}
+
+	bool threw = false;
+	try{
+		fn()();
+	}catch(const std::bad_function_call&){
+		threw = true;
+	}
+
+	const fn from_null_pointer(static_cast<int(*)()>(nullptr));
+	const fn from_empty_function{std::function<int()>()};
+
+	if(result != 12)
+		cout << "unique_function called the wrong thing! " << result << '\n';
+	else if(alive_counter::alive != 2)
+		cout << "unique_function leaked or double-destroyed a callable, that's wrong! "
+		     << alive_counter::alive - 2 << '\n';
+	else if(!threw || from_null_pointer || from_empty_function)
+		cout << "empty unique_functions are wrong!\n";
+	else
+		cout << "unique_function looks good\n";
+}
+
+template<template<typename> typename Queue>
+static void test_post_and_drain(){
+	static constexpr int tasks = 10'000;
+
+	thread_pool<Queue> pool(4);
+	std::atomic<int> ran{0};
+
+	for(int i = 0; i < tasks; i++)
+		pool.post([&ran](){ ran.fetch_add(1, std::memory_order_relaxed); });
+	// Empty tasks don't count, and don't stop anybody.
+	pool.post(typename thread_pool<Queue>::task());
+	pool.post(std::function<void()>());
+	pool.drain();
+
+	if(ran.load() != tasks)
+		cout << "drain came back early! " << ran.load() << " of " << tasks << " ran\n";
+	else
+		cout << "post and drain look good\n";
+}
+
+template<template<typename> typename Queue>
+static void test_submit(){
+	thread_pool<Queue> pool(2);
+
+	task_future<int> sum = pool.submit([](const int a, const int b){ return a + b; }, 2, 3);
+	task_future<std::string> s = pool.submit([](){ return std::string("hello"); });
+	// Move-only arguments have to make it through, too.
+	task_future<int> moved = pool.submit([](const std::unique_ptr<int> p){ return *p; },
+		std::make_unique<int>(7));
+	task_future<void> thrown = pool.submit([](){ throw std::runtime_error("oops"); });
+
+	bool caught = false;
+	try{
+		thrown.get();
+	}catch(const std::runtime_error&){
+		caught = true;
+	}
+
+	if(sum.get() != 5 || s.get() != "hello" || moved.get() != 7)
+		cout << "submit results wrong!\n";
+	else if(!caught)
+		cout << "submit lost an exception, that's wrong!\n";
+	else
+		cout << "submit looks good\n";
+}
+
+template<template<typename> typename Queue>
+static void test_then(){
+	thread_pool<Queue> pool(2);
+
+	// Chained before the first task is likely done, and after.
+	task_future<std::string> chained = pool.submit([](){ return 2; })
+		.then([](const int i){ return i * 3; })
+		.then([](const int i){ return std::to_string(i); });
+	task_future<int> done = pool.submit([](){ return 4; });
+	done.wait();
+	task_future<int> late = done.then([](const int i){ return i + 1; });
+
+	// Errors skip the continuations, and come out the end.
+	std::atomic<bool> skipped{true};
+	task_future<void> thrown = pool.submit([](){ throw std::runtime_error("oops"); })
+		.then([&skipped](){ skipped = false; });
+	bool caught = false;
+	try{
+		thrown.get();
+	}catch(const std::runtime_error&){
+		caught = true;
+	}
+
+	// A promise nobody keeps shouldn't leave anybody waiting.
+	task_future<int> broken;
+	{
+		task_promise<int> p;
+		broken = p.get_future();
+	}
+	bool broke = false;
+	try{
+		broken.get();
+	}catch(const std::future_error &e){
+		broke = e.code() == std::future_errc::broken_promise;
+	}
+
+	if(chained.get() != "6" || late.get() != 5)
+		cout << "then results wrong!\n";
+	else if(!caught || !skipped)
+		cout << "then didn't pass an exception along, that's wrong!\n";
+	else if(!broke)
+		cout << "broken promise wrong!\n";
+	else if(chained.valid() || done.valid())
+		cout << "futures still valid after get and then, that's wrong!\n";
+	else
+		cout << "then and broken promises look good\n";
+}
+
+// An executor that can't take anything, like a pool that's out of memory.
+static void refuse_post(void*, unique_function<void()>&&){
+	throw std::bad_alloc();
+}
+
+static void test_refused_post(){
+	const task_executor refusing{nullptr, refuse_post};
+	const int alive_before = alive_counter::alive;
+
+	// Setting the result has to work even though the continuation can't be
+	// posted, and the future then() gave us has to break instead of hanging.
+	task_future<int> chained;
+	bool set = true;
+	{
+		task_promise<alive_counter> p(refusing);
+		chained = p.get_future().then([](alive_counter){ return 1; });
+		try{
+			p.set_from([](){ return alive_counter(); });
+		}catch(...){
+			set = false;
+		}
+	}
+	bool broke = false;
+	try{
+		chained.get();
+	}catch(const std::future_error &e){
+		broke = e.code() == std::future_errc::broken_promise;
+	}
+
+	// Chaining on a result that's already there posts right away, so then()
+	// throws what the executor threw.
+	bool thrown = false;
+	{
+		task_promise<alive_counter> p(refusing);
+		task_future<alive_counter> ready = p.get_future();
+		p.set_value();
+		try{
+			static_cast<void>(ready.then([](alive_counter){}));
+		}catch(const std::bad_alloc&){
+			thrown = true;
+		}
+	}
+
+	if(!set)
+		cout << "set_from threw when a continuation couldn't be posted, that's wrong!\n";
+	else if(!broke)
+		cout << "continuation that couldn't be posted didn't break its promise, that's wrong!\n";
+	else if(!thrown)
+		cout << "then on a ready future didn't throw the executor's error, that's wrong!\n";
+	else if(alive_counter::alive != alive_before)
+		cout << "refused posts leaked or destroyed a value twice, that's wrong!\n";
+	else
+		cout << "refused posts look good\n";
+}
+
+template<template<typename> typename Queue>
+static void test_bulk_and_nested(){
+	static constexpr int tasks = 1000;
+
+	std::atomic<int> ran{0};
+	{
+		thread_pool<Queue> pool(3);
+
+		std::vector<typename thread_pool<Queue>::task> batch;
+		for(int i = 0; i < tasks; i++)
+			batch.push_back([&ran](){ ran.fetch_add(1, std::memory_order_relaxed); });
+		pool.post_bulk(batch.begin(), batch.end());
+
+		// Tasks that post more tasks, which drain has to wait for too.
+		for(int i = 0; i < tasks; i++){
+			pool.post([&pool, &ran](){
+				pool.post([&ran](){ ran.fetch_add(1, std::memory_order_relaxed); });
+			});
+		}
+		pool.drain();
+
+		if(ran.load() != 2 * tasks)
+			cout << "bulk and nested tasks wrong! " << ran.load() << " of "
+			     << 2 * tasks << " ran\n";
+
+		// And the destructor has to drain on its own.
+		for(int i = 0; i < tasks; i++)
+			pool.post([&ran](){ ran.fetch_add(1, std::memory_order_relaxed); });
+	}
+
+	if(ran.load() != 3 * tasks)
+		cout << "destructor didn't drain, that's wrong! " << ran.load() << " of "
+		     << 3 * tasks << " ran\n";
+	else
+		cout << "bulk, nested, and destructor drain look good\n";
+}
+
+// A pool that refuses every post after the first few, like one that's run
+// out of memory.
+template<typename Pool>
+struct refusing_pool {
+	Pool &pool;
+	int allowed;
+
+	template<typename F>
+	void post(F &&f){
+		if(allowed-- <= 0)
+			throw std::bad_alloc();
+		pool.post(std::forward<F>(f));
+	}
+	bool try_run_one() noexcept {
+		return pool.try_run_one();
+	}
+	std::size_t size() const noexcept {
+		return pool.size();
+	}
+};
+
+// An mpmc_queue that throws instead of pushing while refuse is set, like
+// one that's run out of memory.
+template<typename T>
+struct refusing_queue : mpmc_queue<T> {
+	static inline std::atomic<bool> refuse{false};
+
+	void push(T &&t){
+		if(refuse.load())
+			throw std::bad_alloc();
+		mpmc_queue<T>::push(std::move(t));
+	}
+};
+
+static void test_refused_push(){
+	std::atomic<int> ran{0};
+	int refused = 0;
+	{
+		thread_pool<refusing_queue> pool(2);
+		pool.post([&ran](){ ran++; });
+
+		refusing_queue<thread_pool<refusing_queue>::task>::refuse = true;
+		try{
+			pool.post([&ran](){ ran++; });
+		}catch(const std::bad_alloc&){
+			refused++;
+		}
+		std::vector<thread_pool<refusing_queue>::task> batch;
+		batch.emplace_back([&ran](){ ran++; });
+		batch.emplace_back([&ran](){ ran++; });
+		try{
+			pool.post_bulk(batch.begin(), batch.end());
+		}catch(const std::bad_alloc&){
+			refused++;
+		}
+		refusing_queue<thread_pool<refusing_queue>::task>::refuse = false;
+
+		// Neither of those should be left counted, or this never returns.
+		pool.drain();
+	}
+
+	if(refused != 2 || ran.load() != 1)
+		cout << "refused pushes wrong! " << refused << " refused, " << ran.load() << " ran\n";
+	else
+		cout << "refused pushes look good\n";
+}
+
+template<template<typename> typename Queue>
+static void test_parallel_algorithms(){
+	static constexpr int n = 100'000;
+
+	thread_pool<Queue> pool(3);
+	bool ok = true;
+
+	for(const chunking mode : {chunking::static_chunks, chunking::guided, chunking::adaptive}){
+		for(const std::size_t grain : {std::size_t(1), std::size_t(1000), std::size_t(n * 2)}){
+			const parallel_options opts{mode, grain};
+
+			// Every index exactly once.
+			std::vector<std::atomic<int>> hits(n);
+			parallel_for(pool, 0, n, [&hits](const int i){
+				hits[std::size_t(i)].fetch_add(1, std::memory_order_relaxed);
+			}, opts);
+			for(const std::atomic<int> &h : hits)
+				ok = ok && h.load() == 1;
+
+			std::vector<std::int64_t> squares(n);
+			parallel_transform(pool, 0, n, squares.begin(), [](const int i){
+				return std::int64_t(i) * i;
+			}, opts);
+			for(int i = 0; i < n; i++)
+				ok = ok && squares[std::size_t(i)] == std::int64_t(i) * i;
+
+			// And over iterators, which get elements.
+			parallel_for(pool, squares.begin(), squares.end(), [](std::int64_t &x){ x = -x; }, opts);
+			const std::int64_t sum = parallel_reduce(pool, squares.begin(), squares.end(),
+				std::int64_t(0), std::plus<>(), opts);
+			const std::int64_t sum_of_indexes = parallel_reduce(pool, 0, n, std::int64_t(0),
+				std::plus<>(), [](const int i){ return std::int64_t(i); }, opts);
+			ok = ok && sum == std::accumulate(squares.begin(), squares.end(), std::int64_t(0)) &&
+				squares[2] == -4;
+			ok = ok && sum_of_indexes == std::int64_t(n) * (n - 1) / 2;
+		}
+	}
+	if(!ok)
+		cout << "parallel algorithm results wrong!\n";
+
+	// Empty and backwards ranges do nothing.
+	bool called = false;
+	parallel_for(pool, 5, 5, [&called](int){ called = true; });
+	parallel_for(pool, 5, 2, [&called](int){ called = true; });
+	if(called || parallel_reduce(pool, 0, 0, 7, std::plus<>()) != 7)
+		cout << "parallel algorithms on empty ranges wrong!\n";
+
+	// An exception stops the rest, and comes out here.
+	std::atomic<int> ran{0};
+	bool caught = false;
+	try{
+		parallel_for(pool, 0, n, [&ran](const int i){
+			ran.fetch_add(1, std::memory_order_relaxed);
+			if(i == 10)
+				throw std::runtime_error("oops");
+		}, parallel_options{chunking::adaptive, 1});
+	}catch(const std::runtime_error&){
+		caught = true;
+	}
+	if(!caught || ran.load() == n)
+		cout << "parallel_for didn't stop on an exception, that's wrong! ran "
+		     << ran.load() << " of " << n << '\n';
+
+	// A post that fails partway through still has to wait for the helpers
+	// that did get posted, and do what they didn't.
+	std::vector<std::atomic<int>> covered(n);
+	bool refused = false;
+	try{
+		refusing_pool<thread_pool<Queue>> refusing{pool, 1};
+		parallel_for(refusing, 0, n, [&covered](const int i){
+			covered[std::size_t(i)].fetch_add(1, std::memory_order_relaxed);
+		}, parallel_options{chunking::static_chunks, 1});
+	}catch(const std::bad_alloc&){
+		refused = true;
+	}
+	bool all_covered = true;
+	for(const std::atomic<int> &c : covered)
+		all_covered = all_covered && c.load() == 1;
+	if(!refused || !all_covered)
+		cout << "parallel_for with a refused post wrong!\n";
+
+	// From inside every worker at once, with nobody left to help.
+	std::atomic<std::int64_t> nested{0};
+	for(std::size_t w = 0; w < pool.size(); w++){
+		pool.post([&pool, &nested](){
+			nested.fetch_add(parallel_reduce(pool, 0, 1000, std::int64_t(0), std::plus<>()));
+		});
+	}
+	pool.drain();
+	if(nested.load() != std::int64_t(pool.size()) * 999 * 1000 / 2)
+		cout << "nested parallel_reduce wrong! " << nested.load() << '\n';
+	else if(ok && caught && refused && all_covered)
+		cout << "parallel algorithms look good\n";
+}
+
+// fib: the slowest way to get a Fibonacci number, with a task for every
+// call, so waits nest as deep as the recursion.
+template<typename Pool>
+static int fib(Pool &pool, const int n){
+	if(n < 2)
+		return n;
+
+	int a = 0, b = 0;
+	task_group g(pool);
+	g.run([&pool, &a, n](){ a = fib(pool, n - 1); });
+	g.run([&pool, &b, n](){ b = fib(pool, n - 2); });
+	g.wait();
+	return a + b;
+}
+
+template<template<typename> typename Queue>
+static void test_task_group(){
+	// One worker, waiting inside its own tasks the whole time, which
+	// would deadlock right away with blocking waits.
+	thread_pool<Queue> one(1);
+	const int from_outside = fib(one, 15);
+	const int from_inside = one.submit([&one](){ return fib(one, 15); }).get();
+
+	thread_pool<Queue> pool(3);
+	const int wide = fib(pool, 18);
+
+	// Exceptions come out of wait(), and the group still waits for the
+	// rest first.
+	std::atomic<int> ran{0};
+	bool caught = false;
+	{
+		task_group g(pool);
+		for(int i = 0; i < 100; i++){
+			g.run([&ran, i](){
+				ran.fetch_add(1, std::memory_order_relaxed);
+				if(i % 10 == 0)
+					throw std::runtime_error("oops");
+			});
+		}
+		try{
+			g.wait();
+		}catch(const std::runtime_error&){
+			caught = true;
+		}
+		// And then it's reusable, and doesn't throw again.
+		g.run([&ran](){ ran.fetch_add(1, std::memory_order_relaxed); });
+		g.wait();
+	}
+
+	// A run() whose post throws mustn't leave wait() waiting for it.
+	bool refused = false;
+	{
+		refusing_pool<thread_pool<Queue>> refusing{pool, 1};
+		task_group g(refusing);
+		g.run([&ran](){ ran.fetch_add(1, std::memory_order_relaxed); });
+		try{
+			g.run([&ran](){ ran.fetch_add(1, std::memory_order_relaxed); });
+		}catch(const std::bad_alloc&){
+			refused = true;
+		}
+		g.wait();
+	}
+
+	// A task that blocks until a task it posts has run, on a pool with one
+	// worker. It has that worker, so only the waiter can run the new task,
+	// and it has to notice it's there even though it was posted after the
+	// waiter found the queue empty.
+	static constexpr int posted_late_rounds = 20;
+	int posted_late = 0;
+	for(int round = 0; round < posted_late_rounds; round++){
+		std::atomic<bool> started{false};
+		std::atomic<bool> flag{false};
+		task_group g(one);
+		g.run([&one, &started, &flag](){
+			started = true;
+			started.notify_all();
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			one.post([&flag](){
+				flag = true;
+				flag.notify_all();
+			});
+			flag.wait(false);
+		});
+		started.wait(false);
+		g.wait();
+		// The posted task might still be in notify_all().
+		one.drain();
+		posted_late += flag.load();
+	}
+
+	// Tasks that all finish at once, so their counts come off the group in
+	// every order, and wait() mustn't miss the last one.
+	static constexpr int rounds = 2000;
+	int together = 0;
+	for(int round = 0; round < rounds; round++){
+		std::latch line(std::ptrdiff_t(pool.size()));
+		std::atomic<int> done{0};
+		{
+			task_group g(pool);
+			for(std::size_t i = 0; i < pool.size(); i++){
+				g.run([&line, &done](){
+					line.arrive_and_wait();
+					done.fetch_add(1, std::memory_order_relaxed);
+				});
+			}
+			g.wait();
+		}
+		together += done.load() == int(pool.size());
+	}
+
+	if(from_outside != 610 || from_inside != 610 || wide != 2584)
+		cout << "task_group fib wrong! " << from_outside << ' ' << from_inside << ' '
+		     << wide << '\n';
+	else if(!caught || ran.load() != 102)
+		cout << "task_group exceptions wrong! ran " << ran.load() << " of 102\n";
+	else if(posted_late != posted_late_rounds)
+		cout << "task_group waiter didn't help with a task posted late, that's wrong!\n";
+	else if(!refused)
+		cout << "task_group run didn't throw when its post did, that's wrong!\n";
+	else if(together != rounds)
+		cout << "task_group wait came back early! " << rounds - together << " of "
+		     << rounds << " rounds\n";
+	else
+		cout << "task_group looks good\n";
+}
+
+int main(int /* argc */, char ** /* argv */){
+	cout << "Running unique_function tests.\n";
+	test_unique_function();
+
+	cout << "Running post and drain tests.\n";
+	test_post_and_drain<mpmc_queue>();
+	cout << "And again with the semaphore queue.\n";
+	test_post_and_drain<mpmc_semaphore_queue>();
+
+	cout << "Running submit tests.\n";
+	test_submit<mpmc_queue>();
+	cout << "And again with the semaphore queue.\n";
+	test_submit<mpmc_semaphore_queue>();
+
+	cout << "Running continuation tests.\n";
+	test_then<mpmc_queue>();
+	cout << "And again with the semaphore queue.\n";
+	test_then<mpmc_semaphore_queue>();
+
+	cout << "Running refused post tests.\n";
+	test_refused_post();
+	test_refused_push();
+
+	cout << "Running parallel algorithm tests.\n";
+	test_parallel_algorithms<mpmc_queue>();
+	cout << "And again with the semaphore queue.\n";
+	test_parallel_algorithms<mpmc_semaphore_queue>();
+
+	cout << "Running task_group tests.\n";
+	test_task_group<mpmc_queue>();
+	cout << "And again with the semaphore queue.\n";
+	test_task_group<mpmc_semaphore_queue>();
+
+	cout << "Running bulk and nested task tests.\n";
+	test_bulk_and_nested<mpmc_queue>();
+	cout << "And again with the semaphore queue.\n";
+	test_bulk_and_nested<mpmc_semaphore_queue>();
+}
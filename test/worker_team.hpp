@@ -0,0 +1,170 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+
+/* worker_team: A team of pre-spawned threads for the tests and benchmarks.
+ * Copyright 2023, Douglas Storm Hill
+ *
+ * Provided under AGPLv3 (only), see LICENSE file
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef STORM_WORKER_TEAM_H
+#define STORM_WORKER_TEAM_H 1
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <latch>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+#include <pthread.h>
+#include <sched.h>
+
+namespace storm {
+	namespace test {
+
+/* worker_team: threads that stick around between tests.
+ *
+ * Each test is a phase: dispatch() hands workers 0 through n-1 a job, and
+ * wait() waits until they've all finished it. The team grows to fit the
+ * biggest phase it's been asked to run, and workers past n sit the phase
+ * out. So a whole run of scenarios and reps only pays for spawning threads
+ * once, and every test starts on threads that are already warm.
+ *
+ * Handing out a job takes a lock, but that all happens before the test's
+ * own setup latch, so none of it is in the timed part. A job that pins its
+ * thread doesn't leave it pinned for the next phase.
+ */
+class worker_team {
+public:
+	// job_function: what a worker runs, given the context from dispatch()
+	// and its own index in the phase.
+	using job_function = void (*)(void *context, int worker);
+
+	explicit worker_team(const int threads = 0){
+		grow(threads);
+	}
+
+	~worker_team(){
+		{
+			std::lock_guard<std::mutex> lock(mut);
+			quitting = true;
+		}
+		wake.notify_all();
+		for(std::thread &t : threads)
+			t.join();
+	}
+
+	// We own threads that point back at us, so no copying or moving.
+	worker_team(const worker_team&) = delete;
+	worker_team(worker_team&&) = delete;
+	worker_team& operator=(const worker_team&) = delete;
+	worker_team& operator=(worker_team&&) = delete;
+
+	[[nodiscard]] int size() const {
+		return int(threads.size());
+	}
+
+	// dispatch: start workers 0 through n-1 on job(context, i), and return
+	// without waiting for them. The last phase must have been wait()ed for.
+	void dispatch(const int n, const job_function job, void *const context){
+		grow(n);
+
+		{
+			std::lock_guard<std::mutex> lock(mut);
+			current = phase{job, context, n, std::make_shared<std::latch>(n)};
+			generation++;
+		}
+		wake.notify_all();
+	}
+
+	// dispatch: the same, with f(i) as the job. f has to stay around until
+	// wait() comes back.
+	template<typename F>
+	void dispatch(const int n, const F &f){
+		// Only ever read back as a const F.
+		dispatch(n, [](void *const context, const int worker){
+			(*static_cast<const F*>(context))(worker);
+		}, const_cast<F*>(&f));
+	}
+
+	// wait: wait for every worker in the last phase to finish its job.
+	void wait(){
+		std::shared_ptr<std::latch> done;
+		{
+			std::lock_guard<std::mutex> lock(mut);
+			done = current.done;
+		}
+		if(done)
+			done->wait();
+	}
+
+private:
+	struct phase {
+		job_function job = nullptr;
+		void *context = nullptr;
+		int participants = 0;
+		std::shared_ptr<std::latch> done;
+	};
+
+	// grow: make sure there are at least n threads.
+	void grow(const int n){
+		std::lock_guard<std::mutex> lock(mut);
+		while(int(threads.size()) < n)
+			threads.emplace_back(&worker_team::work, this, int(threads.size()), generation);
+	}
+
+	// work: the loop each thread runs, starting from the generation that
+	// was current when it was spawned.
+	void work(const int index, std::uint64_t seen){
+		// Remember where we were allowed to run, so we can go back to that
+		// after a job pins us somewhere.
+		cpu_set_t affinity;
+		CPU_ZERO(&affinity);
+		const bool have_affinity =
+			pthread_getaffinity_np(pthread_self(), sizeof(affinity), &affinity) == 0;
+
+		while(true){
+			phase p;
+			{
+				std::unique_lock<std::mutex> lock(mut);
+				wake.wait(lock, [&]{ return quitting || generation != seen; });
+				if(quitting)
+					return;
+				seen = generation;
+				p = current;
+			}
+
+			if(index >= p.participants)
+				continue;
+
+			p.job(p.context, index);
+			if(have_affinity)
+				pthread_setaffinity_np(pthread_self(), sizeof(affinity), &affinity);
+			p.done->count_down();
+		}
+	}
+
+	std::mutex mut;
+	std::condition_variable wake;
+	// Bumped for every phase, so sleeping workers can tell there's a new one.
+	std::uint64_t generation = 0;
+	phase current;
+	bool quitting = false;
+	std::vector<std::thread> threads;
+};
+
+	}
+}
+#endif /* STORM_WORKER_TEAM_H */